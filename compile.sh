@@ -6,4 +6,4 @@
 #COMPILER=gcc
 COMPILER=aarch64-linux-gnu-gcc
 
-$COMPILER -g3 -O3 -Wall src/main.c -o rpi_fan_util
+$COMPILER -g3 -O3 -Wall src/*.c -o rpi_fan_util -pthread -ldl -lm
@@ -0,0 +1,70 @@
+/*
+ *  file: ramp_policy.c
+ *
+ *  Example policy plugin. Linear ramp between two temperatures with a minimal duty cycle
+ *  and a hysteresis, so the fan does not slow down on every small temperature drop.
+ *
+ *  Build and use it with:
+ *
+ *      gcc -shared -fPIC -O2 -Isrc examples/ramp_policy.c -o ramp_policy.so
+ *
+ *      plugin = /path/to/ramp_policy.so
+ *      plugin_args = 45 75 0.2 2.0     # low C, high C, minimal duty, hysteresis C
+ *
+ * */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rpifan_plugin.h"
+
+struct ramp {
+    double low, high, min_duty, hyst;
+    double held;        // Temperature the current duty cycle was computed for.
+};
+
+static int ramp_init(void **ctx, const char *args) {
+    struct ramp *r = calloc(1, sizeof(*r));
+
+    if(r == NULL)
+        return -1;
+    r->low = 45.0;
+    r->high = 75.0;
+    r->min_duty = 0.2;
+    r->hyst = 2.0;
+    if(args != NULL && *args != '\0')
+        sscanf(args, "%lf %lf %lf %lf", &r->low, &r->high, &r->min_duty, &r->hyst);
+    if(r->high <= r->low) {
+        free(r);
+        return -1;
+    }
+
+    *ctx = r;
+    return 0;
+}
+
+static double ramp_step(void *ctx, const struct rpifan_state *st) {
+    struct ramp *r = ctx;
+    double x;
+
+    // Going up follows the temperature immediately, going down only after the hysteresis.
+    if(st->temp > r->held || st->temp < r->held - r->hyst)
+        r->held = st->temp;
+
+    x = (r->held - r->low) / (r->high - r->low);
+    if(x < r->min_duty)
+        x = r->held > r->low ? r->min_duty : 0.0;
+    return x > 1.0 ? 1.0 : x;
+}
+
+static void ramp_teardown(void *ctx) {
+    free(ctx);
+}
+
+const struct rpifan_plugin rpifan_plugin = {
+    .abi = RPIFAN_PLUGIN_ABI,
+    .name = "ramp",
+    .init = ramp_init,
+    .step = ramp_step,
+    .teardown = ramp_teardown,
+};
@@ -0,0 +1,788 @@
+/*
+ *  file: adaptive.c
+ *
+ *  The adaptive PWM process. Reads the thermal zones on every tick, asks the configured
+ *  policy for a new duty cycle and writes it to the driver.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <math.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "rpifan.h"
+#include "adaptive.h"
+#include "history.h"
+#include "sketch.h"
+#include "telemetry.h"
+#include "sim.h"
+#include "guard.h"
+#include "ambient.h"
+#include "hotplug.h"
+#include "wheel.h"
+#include "anomaly.h"
+#include "culprit.h"
+#include "standby.h"
+#include "i2csensor.h"
+#include "w1sensor.h"
+#include "fresh.h"
+#include "control.h"
+#include "fans.h"
+#include "deepsleep.h"
+
+#define TZ_BUF_SIZE 8
+#define TZ_PATH_SIZE (CONF_LINE_SIZE + 64)
+#define PROC_BUF_SIZE 128
+#define EPOLL_EVENTS 4
+
+// Periodic tasks, each on its own timer of the wheel.
+enum task {
+    TASK_TICK,          // Control tick: sensors, policy, PWM.
+    TASK_AMBIENT,       // External ambient sensor.
+    TASK_TELEMETRY,
+    TASK_HISTORY,       // Saving the history file.
+    TASK_STANDBY,       // Heartbeat of the owner while standing by, one-shot.
+    TASK_BEAT,          // Own heartbeat in a deep sleep without ticks.
+    TASK_FAN,           // Write of each hotplugged fan at its phase, one-shot.
+    TASK_COUNT = TASK_FAN + HOTPLUG_MAX_FANS,
+};
+
+static volatile sig_atomic_t stop = 0, dump_stats = 0, dump_history = 0;
+
+static void on_signal(int sig) {
+    if(sig == SIGUSR1)
+        dump_stats = 1;
+    else if(sig == SIGUSR2)
+        dump_history = 1;
+    else
+        stop = 1;
+}
+
+// Wall clock in milliseconds, used for the history timestamps.
+static uint64_t epoch_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static struct sketch_hour sketches[SKETCH_HOURS];
+
+static void save_history(struct history *hist, const char *path) {
+    if(hist->blocks == NULL || sketch_save(hist, path, sketches) < 0)
+        return;
+    dfprintf("History of %lu samples (%zu bytes) saved to %s.\n", hist_samples(hist), hist_bytes(hist), path);
+}
+
+// Reads the 'some avg10' CPU pressure as a fraction.
+static double read_psi(int psi_fd) {
+    char buf[PROC_BUF_SIZE];
+    char *p;
+    ssize_t n;
+
+    if(psi_fd < 0 || (n = pread(psi_fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return 0.0;
+    buf[n] = '\0';
+    p = strstr(buf, "avg10=");
+    return p != NULL ? strtod(p + 6, NULL) / 100.0 : 0.0;
+}
+
+// Reads the 1 minute load average normalized by the amount of online CPUs.
+static double read_load(int load_fd, long ncpus) {
+    char buf[PROC_BUF_SIZE];
+    ssize_t n;
+
+    if(load_fd < 0 || (n = pread(load_fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return 0.0;
+    buf[n] = '\0';
+    return strtod(buf, NULL) / ncpus;
+}
+
+// Opens the optional inputs that the policies use and that are not open yet.
+static void open_inputs(uint32_t inputs, int *psi_fd, int *load_fd) {
+    if((inputs & POLICY_IN_PSI) && *psi_fd < 0) {
+        *psi_fd = open("/proc/pressure/cpu", O_RDONLY);
+        if(*psi_fd < 0)
+            fprintf(stderr, "Unable to open CPU pressure information, 'psi' will be 0.\n");
+    }
+    if((inputs & POLICY_IN_LOAD) && *load_fd < 0)
+        *load_fd = open("/proc/loadavg", O_RDONLY);
+}
+
+// Inputs read on each tick. The inferred ambient temperature needs the load to see idling.
+static uint32_t needed_inputs(const struct policy *policy, const struct shadows *sh, const struct ambient *amb) {
+    uint32_t inputs = policy->inputs | sh->inputs;
+
+    if((inputs & POLICY_IN_AMBIENT) && amb->fd < 0)
+        inputs |= POLICY_IN_LOAD;
+    return inputs;
+}
+
+static struct fan_conf good_conf;
+
+// Manual duty cycle override and the bumpless return from it.
+struct manual {
+    double duty;            // Held while until_ns is ahead, -1 under automatic control.
+    uint64_t until_ns;
+    double offset;          // Manual minus automatic duty cycle when control went back.
+    uint64_t back_ns;
+};
+
+/*
+ * Applies the override to the policy's duty cycle. The policy keeps running meanwhile and
+ * sees the held duty cycle as the previous one, so policies that build on it (integrators,
+ * filters) continue from the held output. The rest of the gap is closed by an offset that
+ * fades out over 'manual_ramp' seconds, so the duty cycle never jumps on the way back.
+ * */
+static double manual_apply(struct manual *m, const struct fan_conf *conf, double duty, uint64_t now) {
+    uint64_t ramp_ns = conf->manual_ramp_s * 1000000000ull;
+
+    if(m->duty >= 0.0) {
+        if(now < m->until_ns)
+            return m->duty;
+        m->offset = ramp_ns ? m->duty - duty : 0.0;
+        m->back_ns = now;
+        m->duty = -1.0;
+        dfprintf("Manual duty cycle expired, returning to automatic control.\n");
+    }
+    if(m->offset == 0.0)
+        return duty;
+    if(now - m->back_ns >= ramp_ns) {
+        m->offset = 0.0;
+        return duty;
+    }
+    duty += m->offset * (1.0 - (double)(now - m->back_ns) / ramp_ns);
+    return duty < 0.0 ? 0.0 : duty > 1.0 ? 1.0 : duty;
+}
+
+// Takes an override from 'rpi_fan_util -c' or the control socket. A negative duty cycle ends it.
+static void manual_set(struct manual *m, double duty, unsigned secs, uint64_t now) {
+    // Ending it goes back through the same ramp.
+    if(duty >= 0.0 || m->duty >= 0.0)
+        m->duty = duty >= 0.0 ? duty : m->duty;
+    m->until_ns = duty >= 0.0 ? now + secs * 1000000000ull : now;
+    if(duty >= 0.0) {
+        dfprintf("Manual duty cycle %.0f %% for %u seconds.\n", duty * 100.0, secs);
+    } else {
+        dfprintf("Manual duty cycle ended.\n");
+    }
+}
+
+// Replaces the policy with the one of the known-good configuration, or the built-in curve.
+static void rollback(struct policy *policy, const struct fan_conf *conf) {
+    policy_teardown(policy);
+    if(conf_load(conf->known_good, &good_conf) < 0 || policy_init(policy, &good_conf) < 0) {
+        fprintf(stderr, "Known-good configuration is not usable, falling back to the built-in curve.\n");
+        conf_default(&good_conf);
+        policy_init(policy, &good_conf);
+    }
+}
+
+// Reads one thermal zone in millidegrees of Celsius.
+static int read_zone(int tz_fd, int64_t *mdeg) {
+    char tzbuf[TZ_BUF_SIZE];
+    ssize_t n;
+
+    if((n = pread(tz_fd, tzbuf, sizeof(tzbuf) - 1, 0)) <= 0)
+        return -1;
+    tzbuf[n] = '\0';
+    *mdeg = atoi(tzbuf);
+    return 0;
+}
+
+static void mark_due(struct wtimer *t, void *ctx) {
+    *(uint32_t*) ctx |= 1u << t->id;
+}
+
+static void add_task(struct wheel *w, struct wtimer *t, enum task id, uint64_t interval_ms, uint64_t slack_ms, uint32_t *due) {
+    *t = (struct wtimer) { .id = id, .interval = interval_ms, .slack = slack_ms, .fn = mark_due, .ctx = due };
+    wheel_add(w, t, w->now + interval_ms);
+}
+
+static void add_oneshot(struct wheel *w, struct wtimer *t, enum task id, uint64_t delay_ms, uint32_t *due) {
+    *t = (struct wtimer) { .id = id, .fn = mark_due, .ctx = due };
+    wheel_add(w, t, w->now + delay_ms);
+}
+
+// What ends a deep sleep besides its own wake-up sources, NULL if nothing did.
+static const char *wake_reason(const struct deep_sleep *ds, const struct control *ctl, const struct hotplug *hp) {
+    if(ds->woken != NULL)
+        return ds->woken;
+    if(ctl->manual_pending || ctl->wake)
+        return "control request";
+    if(hp->changed)
+        return "hotplug";
+    if(dump_stats || dump_history)
+        return "signal";
+    return NULL;
+}
+
+/*
+ * Sleeps on the timerfd until the earliest timer of the wheel and runs the wheel, which marks
+ * the due tasks. Uevents that arrive in the meantime are handled right away, so the sensor
+ * and fan sets only change between the ticks. With no timer at all, as in a deep sleep
+ * without ticks, the timerfd is disarmed and only the events end the wait.
+ * */
+static void wait_timers(int ep, int tfd, struct wheel *w, uint64_t start, struct hotplug *hp, struct control *ctl,
+        struct deep_sleep *ds) {
+    struct epoll_event evs[EPOLL_EVENTS];
+    struct itimerspec its = { 0 };
+    uint64_t when, deadline, expirations;
+    int n;
+
+    if(wheel_next(w, &when)) {
+        deadline = start + when * 1000000ull;
+        its.it_value.tv_sec = deadline / 1000000000ull;
+        its.it_value.tv_nsec = deadline % 1000000000ull;
+    }
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+    while(!stop) {
+        n = epoll_wait(ep, evs, EPOLL_EVENTS, -1);
+        for(int i = 0; i < n; i++) {
+            if(evs[i].data.fd != tfd) {
+                if(deep_handle(ds, evs[i].data.fd) < 0 && control_handle(ctl, evs[i].data.fd) < 0)
+                    hotplug_handle(hp);
+            } else if(read(tfd, &expirations, sizeof(expirations)) > 0) {
+                wheel_run(w, (now_ns() - start) / 1000000ull);
+                return;
+            }
+        }
+        if(ds->asleep && wake_reason(ds, ctl, hp) != NULL)
+            return;
+    }
+}
+
+/*
+ * Milliseconds to move the tick after the next one by, so that the ticks follow the updates of
+ * the first sensor whose cadence is known. See fresh.h.
+ * */
+static int64_t tick_shift(const struct fresh *zones, int nzones, const struct hotplug *hp, uint64_t timeout, uint64_t next_tick) {
+    const struct fresh *f = NULL;
+
+    for(int z = 0; f == NULL && z < nzones; z++)
+        f = zones[z].lo_ns ? &zones[z] : NULL;
+    for(int i = 0; f == NULL && i < hp->nsensors; i++)
+        f = hp->sensors[i].fresh.lo_ns ? &hp->sensors[i].fresh : NULL;
+    return f != NULL ? fresh_shift(f, timeout * 1000000ull, next_tick) / 1000000 : 0;
+}
+
+static const enum task periodic[] = { TASK_AMBIENT, TASK_TELEMETRY, TASK_HISTORY };
+
+/*
+ * Stretches the tick to 'sleep_interval' and suspends the other periodic tasks. Without ticks
+ * the heartbeat still goes on, so a standby can tell a sleeper from a hung process.
+ * */
+static void sleep_timers(struct wheel *w, struct wtimer *timers, const struct fan_conf *conf, uint32_t *due) {
+    wheel_del(w, &timers[TASK_TICK]);
+    for(size_t i = 0; i < sizeof(periodic) / sizeof(periodic[0]); i++) {
+        if(timers[periodic[i]].fn)
+            wheel_del(w, &timers[periodic[i]]);
+    }
+    timers[TASK_TICK].interval = conf->sleep_interval_s * 1000ull;
+    if(timers[TASK_TICK].interval)
+        wheel_add(w, &timers[TASK_TICK], w->now + timers[TASK_TICK].interval);
+    else
+        add_task(w, &timers[TASK_BEAT], TASK_BEAT, DEEP_BEAT_MS, 0, due);
+}
+
+// Back to the normal ticks from 'now', the wake-up itself runs a tick right away.
+static void wake_timers(struct wheel *w, struct wtimer *timers, uint64_t timeout, uint64_t now) {
+    wheel_del(w, &timers[TASK_TICK]);
+    wheel_del(w, &timers[TASK_BEAT]);
+    timers[TASK_TICK].interval = timeout;
+    wheel_add(w, &timers[TASK_TICK], now + timeout);
+    for(size_t i = 0; i < sizeof(periodic) / sizeof(periodic[0]); i++) {
+        if(timers[periodic[i]].fn)
+            wheel_add(w, &timers[periodic[i]], now + timers[periodic[i]].interval);
+    }
+}
+
+// This function will only be executed from a child process. The fd would be provided to child.
+void adaptive(int fd, uint64_t timeout, char *proc_name, struct fan_conf *conf, struct policy *policy, struct shadows *sh) {
+    struct rpifan_state st = {
+        .abi = RPIFAN_PLUGIN_ABI,
+        .size = sizeof(struct rpifan_state),
+        .interval_ms = timeout,
+        .ntemps = conf->nzones,
+    };
+    int tz_fds[RPIFAN_MAX_ZONES];
+    struct fresh tz_fresh[RPIFAN_MAX_ZONES];
+    uint64_t reads, skipped;
+    char tz_path[TZ_PATH_SIZE];
+    struct history hist = { 0 };
+    double hist_vals[HIST_MAX_VALUES];
+    int psi_fd = -1, load_fd = -1;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t inputs;
+    uint64_t start, tick_start, new_dc, ms;
+    int64_t mdeg;
+    double duty;
+    float sk_vals[SKETCH_NMETRICS];
+    static struct counters cnt;
+    struct counter_shard *ctr = counters_shard(&cnt);
+    static struct telemetry tel = { .sock = -1 };
+    struct sim sim;
+    uint64_t sim_ns = 0;
+    struct guard guard;
+    struct ambient amb;
+    struct hotplug hp;
+    struct epoll_event ev = { .events = EPOLLIN };
+    int ep, tfd;
+    struct wheel wheel;
+    struct wtimer timers[TASK_COUNT] = { 0 };
+    uint32_t due = 0;
+    struct standby sb;
+    struct standby_state hs;
+    struct standby_live live;
+    struct manual man = { .duty = -1.0 };
+    double manual;
+    unsigned manual_s;
+    struct anomaly an;
+    static struct culprit cul;
+    static struct i2c_sensors i2c;
+    static struct w1_sensors w1 = { .wake = -1 };
+    static struct control ctl;
+    static struct fans fans = { .dc = UINT64_MAX };
+    struct deep_sleep ds;
+    const char *why;
+    double base, w1_t;
+    int read_failed = 0, written;
+
+    setsid();
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGUSR1, on_signal);
+    signal(SIGUSR2, on_signal);
+
+    for(int z = 0; !conf->sim && z < conf->nzones; z++) {
+        snprintf(tz_path, sizeof(tz_path), "%s/class/thermal/thermal_zone%d/temp", conf->sysfs, conf->zones[z]);
+        tz_fds[z] = open(tz_path, O_RDONLY);
+        if(tz_fds[z] < 0) {
+            fprintf(stderr, "Unable to open 'thermal_zone%d' device, aborting...\n", conf->zones[z]);
+            close(fd);
+            exit(-1);
+        }
+        fresh_init(&tz_fresh[z], 0, conf->sensor_learn);
+    }
+
+    if(ambient_open(&amb, conf) < 0)
+        fprintf(stderr, "Ambient temperature will be inferred.\n");
+
+    // Only the inputs that the policies actually use are read on each tick.
+    inputs = needed_inputs(policy, sh, &amb);
+    open_inputs(inputs, &psi_fd, &load_fd);
+    if(ncpus < 1)
+        ncpus = 1;
+
+    // Temperatures in millidegrees and the written duty cycle, integral values compress best.
+    if(conf->history_kb && hist_init(&hist, conf->nzones + 1, conf->history_kb * 1024ul) < 0)
+        fprintf(stderr, "Sample history is disabled.\n");
+    if(conf->telemetry[0] != '\0' && telemetry_open(&tel, conf->telemetry, conf->board) < 0)
+        fprintf(stderr, "Telemetry is disabled.\n");
+    if(conf->sim)
+        sim_init(&sim, conf->sim_ambient, conf->sim_load);
+    if(hotplug_open(&hp, conf) < 0)
+        fprintf(stderr, "Hotplug is disabled.\n");
+    if(!conf->sim)
+        fans_sync(&fans, fd, &hp, timeout, conf->fan_stagger_ms);
+    if(i2c_open(&i2c, conf) < 0)
+        fprintf(stderr, "I2C sensors are disabled.\n");
+    if(conf->w1[0] != '\0' && w1_open(&w1, conf, &cnt) < 0)
+        fprintf(stderr, "1-Wire sensors are disabled.\n");
+
+    // One timerfd paces the ticks, the uevents are waited for next to it.
+    ep = epoll_create1(EPOLL_CLOEXEC);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    ev.data.fd = tfd;
+    if(ep < 0 || tfd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev) < 0) {
+        perror("Unable to create the tick timer, aborting");
+        exit(-1);
+    }
+    ev.data.fd = hp.sock;
+    if(hp.sock >= 0 && epoll_ctl(ep, EPOLL_CTL_ADD, hp.sock, &ev) < 0)
+        perror("Unable to wait for uevents");
+    control_init(&ctl, ep, &sb);
+    deep_open(&ds, conf, ep);
+    start = now_ns();
+
+    /*
+     * The tick is exact, the rest may be late by a part of its interval so that it can share
+     * a wake-up with the tick or with each other.
+     * */
+    wheel_init(&wheel);
+    add_task(&wheel, &timers[TASK_TICK], TASK_TICK, timeout, 0, &due);
+    if(amb.fd >= 0 && conf->ambient_s)
+        add_task(&wheel, &timers[TASK_AMBIENT], TASK_AMBIENT, conf->ambient_s * 1000ull, conf->ambient_s * 250ull, &due);
+    if(tel.sock >= 0 && conf->telemetry_s)
+        add_task(&wheel, &timers[TASK_TELEMETRY], TASK_TELEMETRY, conf->telemetry_s * 1000ull, conf->telemetry_s * 100ull, &due);
+    if(hist.blocks != NULL && conf->history_save_s)
+        add_task(&wheel, &timers[TASK_HISTORY], TASK_HISTORY, conf->history_save_s * 1000ull, conf->history_save_s * 100ull, &due);
+    guard_start(&guard, conf, epoch_ms(), &cnt);
+    anomaly_init(&an, conf);
+    if(culprit_open(&cul, conf) < 0)
+        fprintf(stderr, "Incidents will not be recorded.\n");
+    if(standby_open(&sb, conf->heartbeat, conf->standby, timeout) < 0) {
+        if(conf->standby) {
+            fprintf(stderr, "A standby can not run without the heartbeat, aborting...\n");
+            exit(-1);
+        }
+        fprintf(stderr, "Heartbeat is disabled, no standby can take over.\n");
+    }
+    if(!sb.active)
+        add_oneshot(&wheel, &timers[TASK_STANDBY], TASK_STANDBY, timeout / 4 + 1, &due);
+    else if(control_open(&ctl, conf->control) < 0 && conf->control[0] != '\0')
+        fprintf(stderr, "Control socket is disabled.\n");
+
+    sprintf(proc_name, ADAPTIVE_PROCESS);  // This changes the name of the child process.
+    dfprintf("Adaptive PWM uses '%s' policy over %d thermal zone(s).\n", policy->name, conf->nzones);
+
+    /*
+     * Until a proper signal is received, would work under the curtains.
+     *
+     * Checks the current CPU
+     * */
+    for(st.tick = 0; !stop; st.tick++) {
+        // Only the owner of the heartbeat reads and writes, a standby just watches it.
+        hs = (struct standby_state) { st.tick, st.prev_duty, st.temp_max, amb.valid ? amb.estimate : NAN };
+        if(!standby_beat(&sb, &hs)) {
+            control_close(&ctl);
+            if(!timers[TASK_STANDBY].fn)
+                add_oneshot(&wheel, &timers[TASK_STANDBY], TASK_STANDBY, timeout / 4 + 1, &due);
+            goto _sleep;
+        }
+
+        tick_start = now_ns();
+        counter_add(ctr, CNT_TICKS, 1);
+        if(conf->sim) {
+            sim_step(&sim, sim_ns ? (tick_start - sim_ns) / 1e9 : 0.0);
+            sim_ns = tick_start;
+        }
+
+        st.temp = 0.0;
+        for(int z = 0; z < conf->nzones; z++) {
+            if(conf->sim) {
+                mdeg = (int64_t)(sim.temp * 1000.0);
+            } else if(fresh_skip(&tz_fresh[z], tick_start)) {
+                mdeg = tz_fresh[z].value;   // The zone can not have updated since the last read.
+            } else if(read_zone(tz_fds[z], &mdeg) < 0) {
+                fprintf(stderr, "Unable to read data from thermal zone sensor. Retrying in %lu ms.\n", (unsigned long) timeout);
+                counter_add(ctr, CNT_READ_ERRORS, 1);
+                read_failed = 1;
+                ms = epoch_ms();
+                goto _guard;
+            } else {
+                fresh_update(&tz_fresh[z], tick_start, mdeg, timeout * 1000000ull);
+            }
+            st.temps[z] = mdeg / 1000.0;
+            hist_vals[z] = mdeg;
+            if(st.temps[z] > st.temp)
+                st.temp = st.temps[z];
+        }
+
+        // Hotplugged sensors follow the zones. One that is gone before its uevent is skipped.
+        st.ntemps = conf->nzones;
+        for(int i = 0; i < hp.nsensors; i++) {
+            if(!fresh_skip(&hp.sensors[i].fresh, tick_start)) {
+                if(read_zone(hp.sensors[i].fd, &mdeg) < 0)
+                    continue;
+                fresh_update(&hp.sensors[i].fresh, tick_start, mdeg, timeout * 1000000ull);
+            }
+            st.temps[st.ntemps] = hp.sensors[i].fresh.value / 1000.0;
+            if(st.temps[st.ntemps] > st.temp)
+                st.temp = st.temps[st.ntemps];
+            st.ntemps++;
+        }
+
+        // Then the I2C chips, all of a bus in one transaction. A missing chip only costs its reading.
+        if(i2c.nchips && i2c_read(&i2c) < 0)
+            counter_add(ctr, CNT_READ_ERRORS, 1);
+        for(int i = 0; i < i2c.nchips && st.ntemps < RPIFAN_MAX_ZONES; i++) {
+            if(!i2c.chips[i].ok)
+                continue;
+            st.temps[st.ntemps] = i2c.chips[i].temp;
+            if(st.temps[st.ntemps] > st.temp)
+                st.temp = st.temps[st.ntemps];
+            st.ntemps++;
+        }
+
+        // The 1-Wire sensors are read by their worker, the tick only takes the latest values.
+        base = st.temp;
+        ms = now_ns() / 1000000ull;
+        for(int i = 0; i < w1.nsensors && st.ntemps < RPIFAN_MAX_ZONES; i++) {
+            if(w1_temp(&w1, i, ms, base, &w1_t) < 0)
+                continue;
+            st.temps[st.ntemps] = w1_t;
+            if(w1_t > st.temp)
+                st.temp = w1_t;
+            st.ntemps++;
+        }
+
+        // The tick after the next one moves toward the updates of the sensors, see fresh.h.
+        if(!ds.asleep)
+            timers[TASK_TICK].interval = timeout + tick_shift(tz_fresh, conf->sim ? 0 : conf->nzones, &hp, timeout,
+                    start + timers[TASK_TICK].due * 1000000ull);
+
+        // This part is adaptive i.e defined the maximum dynamically.
+        if(st.temp > st.temp_max) {
+            st.temp_max = st.temp;
+            dfprintf("New maximum temperature found. Remembering: %.1f C.\n", st.temp);
+        }
+
+        st.time_ns = now_ns() - start;
+        if(inputs & POLICY_IN_PSI)
+            st.psi = read_psi(psi_fd);
+        if(conf->sim)
+            st.load = sim.load;
+        else if(inputs & POLICY_IN_LOAD)
+            st.load = read_load(load_fd, ncpus);
+        if(inputs & POLICY_IN_AMBIENT) {
+            st.ambient = ambient_update(&amb, &st);
+            st.flags = amb.valid ? st.flags | RPIFAN_STATE_AMBIENT : st.flags & ~RPIFAN_STATE_AMBIENT;
+        }
+
+        // A sensor that comes or goes moves the hottest temperature, which is no heat rise.
+        if(hp.changed)
+            anomaly_reset(&an);
+        ms = epoch_ms();
+        // Whoever is busy over the next moment is what heats the board, the worker samples it.
+        culprit_check(&cul, st.temp, ms);
+        if(anomaly_update(&an, st.temp, st.time_ns)) {
+            fprintf(stderr, "Abnormal heat rise at %.1f C, %.2f K/s.%s\n", st.temp, an.trend,
+                    an.until_ns > st.time_ns ? " Running the fan at full duty." : "");
+            dump_history = 1;   // The history up to this tick is the record of what led to it.
+            culprit_start(&cul, "abnormal heat rise", ms);
+        }
+
+        duty = policy_step(policy, &st);
+        // Either way 0 seconds holds for the configured 'manual_hold'.
+        if(standby_poll_manual(&sb, &manual, &manual_s))
+            manual_set(&man, manual, manual_s ? manual_s : conf->manual_hold_s, st.time_ns);
+        if(control_poll_manual(&ctl, &manual, &manual_s))
+            manual_set(&man, manual, manual_s ? manual_s : conf->manual_hold_s, st.time_ns);
+        duty = manual_apply(&man, conf, duty, st.time_ns);
+        // A heat rise alarm overrides even the manual duty cycle.
+        if(st.time_ns < an.until_ns)
+            duty = 1.0;
+        new_dc = (uint64_t)(duty * PWM_PERIOD);
+
+        dfprintf("CPU temperature: %.1f C. Writing new duty cycle: %ld\n", st.temp, new_dc);
+
+        // A new fan starts with whatever it had, so the value is written to all of them again.
+        if(hp.changed) {
+            hp.changed = 0;
+            if(!conf->sim)
+                fans_sync(&fans, fd, &hp, timeout, conf->fan_stagger_ms);
+        }
+
+        // The driver keeps the value, so writing the same one again is only a wasted syscall.
+        if(new_dc == fans.dc) {
+            counter_add(ctr, CNT_SUPPRESSED, 1);
+        } else {
+            fans.dc = new_dc;
+            if(conf->sim) {
+                sim.duty = duty;
+                counter_add(ctr, CNT_WRITES, 1);
+            }
+        }
+        // The configured fan right away, the others at their phases. Also any whose write failed.
+        // Writes count the ioctls that reached the configured fan, the others count their own.
+        written = conf->sim ? 0 : fans_write(&fans, 0);    //   Writing calibrated value.
+        if(written < 0) {
+            fprintf(stderr, "Unable to write value to the driver via IOCTL call.\n");
+            counter_add(ctr, CNT_WRITE_ERRORS, 1);
+        } else if(written) {
+            counter_add(ctr, CNT_WRITES, 1);
+        }
+        for(int i = 1; !conf->sim && i < fans.n; i++) {
+            if(fans.f[i].written != fans.dc && !timers[TASK_FAN + i - 1].fn)
+                add_oneshot(&wheel, &timers[TASK_FAN + i - 1], TASK_FAN + i - 1, fans.f[i].phase_ms, &due);
+        }
+        // Shadows see the same state, before the previous duty moves on to this tick's.
+        shadows_step(sh, &st, duty);
+        st.prev_duty = duty;
+
+        if(hist.blocks != NULL) {
+            hist_vals[conf->nzones] = new_dc;
+            hist_add(&hist, ms, hist_vals);
+        }
+        sk_vals[SKETCH_TEMP] = st.temp;
+        sk_vals[SKETCH_DUTY] = duty * 100.0;
+        sk_vals[SKETCH_LATENCY] = (now_ns() - tick_start) / 1000.0;
+        sketch_hour_add(sketches, ms, sk_vals);
+        if(tel.sock >= 0)
+            telemetry_sample(&tel, sk_vals);
+
+        // Live view for 'rpi_fan_util top', plain stores into the shared page.
+        live = (struct standby_live) {
+            .tick = st.tick, .time_ms = ms, .interval_ms = timeout, .ntemps = st.ntemps,
+            .temp = st.temp, .temp_max = st.temp_max, .duty = duty, .ambient = st.ambient,
+            .tick_ns = sk_vals[SKETCH_LATENCY] * 1000.0, .nfans = hp.nfans, .writes = counter_read(&cnt, CNT_WRITES),
+            .manual = man.duty, .manual_left_s = man.duty >= 0.0 ? (man.until_ns - st.time_ns) / 1000000000ull : 0,
+            .suppressed = counter_read(&cnt, CNT_SUPPRESSED),
+            .write_errors = counter_read(&cnt, CNT_WRITE_ERRORS), .read_errors = counter_read(&cnt, CNT_READ_ERRORS),
+        };
+        for(uint32_t z = 0; z < st.ntemps && z < RPIFAN_MAX_ZONES; z++)
+            live.temps[z] = st.temps[z];
+        standby_publish(&sb, &live);
+        control_publish(&ctl, &live);
+
+        // A sensor that can not be read still counts against a configuration on probation.
+_guard:
+        switch(read_failed ? guard_errors(&guard, &cnt) : guard_check(&guard, &st, &cnt, ms)) {
+            case GUARD_FAILED:
+                guard_log(&guard, ms);
+                rollback(policy, conf);
+                inputs = needed_inputs(policy, sh, &amb);
+                open_inputs(inputs, &psi_fd, &load_fd);
+                break;
+            case GUARD_PASSED:
+                guard_log(&guard, ms);
+                if(guard_promote(&guard) < 0)
+                    fprintf(stderr, "Unable to promote '%s' to the known-good configuration.\n", conf->path);
+                break;
+            default:
+                break;
+        }
+        if(read_failed) {
+            read_failed = 0;
+            goto _sleep;
+        }
+
+        // Policy cost on demand, with 'kill -USR1 <pid>'.
+        if(dump_stats) {
+            dump_stats = 0;
+            lat_print(stderr, policy->name, &policy->cost);
+            shadows_print(stderr, sh, counter_read(&cnt, CNT_WRITES));
+            counters_print(stderr, &cnt);
+            fans_print(stderr, &fans);
+            fprintf(stderr, "%lu wake-ups for %lu timer expiries.\n", wheel.wakeups, wheel.fired);
+            fprintf(stderr, "%lu heat rise alarms.\n", an.alarms);
+            reads = skipped = 0;
+            for(int z = 0; !conf->sim && z < conf->nzones; z++) {
+                reads += tz_fresh[z].reads;
+                skipped += tz_fresh[z].skipped;
+            }
+            for(int i = 0; i < hp.nsensors; i++) {
+                reads += hp.sensors[i].fresh.reads;
+                skipped += hp.sensors[i].fresh.skipped;
+            }
+            fprintf(stderr, "%lu sensor reads, %lu skipped without new data.\n", reads, skipped);
+            if(ctl.sock >= 0)
+                fprintf(stderr, "%lu control requests, %lu events dropped.\n", ctl.requests, ctl.dropped);
+            if(conf->sleep_below > 0.0)
+                fprintf(stderr, "%lu deep sleeps, %lu s asleep.\n", ds.sleeps, (unsigned long)(ds.slept_ns / 1000000000ull));
+        }
+
+        // History dump on demand, with 'kill -USR2 <pid>'.
+        if(dump_history) {
+            dump_history = 0;
+            save_history(&hist, conf->history_file);
+        }
+
+        // Idle and cool for long enough, only the long tick and the wake-up sources are left.
+        if(deep_idle(&ds, conf, st.temp, man.duty < 0.0 && man.offset == 0.0 && st.time_ns >= an.until_ns, tick_start)) {
+            save_history(&hist, conf->history_file);
+            ctl.wake = 0;
+            deep_enter(&ds, tick_start);
+            w1_park(&w1, 1);
+            sleep_timers(&wheel, timers, conf, &due);
+            dfprintf("Deep sleep at %.1f C.\n", st.temp);
+        } else if(ds.asleep && ds.below_ns == 0) {
+            deep_leave(&ds, now_ns());
+            w1_park(&w1, 0);
+            wake_timers(&wheel, timers, timeout, wheel.now);
+        }
+        // Every beat sets the normal interval, the standby must not take over from a sleeper.
+        if(ds.asleep)
+            standby_sleep(&sb, conf->sleep_interval_s ? conf->sleep_interval_s * 1000ull : DEEP_BEAT_MS);
+
+_sleep:
+        // Absolute deadlines, so the processing time does not shift the phase of the next tick.
+        while(!stop && !(due & (1u << TASK_TICK))) {
+            wait_timers(ep, tfd, &wheel, start, &hp, &ctl, &ds);
+            if((due & (1u << TASK_BEAT)) && !standby_sleep(&sb, DEEP_BEAT_MS))
+                ds.woken = "lost control of the fan";
+            if(ds.asleep && (why = wake_reason(&ds, &ctl, &hp)) != NULL) {
+                ds.woken = why;
+                ctl.wake = 0;
+                deep_leave(&ds, now_ns());
+                w1_park(&w1, 0);
+                wake_timers(&wheel, timers, timeout, (now_ns() - start) / 1000000ull);
+                due |= 1u << TASK_TICK;
+            }
+            if(due & (1u << TASK_AMBIENT))
+                ambient_read(&amb);
+            if((due & (1u << TASK_TELEMETRY)) && telemetry_push(&tel, epoch_ms(), &st, &cnt, sh, &fans) < 0)
+                counter_add(ctr, CNT_DROPS, 1);
+            if(due & (1u << TASK_HISTORY))
+                save_history(&hist, conf->history_file);
+            // A fan that went away since the tick is not written, the next tick takes the new set.
+            for(int i = 0; i < HOTPLUG_MAX_FANS; i++) {
+                if(!(due & (1u << (TASK_FAN + i))))
+                    continue;
+                timers[TASK_FAN + i].fn = NULL;
+                if(!hp.changed && i + 1 < fans.n && fans_write(&fans, i + 1) < 0)
+                    counter_add(ctr, CNT_WRITE_ERRORS, 1);
+            }
+            if(due & (1u << TASK_STANDBY)) {
+                timers[TASK_STANDBY].fn = NULL;
+                if(standby_watch(&sb, &hs)) {
+                    // Continues where the owner left off, the fans get the duty cycle again.
+                    st.tick = hs.tick;
+                    st.prev_duty = hs.prev_duty;
+                    st.temp_max = hs.temp_max > st.temp_max ? hs.temp_max : st.temp_max;
+                    if(!amb.valid && !isnan(hs.ambient)) {
+                        amb.estimate = hs.ambient;
+                        amb.valid = 1;
+                    }
+                    fans_invalidate(&fans);
+                    if(control_open(&ctl, conf->control) < 0 && conf->control[0] != '\0')
+                        fprintf(stderr, "Control socket is disabled.\n");
+                    due |= 1u << TASK_TICK;
+                } else {
+                    add_oneshot(&wheel, &timers[TASK_STANDBY], TASK_STANDBY, timeout / 4 + 1, &due);
+                }
+            }
+            due &= 1u << TASK_TICK;
+        }
+        due = 0;
+    }
+
+    dfprintf("Adaptive PWM process is stopping.\n");
+    if(debug) {
+        lat_print(stdout, policy->name, &policy->cost);
+        shadows_print(stdout, sh, counter_read(&cnt, CNT_WRITES));
+        counters_print(stdout, &cnt);
+        fans_print(stdout, &fans);
+        fprintf(stdout, "%lu wake-ups for %lu timer expiries.\n", wheel.wakeups, wheel.fired);
+    }
+    policy_teardown(policy);
+    shadows_teardown(sh);
+    save_history(&hist, conf->history_file);
+    hist_free(&hist);
+    telemetry_close(&tel);
+    ambient_close(&amb);
+    hotplug_close(&hp);
+    i2c_close(&i2c);
+    w1_close(&w1);
+    control_close(&ctl);
+    deep_close(&ds);
+    culprit_close(&cul);
+    guard_close(&guard);
+    standby_close(&sb);
+    close(tfd);
+    close(ep);
+    for(int z = 0; !conf->sim && z < conf->nzones; z++)
+        close(tz_fds[z]);
+    if(fd >= 0)
+        close(fd);
+    exit(0);
+}
@@ -0,0 +1,21 @@
+/*
+ *  file: adaptive.h
+ *
+ *  Background process that adjusts the PWM based on the temperature.
+ *
+ * */
+
+#ifndef RPIFAN_ADAPTIVE_H
+#define RPIFAN_ADAPTIVE_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "policy.h"
+#include "shadow.h"
+
+#define ADAPTIVE_PROCESS "adaptive_rpifan_pwm        "
+
+void adaptive(int fd, uint64_t timeout, char *proc_name, struct fan_conf *conf, struct policy *policy, struct shadows *sh);
+
+#endif
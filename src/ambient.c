@@ -0,0 +1,94 @@
+/*
+ *  file: ambient.c
+ *
+ *  Ambient temperature from an external sensor or inferred from the idle SoC.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+
+#include "rpifan.h"
+#include "ambient.h"
+
+#define AMBIENT_BUF_SIZE 16
+#define AMBIENT_SLOPE_TAU_S 30.0    // Filter of the temperature slope.
+#define AMBIENT_TAU_S 600.0         // Filter of the inferred ambient temperature.
+#define AMBIENT_STEADY 0.005        // Steady state below this slope in K/s.
+
+int ambient_open(struct ambient *a, const struct fan_conf *conf) {
+    memset(a, 0, sizeof(*a));
+    a->fd = -1;
+    a->rise_idle = conf->ambient_rise;
+    a->rise_load = conf->ambient_load_rise;
+    a->fan_gain = conf->ambient_fan_gain;
+    a->idle_load = conf->ambient_idle_load;
+
+    if(conf->ambient_sensor[0] != '\0') {
+        a->fd = open(conf->ambient_sensor, O_RDONLY);
+        if(a->fd < 0) {
+            fprintf(stderr, "Unable to open ambient sensor '%s'.\n", conf->ambient_sensor);
+            return -1;
+        }
+        ambient_read(a);
+    }
+    return 0;
+}
+
+/*
+ * Reads the external sensor, in millidegrees like the thermal zones and hwmon 'temp*_input'
+ * files. Air temperature is slow, so this runs on its own timer and not on every tick.
+ * */
+void ambient_read(struct ambient *a) {
+    char buf[AMBIENT_BUF_SIZE];
+    ssize_t n;
+
+    if(a->fd < 0 || (n = pread(a->fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return;
+    buf[n] = '\0';
+    a->estimate = strtol(buf, NULL, 10) / 1000.0;
+    a->valid = 1;
+}
+
+// Updates the estimate with the state of one tick and returns it.
+double ambient_update(struct ambient *a, const struct rpifan_state *st) {
+    double dt, w, sample;
+
+    if(a->fd >= 0)
+        return a->estimate;
+
+    dt = a->prev_ns ? (st->time_ns - a->prev_ns) / 1e9 : 0.0;
+    if(dt > 0.0) {
+        w = dt < AMBIENT_SLOPE_TAU_S ? dt / AMBIENT_SLOPE_TAU_S : 1.0;
+        a->slope += w * ((st->temp - a->prev_temp) / dt - a->slope);
+    }
+    a->prev_temp = st->temp;
+    a->prev_ns = st->time_ns;
+
+    // Only an idle board in a steady state follows the model closely enough. The slope filter
+    // starts from a flat line, so it has to settle first.
+    if(dt <= 0.0 || st->time_ns < AMBIENT_SLOPE_TAU_S * 1e9 || st->load > a->idle_load || fabs(a->slope) > AMBIENT_STEADY)
+        return a->estimate;
+
+    sample = st->temp - (a->rise_idle + a->rise_load * st->load) / (1.0 + a->fan_gain * st->prev_duty);
+    if(!a->valid) {
+        a->estimate = sample;
+        a->valid = 1;
+        dfprintf("Ambient temperature estimated at %.1f C.\n", sample);
+    } else {
+        w = dt < AMBIENT_TAU_S ? dt / AMBIENT_TAU_S : 1.0;
+        a->estimate += w * (sample - a->estimate);
+    }
+    return a->estimate;
+}
+
+void ambient_close(struct ambient *a) {
+    if(a->fd >= 0)
+        close(a->fd);
+    a->fd = -1;
+}
@@ -0,0 +1,42 @@
+/*
+ *  file: ambient.h
+ *
+ *  Ambient temperature estimation. Read from an external sensor when one is configured,
+ *  otherwise inferred from the SoC temperature while the board idles in a steady state.
+ *  By the thermal model (see sim.h) the SoC then sits a known amount above the air:
+ *
+ *      T - ambient = (rise_idle + rise_load * load) / (1 + fan_gain * duty)
+ *
+ *  where rise_idle is the rise at idle with the fan off, rise_load the additional one at full
+ *  load and fan_gain the ratio of the fan's conductance at full speed to the passive one. The inferred samples are filtered slowly,
+ *  air temperature changes over hours.
+ *
+ * */
+
+#ifndef RPIFAN_AMBIENT_H
+#define RPIFAN_AMBIENT_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "rpifan_plugin.h"
+
+struct ambient {
+    int fd;                 // External sensor, -1 when inferred.
+    double estimate;
+    int valid;              // Whether there is an estimate yet.
+    double rise_idle;
+    double rise_load;
+    double fan_gain;
+    double idle_load;
+    double slope;           // Filtered dT/dt in K/s.
+    double prev_temp;
+    uint64_t prev_ns;
+};
+
+int ambient_open(struct ambient *a, const struct fan_conf *conf);
+void ambient_read(struct ambient *a);
+double ambient_update(struct ambient *a, const struct rpifan_state *st);
+void ambient_close(struct ambient *a);
+
+#endif
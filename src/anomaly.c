@@ -0,0 +1,101 @@
+/*
+ *  file: anomaly.c
+ *
+ *  CUSUM on the residual of the predicted temperature.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "rpifan.h"
+#include "anomaly.h"
+
+#define ANOMALY_STEP_S 1.0          // Ticks are averaged over this, at least.
+#define ANOMALY_LEVEL_TAU_S 2.0     // Filter of the temperature level.
+#define ANOMALY_TREND_TAU_S 60.0    // Filter of the heating rate.
+#define ANOMALY_SIGMA_N 100.0       // Samples the residual size is averaged over.
+#define ANOMALY_WARMUP 10           // Samples before the sum starts.
+#define ANOMALY_CLIP 4.0            // Largest residual that updates sigma, in sigmas.
+#define ANOMALY_MIN_NOISE 0.01
+
+void anomaly_init(struct anomaly *a, const struct fan_conf *conf) {
+    memset(a, 0, sizeof(*a));
+    a->h = conf->anomaly_h;
+    a->k = conf->anomaly_k;
+    a->noise = conf->anomaly_noise > ANOMALY_MIN_NOISE ? conf->anomaly_noise : ANOMALY_MIN_NOISE;
+    a->hold_ns = conf->anomaly_full_s * 1000000000ull;
+    anomaly_reset(a);
+}
+
+// Starts over, e.g. when the set of sensors changes and the temperature jumps with it.
+void anomaly_reset(struct anomaly *a) {
+    a->trend = 0.0;
+    a->sigma = a->noise;
+    a->sum = 0.0;
+    a->acc = 0.0;
+    a->nacc = 0;
+    a->prev_ns = 0;
+    a->samples = 0;
+}
+
+static double weight(double dt, double tau) {
+    return dt < tau ? dt / tau : 1.0;
+}
+
+/*
+ * Adds the temperature of one tick. Returns 1 when it raises an alarm, after which the sum
+ * starts again from zero.
+ *
+ * Fast ticks are averaged into steps of a second, so that the thresholds do not depend on
+ * the tick interval and the sensor noise is smaller than the heating rate of a second.
+ * */
+int anomaly_update(struct anomaly *a, double temp, uint64_t time_ns) {
+    double dt, pred, r;
+
+    if(a->h <= 0.0)
+        return 0;
+    a->acc += temp;
+    a->nacc++;
+    if(a->prev_ns == 0) {
+        a->prev_ns = time_ns;
+        return 0;
+    }
+    dt = (time_ns - a->prev_ns) / 1e9;
+    if(dt < ANOMALY_STEP_S)
+        return 0;
+    temp = a->acc / a->nacc;
+    a->acc = 0.0;
+    a->nacc = 0;
+    a->prev_ns = time_ns;
+    if(a->samples++ == 0) {
+        a->level = temp;
+        return 0;
+    }
+
+    pred = a->level + a->trend * dt;
+    r = temp - pred;
+    a->level = pred + weight(dt, ANOMALY_LEVEL_TAU_S) * r;
+    a->trend += weight(dt, ANOMALY_TREND_TAU_S) * r / dt;
+
+    if(a->samples < ANOMALY_WARMUP)
+        return 0;
+
+    // Only the residuals of normal operation tell how large they usually are.
+    if(a->sum == 0.0) {
+        a->sigma += (fmin(fabs(r), ANOMALY_CLIP * a->sigma) - a->sigma) / fmin(a->samples, ANOMALY_SIGMA_N);
+        if(a->sigma < a->noise)
+            a->sigma = a->noise;
+    }
+
+    a->sum = fmax(0.0, a->sum + r / a->sigma - a->k);
+    if(a->sum <= a->h)
+        return 0;
+
+    a->sum = 0.0;
+    a->alarms++;
+    if(a->hold_ns)
+        a->until_ns = time_ns + a->hold_ns;
+    return 1;
+}
@@ -0,0 +1,45 @@
+/*
+ *  file: anomaly.h
+ *
+ *  Detection of abnormal heat rise: a runaway process, a failed fan or blocked airflow. Each
+ *  step of about a second predicts the temperature from its local level and trend (Holt's linear smoothing) and
+ *  feeds the residual, in units of its usual size, to a one sided CUSUM:
+ *
+ *      S = max(0, S + r / sigma - k)
+ *
+ *  An alarm is raised when S exceeds h. Noise and slow drifts are absorbed by k, while a
+ *  heating rate that jumps away from the prediction adds up within a few steps. Everything
+ *  is O(1) per tick.
+ *
+ * */
+
+#ifndef RPIFAN_ANOMALY_H
+#define RPIFAN_ANOMALY_H
+
+#include <stdint.h>
+
+#include "conf.h"
+
+struct anomaly {
+    double h;               // Threshold of the sum, 0 disables the detector.
+    double k;               // Allowance per step, in sigmas.
+    double noise;           // Lower bound of sigma in K.
+    uint64_t hold_ns;       // Full duty after an alarm.
+
+    double level;           // Smoothed temperature.
+    double trend;           // Smoothed heating rate in K/s.
+    double sigma;           // Mean absolute residual in K.
+    double sum;
+    double acc;             // Temperatures of the current step.
+    unsigned nacc;
+    uint64_t prev_ns;
+    unsigned samples;
+    uint64_t alarms;
+    uint64_t until_ns;      // End of the full duty state.
+};
+
+void anomaly_init(struct anomaly *a, const struct fan_conf *conf);
+void anomaly_reset(struct anomaly *a);
+int anomaly_update(struct anomaly *a, double temp, uint64_t time_ns);
+
+#endif
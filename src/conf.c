@@ -0,0 +1,407 @@
+/*
+ *  file: conf.c
+ *
+ *  Configuration file parser. Everything is checked and compiled here, so that the adaptive
+ *  process never starts with a broken configuration.
+ *
+ * */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "rpifan.h"
+#include "conf.h"
+#include "sim.h"
+
+// Cuts the leading and trailing whitespace in place.
+static char *trim(char *s) {
+    char *end;
+
+    while(isspace((unsigned char)*s))
+        s++;
+    end = s + strlen(s);
+    while(end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+static int conf_uint(unsigned *dst, const char *val, char *err, size_t errlen) {
+    char *end;
+    long v = strtol(val, &end, 10);
+
+    if(end == val || *end != '\0' || v < 0) {
+        snprintf(err, errlen, "'%s' is not a non negative integer", val);
+        return -1;
+    }
+    *dst = (unsigned) v;
+    return 0;
+}
+
+static int conf_double(double *dst, const char *val, char *err, size_t errlen) {
+    char *end;
+    double v = strtod(val, &end);
+
+    if(end == val || *end != '\0') {
+        snprintf(err, errlen, "'%s' is not a number", val);
+        return -1;
+    }
+    *dst = v;
+    return 0;
+}
+
+static int conf_str(char *dst, const char *val) {
+    strncpy(dst, val, CONF_LINE_SIZE - 1);
+    dst[CONF_LINE_SIZE - 1] = '\0';
+    return 0;
+}
+
+// Parses a whitespace or comma separated list of thermal zone numbers.
+static int conf_zones(struct fan_conf *conf, const char *val, char *err, size_t errlen) {
+    char *end;
+    long zone;
+
+    conf->nzones = 0;
+    while(*val != '\0') {
+        if(isspace((unsigned char)*val) || *val == ',') {
+            val++;
+            continue;
+        }
+        zone = strtol(val, &end, 10);
+        if(end == val || zone < 0) {
+            snprintf(err, errlen, "invalid thermal zone number");
+            return -1;
+        }
+        if(conf->nzones == RPIFAN_MAX_ZONES) {
+            snprintf(err, errlen, "at most %d thermal zones are supported", RPIFAN_MAX_ZONES);
+            return -1;
+        }
+        conf->zones[conf->nzones++] = (int) zone;
+        val = end;
+    }
+    return 0;
+}
+
+/*
+ * Parses a whitespace or comma separated list of 'bus:address[:chip]' I2C sensors, the chip
+ * is 'lm75' (default) or 'tmp102'.
+ * */
+static int conf_i2c(struct fan_conf *conf, const char *val, char *err, size_t errlen) {
+    struct conf_i2c *c;
+    char *end;
+    long bus, addr;
+    size_t len;
+
+    conf->ni2c = 0;
+    while(*val != '\0') {
+        if(isspace((unsigned char)*val) || *val == ',') {
+            val++;
+            continue;
+        }
+        bus = strtol(val, &end, 10);
+        if(end == val || bus < 0 || *end != ':') {
+            snprintf(err, errlen, "expected 'bus:address[:chip]' I2C sensors");
+            return -1;
+        }
+        val = end + 1;
+        addr = strtol(val, &end, 0);
+        if(end == val || addr < 0x03 || addr > 0x77) {
+            snprintf(err, errlen, "invalid I2C address");
+            return -1;
+        }
+        if(conf->ni2c == CONF_MAX_I2C) {
+            snprintf(err, errlen, "at most %d I2C sensors are supported", CONF_MAX_I2C);
+            return -1;
+        }
+        c = &conf->i2c[conf->ni2c++];
+        c->bus = (int) bus;
+        c->addr = (int) addr;
+        c->chip = CONF_I2C_LM75;
+        val = end;
+        if(*val != ':')
+            continue;
+        len = strcspn(++val, " \t,");
+        if(len == 6 && strncmp(val, "tmp102", len) == 0) {
+            c->chip = CONF_I2C_TMP102;
+        } else if(len != 4 || strncmp(val, "lm75", len) != 0) {
+            snprintf(err, errlen, "unknown I2C chip '%.*s'", (int) len, val);
+            return -1;
+        }
+        val += len;
+    }
+    return 0;
+}
+
+static int conf_set(struct fan_conf *conf, const char *key, const char *val, char *err, size_t errlen) {
+    if(strcmp(key, "duty") == 0) {
+        if(expr_compile(&conf->duty, val, err, errlen) < 0)
+            return -1;
+        conf->has_duty = 1;
+        return conf_str(conf->duty_src, val);
+    }
+
+    if(strcmp(key, "plugin") == 0)
+        return conf_str(conf->plugin, val);
+
+    if(strcmp(key, "plugin_args") == 0)
+        return conf_str(conf->plugin_args, val);
+
+    if(strcmp(key, "zones") == 0)
+        return conf_zones(conf, val, err, errlen);
+
+    if(strcmp(key, "history_kb") == 0)
+        return conf_uint(&conf->history_kb, val, err, errlen);
+
+    if(strcmp(key, "history_file") == 0)
+        return conf_str(conf->history_file, val);
+
+    if(strcmp(key, "history_save") == 0)
+        return conf_uint(&conf->history_save_s, val, err, errlen);
+
+    if(strcmp(key, "device") == 0) {
+        conf->sim = strcmp(val, SIM_DEVICE) == 0;
+        return conf_str(conf->device, val);
+    }
+
+    if(strcmp(key, "sim_load") == 0)
+        return conf_double(&conf->sim_load, val, err, errlen);
+
+    if(strcmp(key, "sim_ambient") == 0)
+        return conf_double(&conf->sim_ambient, val, err, errlen);
+
+    if(strcmp(key, "telemetry") == 0)
+        return conf_str(conf->telemetry, val);
+
+    if(strcmp(key, "telemetry_interval") == 0)
+        return conf_uint(&conf->telemetry_s, val, err, errlen);
+
+    if(strcmp(key, "board") == 0)
+        return conf_str(conf->board, val);
+
+    if(strcmp(key, "shadow") == 0) {
+        if(conf->nshadows == CONF_MAX_SHADOWS) {
+            snprintf(err, errlen, "at most %d shadow policies are supported", CONF_MAX_SHADOWS);
+            return -1;
+        }
+        return conf_str(conf->shadows[conf->nshadows++], val);
+    }
+
+    if(strcmp(key, "probation") == 0)
+        return conf_uint(&conf->probation_s, val, err, errlen);
+
+    if(strcmp(key, "guard_temp") == 0)
+        return conf_double(&conf->guard_temp, val, err, errlen);
+
+    if(strcmp(key, "guard_above") == 0)
+        return conf_double(&conf->guard_above, val, err, errlen);
+
+    if(strcmp(key, "guard_above_s") == 0)
+        return conf_uint(&conf->guard_above_s, val, err, errlen);
+
+    if(strcmp(key, "guard_writes") == 0)
+        return conf_uint(&conf->guard_writes, val, err, errlen);
+
+    if(strcmp(key, "guard_errors") == 0)
+        return conf_uint(&conf->guard_errors, val, err, errlen);
+
+    if(strcmp(key, "known_good") == 0)
+        return conf_str(conf->known_good, val);
+
+    if(strcmp(key, "ambient_sensor") == 0)
+        return conf_str(conf->ambient_sensor, val);
+
+    if(strcmp(key, "ambient_gain") == 0)
+        return conf_double(&conf->ambient_gain, val, err, errlen);
+
+    if(strcmp(key, "ambient_ref") == 0)
+        return conf_double(&conf->ambient_ref, val, err, errlen);
+
+    if(strcmp(key, "ambient_rise") == 0)
+        return conf_double(&conf->ambient_rise, val, err, errlen);
+
+    if(strcmp(key, "ambient_load_rise") == 0)
+        return conf_double(&conf->ambient_load_rise, val, err, errlen);
+
+    if(strcmp(key, "ambient_fan_gain") == 0)
+        return conf_double(&conf->ambient_fan_gain, val, err, errlen);
+
+    if(strcmp(key, "ambient_idle_load") == 0)
+        return conf_double(&conf->ambient_idle_load, val, err, errlen);
+
+    if(strcmp(key, "ambient_interval") == 0)
+        return conf_uint(&conf->ambient_s, val, err, errlen);
+
+    if(strcmp(key, "hotplug") == 0)
+        return conf_uint(&conf->hotplug, val, err, errlen);
+
+    if(strcmp(key, "hwmon") == 0)
+        return conf_str(conf->hwmon, val);
+
+    if(strcmp(key, "i2c") == 0)
+        return conf_i2c(conf, val, err, errlen);
+
+    if(strcmp(key, "w1") == 0)
+        return conf_str(conf->w1, val);
+
+    if(strcmp(key, "w1_interval") == 0)
+        return conf_uint(&conf->w1_interval_s, val, err, errlen);
+
+    if(strcmp(key, "w1_stale") == 0)
+        return conf_uint(&conf->w1_stale_s, val, err, errlen);
+
+    if(strcmp(key, "sysfs") == 0)
+        return conf_str(conf->sysfs, val);
+
+    if(strcmp(key, "anomaly_h") == 0)
+        return conf_double(&conf->anomaly_h, val, err, errlen);
+
+    if(strcmp(key, "anomaly_k") == 0)
+        return conf_double(&conf->anomaly_k, val, err, errlen);
+
+    if(strcmp(key, "anomaly_noise") == 0)
+        return conf_double(&conf->anomaly_noise, val, err, errlen);
+
+    if(strcmp(key, "anomaly_full") == 0)
+        return conf_uint(&conf->anomaly_full_s, val, err, errlen);
+
+    if(strcmp(key, "incident_temp") == 0)
+        return conf_double(&conf->incident_temp, val, err, errlen);
+
+    if(strcmp(key, "incident_window") == 0)
+        return conf_uint(&conf->incident_window_s, val, err, errlen);
+
+    if(strcmp(key, "incident_top") == 0)
+        return conf_uint(&conf->incident_top, val, err, errlen);
+
+    if(strcmp(key, "incident_log") == 0)
+        return conf_str(conf->incident_log, val);
+
+    if(strcmp(key, "heartbeat") == 0)
+        return conf_str(conf->heartbeat, val);
+
+    if(strcmp(key, "manual_hold") == 0)
+        return conf_uint(&conf->manual_hold_s, val, err, errlen);
+
+    if(strcmp(key, "manual_ramp") == 0)
+        return conf_uint(&conf->manual_ramp_s, val, err, errlen);
+
+    if(strcmp(key, "control") == 0)
+        return conf_str(conf->control, val);
+
+    if(strcmp(key, "fan_stagger") == 0)
+        return conf_uint(&conf->fan_stagger_ms, val, err, errlen);
+
+    if(strcmp(key, "sensor_learn") == 0)
+        return conf_uint(&conf->sensor_learn, val, err, errlen);
+
+    if(strcmp(key, "sleep_below") == 0)
+        return conf_double(&conf->sleep_below, val, err, errlen);
+
+    if(strcmp(key, "sleep_after") == 0)
+        return conf_uint(&conf->sleep_after_s, val, err, errlen);
+
+    if(strcmp(key, "sleep_interval") == 0)
+        return conf_uint(&conf->sleep_interval_s, val, err, errlen);
+
+    if(strcmp(key, "sleep_psi") == 0)
+        return conf_uint(&conf->sleep_psi_ms, val, err, errlen);
+
+    snprintf(err, errlen, "unknown key '%s'", key);
+    return -1;
+}
+
+// Configuration used when no file is given: built-in curve over thermal zone 0.
+void conf_default(struct fan_conf *conf) {
+    memset(conf, 0, sizeof(*conf));
+    conf->nzones = 1;
+    conf->history_kb = CONF_HISTORY_KB;
+    strcpy(conf->history_file, CONF_HISTORY_FILE);
+    strcpy(conf->device, CONF_DEVICE);
+    conf->sim_load = 0.5;
+    conf->sim_ambient = 25.0;
+    conf->telemetry_s = CONF_TELEMETRY_S;
+    strcpy(conf->known_good, CONF_KNOWN_GOOD);
+    // Thermal model of a Raspberry Pi 4 with a small heatsink fan, as the simulated board.
+    conf->ambient_ref = 25.0;
+    conf->ambient_rise = 25.0;
+    conf->ambient_load_rise = 55.0;
+    conf->ambient_fan_gain = 3.0;
+    conf->ambient_idle_load = 0.15;
+    conf->ambient_s = 10;
+    strcpy(conf->sysfs, CONF_SYSFS);
+    conf->w1_interval_s = 5;
+    conf->w1_stale_s = 60;
+    conf->anomaly_h = 10.0;
+    conf->anomaly_k = 0.5;
+    conf->anomaly_noise = 0.1;
+    conf->incident_window_s = 300;
+    conf->incident_top = 5;
+    strcpy(conf->incident_log, CONF_INCIDENT_LOG);
+    strcpy(conf->heartbeat, CONF_HEARTBEAT);
+    conf->manual_hold_s = 600;
+    conf->manual_ramp_s = 30;
+    strcpy(conf->control, RPIFAN_CTL_SOCKET);
+    conf->sleep_after_s = 60;
+    conf->sleep_interval_s = 300;
+    conf->sleep_psi_ms = 100;
+}
+
+// Loads the configuration file. Returns -1 with an error already printed on failure.
+int conf_load(const char *path, struct fan_conf *conf) {
+    char line[CONF_LINE_SIZE], err[128];
+    char *key, *val, *p;
+    int lineno = 0;
+    FILE *f;
+
+    conf_default(conf);
+    conf_str(conf->path, path);
+
+    f = fopen(path, "r");
+    if(f == NULL) {
+        perror("Unable to open configuration file");
+        return -1;
+    }
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        key = trim(line);
+        if(*key == '\0')
+            continue;
+
+        if((p = strchr(key, '=')) == NULL) {
+            fprintf(stderr, "%s:%d: expected 'key = value'.\n", path, lineno);
+            fclose(f);
+            return -1;
+        }
+        *p = '\0';
+        key = trim(key);
+        val = trim(p + 1);
+
+        if(conf_set(conf, key, val, err, sizeof(err)) < 0) {
+            fprintf(stderr, "%s:%d: %s.\n", path, lineno, err);
+            fclose(f);
+            return -1;
+        }
+        dfprintf("Configuration: %s = %s\n", key, val);
+    }
+
+    fclose(f);
+
+    if(conf->nzones + conf->ni2c > RPIFAN_MAX_ZONES) {
+        fprintf(stderr, "%s: at most %d thermal zones and I2C sensors are supported.\n", path, RPIFAN_MAX_ZONES);
+        return -1;
+    }
+    // Without any sensor the tick would read 0 C forever and the fan would never speed up.
+    if(conf->nzones + conf->ni2c == 0 && conf->w1[0] == '\0') {
+        fprintf(stderr, "%s: no thermal zone, I2C or 1-Wire sensor is configured.\n", path);
+        return -1;
+    }
+    if(conf->has_duty && conf->plugin[0] != '\0') {
+        fprintf(stderr, "%s: 'duty' and 'plugin' can not be used together.\n", path);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ *  file: conf.h
+ *
+ *  Configuration file of the adaptive process. The file consists of 'key = value' lines,
+ *  everything after '#' is a comment.
+ *
+ * */
+
+#ifndef RPIFAN_CONF_H
+#define RPIFAN_CONF_H
+
+#include "expr.h"
+#include "rpifan_plugin.h"
+#include "rpifan_ctl.h"
+
+#define CONF_LINE_SIZE 512
+#define CONF_HISTORY_KB 256
+#define CONF_HISTORY_FILE "/var/lib/rpi_fan_util.hist"
+#define CONF_DEVICE "/dev/rpifan"
+#define CONF_TELEMETRY_S 10
+#define CONF_MAX_SHADOWS 4
+#define CONF_KNOWN_GOOD "/var/lib/rpi_fan_util.good.conf"
+#define CONF_SYSFS "/sys"
+#define CONF_INCIDENT_LOG "/var/log/rpi_fan_util.incidents"
+#define CONF_HEARTBEAT "/run/rpi_fan_util.hb"
+#define CONF_MAX_I2C 8
+
+enum conf_i2c_chip { CONF_I2C_LM75, CONF_I2C_TMP102 };
+
+// Temperature chip read directly through '/dev/i2c-<bus>'.
+struct conf_i2c {
+    int bus;
+    int addr;
+    enum conf_i2c_chip chip;
+};
+
+struct fan_conf {
+    char path[CONF_LINE_SIZE];      // File the configuration was loaded from, empty for defaults.
+
+    int has_duty;
+    char duty_src[CONF_LINE_SIZE];  // Source of the duty expression, as written.
+    struct expr duty;               // Duty expression compiled at load time.
+
+    char plugin[CONF_LINE_SIZE];    // Path to the policy plugin, empty if not used.
+    char plugin_args[CONF_LINE_SIZE];
+
+    int zones[RPIFAN_MAX_ZONES];    // Thermal zones to read, the hottest one is used.
+    int nzones;
+
+    unsigned history_kb;            // Memory for the sample history, 0 disables it.
+    char history_file[CONF_LINE_SIZE];
+    unsigned history_save_s;        // Interval of saving the history, 0 only on exit.
+
+    char device[CONF_LINE_SIZE];    // Driver device, or 'sim' for the simulated board.
+    int sim;
+    double sim_load;                // CPU utilization of the simulated board.
+    double sim_ambient;
+
+    char telemetry[CONF_LINE_SIZE]; // 'host[:port]' to push telemetry to, empty if not used.
+    unsigned telemetry_s;
+    char board[CONF_LINE_SIZE];     // Name of the board in telemetry, hostname by default.
+
+    char shadows[CONF_MAX_SHADOWS][CONF_LINE_SIZE];    // Configurations of the shadow policies.
+    int nshadows;
+
+    unsigned probation_s;           // Probation of a new configuration, 0 disables the guardrails.
+    double guard_temp;              // Limits during the probation, 0 disables each of them.
+    double guard_above;
+    unsigned guard_above_s;         // Seconds allowed above 'guard_above'.
+    unsigned guard_writes;          // PWM writes per minute.
+    unsigned guard_errors;          // Sensor and driver errors.
+    char known_good[CONF_LINE_SIZE];
+
+    char ambient_sensor[CONF_LINE_SIZE];    // Air temperature in millidegrees, empty to infer it.
+    double ambient_gain;            // Curve shift per C of ambient over 'ambient_ref', 0 disables it.
+    double ambient_ref;
+    double ambient_rise;            // SoC rise over ambient at idle with the fan off, in K.
+    double ambient_load_rise;       // Additional rise at full load.
+    double ambient_fan_gain;        // Fan conductance at full speed relative to the passive one.
+    double ambient_idle_load;       // Load under which the board counts as idle.
+    unsigned ambient_s;             // Interval of the external sensor.
+
+    unsigned hotplug;               // Follow uevents for hwmon sensors and additional fans.
+    char hwmon[CONF_LINE_SIZE];     // Names of the hwmon chips used as sensors.
+    char sysfs[CONF_LINE_SIZE];
+
+    struct conf_i2c i2c[CONF_MAX_I2C];  // Chips without a hwmon driver, after the hwmon sensors.
+    int ni2c;
+
+    char w1[CONF_LINE_SIZE];        // Ids of the 1-Wire sensors, read by a worker thread.
+    unsigned w1_interval_s;
+    unsigned w1_stale_s;            // Age at which a 1-Wire reading stops counting.
+
+    double anomaly_h;               // CUSUM threshold of the heat rise detector, 0 disables it.
+    double anomaly_k;               // Allowance per second, in sigmas of the residual.
+    double anomaly_noise;           // Lower bound of the residual sigma in K.
+    unsigned anomaly_full_s;        // Full duty after an alarm, 0 only reports it.
+
+    double incident_temp;           // Temperature that starts an incident, 0 for alarms only.
+    unsigned incident_window_s;     // At most one incident per window.
+    unsigned incident_top;          // Processes and cgroups recorded per incident.
+    char incident_log[CONF_LINE_SIZE];
+
+    char heartbeat[CONF_LINE_SIZE]; // Shared heartbeat of the primary and the standby.
+    int standby;                    // Started as the hot standby, set by -S.
+
+    unsigned manual_hold_s;         // How long a manual duty cycle holds by default.
+    unsigned manual_ramp_s;         // Return from the manual to the automatic duty cycle.
+
+    char control[CONF_LINE_SIZE];   // Unix socket of the binary control protocol, empty if not used.
+
+    unsigned fan_stagger_ms;        // Between the writes of consecutive fans, 0 spreads them evenly.
+    unsigned sensor_learn;          // Learn the cadence of sensors that do not tell it.
+
+    double sleep_below;             // Deep sleep below this temperature, 0 disables it.
+    unsigned sleep_after_s;         // Time below it before the sleep starts.
+    unsigned sleep_interval_s;      // Tick interval while asleep, 0 for none at all.
+    unsigned sleep_psi_ms;          // CPU stall per second that wakes the sleep, 0 to ignore it.
+};
+
+void conf_default(struct fan_conf *conf);
+int conf_load(const char *path, struct fan_conf *conf);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ *  file: control.c
+ *
+ *  Control socket of the adaptive process.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "rpifan.h"
+#include "control.h"
+
+/*
+ * Whether a socket file that is in the way may be replaced: it is a socket nobody listens on
+ * any more, or the one of the process this one took control from, which may still be alive
+ * but stopped. A regular file or another instance's socket is left alone.
+ * */
+static int stale_socket(const struct control *c, const struct sockaddr_un *addr) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    struct stat st;
+    int fd, stale;
+
+    if(lstat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "'%s' is not a control socket, it is not replaced.\n", addr->sun_path);
+        return 0;
+    }
+    if((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+        return 0;
+    if(connect(fd, (const struct sockaddr*) addr, sizeof(*addr)) < 0)
+        stale = errno == ECONNREFUSED;
+    else
+        stale = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.pid != 0 && cred.pid == c->sb->from;
+    close(fd);
+    if(!stale)
+        fprintf(stderr, "Another process serves the control socket '%s'.\n", addr->sun_path);
+    return stale;
+}
+
+/*
+ * Binds the socket, only for the user of the process: it sets the fan, the same as the
+ * heartbeat. The mode is set by the umask, so the socket is never open to others.
+ * */
+static int bind_socket(struct control *c, const struct sockaddr_un *addr) {
+    struct stat sb;
+    mode_t mask = umask(0177);
+    int ret = bind(c->sock, (const struct sockaddr*) addr, sizeof(*addr));
+
+    if(ret < 0 && errno == EADDRINUSE && stale_socket(c, addr)) {
+        unlink(addr->sun_path);
+        ret = bind(c->sock, (const struct sockaddr*) addr, sizeof(*addr));
+    }
+    umask(mask);
+    if(ret < 0)
+        return -1;
+    if(stat(addr->sun_path, &sb) == 0) {
+        c->dev = sb.st_dev;
+        c->ino = sb.st_ino;
+    }
+    return 0;
+}
+
+void control_init(struct control *c, int ep, const struct standby *sb) {
+    memset(c, 0, sizeof(*c));
+    c->sock = -1;
+    c->ep = ep;
+    c->sb = sb;
+    for(int i = 0; i < CONTROL_MAX_CLIENTS; i++)
+        c->clients[i].fd = -1;
+    c->state.status = -EAGAIN;
+}
+
+// Starts serving, when the process gets control. Requests of an earlier time in control are gone.
+int control_open(struct control *c, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    if(c->sock >= 0)
+        return 0;
+    c->manual_pending = c->wake = 0;
+    c->state.status = -EAGAIN;
+    if(path[0] == '\0')
+        return -1;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Control socket path '%s' is too long.\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    c->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->sock < 0 || bind_socket(c, &addr) < 0) {
+        perror("Unable to bind the control socket");
+        goto _fail;
+    }
+    strcpy(c->path, path);
+    ev.data.fd = c->sock;
+    if(listen(c->sock, CONTROL_MAX_CLIENTS) < 0 || epoll_ctl(c->ep, EPOLL_CTL_ADD, c->sock, &ev) < 0) {
+        perror("Unable to listen on the control socket");
+        goto _fail;
+    }
+    dfprintf("Control socket listens on '%s'.\n", path);
+    return 0;
+
+_fail:
+    control_close(c);
+    return -1;
+}
+
+static void drop_client(struct control *c, struct control_client *cl) {
+    epoll_ctl(c->ep, EPOLL_CTL_DEL, cl->fd, NULL);
+    close(cl->fd);
+    cl->fd = -1;
+    cl->every = 0;
+}
+
+static void accept_clients(struct control *c) {
+    struct epoll_event ev = { .events = EPOLLIN };
+    struct control_client *cl;
+    int fd;
+
+    while((fd = accept4(c->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        cl = NULL;
+        for(int i = 0; cl == NULL && i < CONTROL_MAX_CLIENTS; i++)
+            cl = c->clients[i].fd < 0 ? &c->clients[i] : NULL;
+        ev.data.fd = fd;
+        if(cl == NULL || epoll_ctl(c->ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            dfprintf("Control socket refused a client, all %d slots are taken.\n", CONTROL_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+        *cl = (struct control_client) { .fd = fd };
+    }
+}
+
+// Replies are small and the client waits for them, one that does not fit is a client gone wrong.
+static int reply(struct control *c, struct control_client *cl, void *msg, uint16_t len, const struct rpifan_ctl_hdr *req) {
+    struct rpifan_ctl_hdr *hdr = msg;
+
+    *hdr = (struct rpifan_ctl_hdr) { .len = len, .version = RPIFAN_CTL_VERSION, .type = req->type | RPIFAN_CTL_REPLY, .seq = req->seq };
+    if(send(cl->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {
+        drop_client(c, cl);
+        return -1;
+    }
+    return 0;
+}
+
+// Serves one request. Fixed layouts, so checking the size is all the parsing there is.
+static int serve(struct control *c, struct control_client *cl, const uint8_t *buf, ssize_t n) {
+    const struct rpifan_ctl_hdr *req = (const void*) buf;
+    const struct rpifan_ctl_set_duty *sd = (const void*) buf;
+    const struct rpifan_ctl_subscribe *sub = (const void*) buf;
+    struct rpifan_ctl_status status = { .status = 0 };
+    struct rpifan_ctl_state st;
+
+    c->requests++;
+    if((size_t) n < sizeof(*req) || req->len != n) {
+        drop_client(c, cl);     // Not a message of this protocol at all.
+        return -1;
+    }
+    if(req->version != RPIFAN_CTL_VERSION) {
+        status.status = -EPROTO;
+        return reply(c, cl, &status, sizeof(status), req);
+    }
+    // Lost control since the last tick, which closes the socket. Nothing here may reach the fan.
+    if(!standby_owner(c->sb)) {
+        status.status = req->type == RPIFAN_CTL_GET_STATE ? -EAGAIN : -EBUSY;
+        return reply(c, cl, &status, sizeof(status), req);
+    }
+
+    switch(req->type) {
+        case RPIFAN_CTL_GET_STATE:
+            st = c->state;
+            return reply(c, cl, &st, sizeof(st), req);
+        case RPIFAN_CTL_SET_DUTY:
+            // NaN fails both comparisons.
+            if(n != sizeof(*sd) || !(sd->duty <= 1.0f)) {
+                status.status = -EINVAL;
+                break;
+            }
+            c->manual_pending = 1;
+            c->manual_duty = sd->duty < 0.0f ? -1.0 : sd->duty;
+            c->manual_s = sd->hold_s;
+            break;
+        case RPIFAN_CTL_WAKE:
+            c->wake = 1;
+            break;
+        case RPIFAN_CTL_SUBSCRIBE:
+            if(n != sizeof(*sub)) {
+                status.status = -EINVAL;
+                break;
+            }
+            cl->every = sub->every;
+            cl->seq = req->seq;
+            break;
+        default:
+            status.status = -EOPNOTSUPP;
+            break;
+    }
+    return reply(c, cl, &status, sizeof(status), req);
+}
+
+/*
+ * Handles a ready descriptor of the epoll. Returns -1 when it is not one of the control
+ * socket's.
+ * */
+int control_handle(struct control *c, int fd) {
+    uint8_t buf[RPIFAN_CTL_MAX_SIZE];
+    struct control_client *cl = NULL;
+    ssize_t n;
+
+    if(c->sock < 0)
+        return -1;
+    if(fd == c->sock) {
+        accept_clients(c);
+        return 0;
+    }
+    for(int i = 0; cl == NULL && i < CONTROL_MAX_CLIENTS; i++)
+        cl = c->clients[i].fd == fd ? &c->clients[i] : NULL;
+    if(cl == NULL)
+        return -1;
+
+    // Everything that is queued, a client may pipeline its requests.
+    while((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        if(serve(c, cl, buf, n) < 0)
+            return 0;
+    }
+    if(n == 0 || (errno != EAGAIN && errno != EINTR))
+        drop_client(c, cl);
+    return 0;
+}
+
+// Takes the live view of a tick for the requests until the next one and sends the events.
+void control_publish(struct control *c, const struct standby_live *live) {
+    struct rpifan_ctl_state *st = &c->state;
+    struct control_client *cl;
+
+    if(c->sock < 0)
+        return;
+    *st = (struct rpifan_ctl_state) {
+        .status = 0, .ntemps = live->ntemps, .tick = live->tick, .time_ms = live->time_ms,
+        .interval_ms = live->interval_ms, .nfans = live->nfans, .temp = live->temp,
+        .temp_max = live->temp_max, .duty = live->duty, .ambient = live->ambient,
+        .manual = live->manual, .manual_left_s = live->manual_left_s, .writes = live->writes,
+        .suppressed = live->suppressed, .write_errors = live->write_errors, .read_errors = live->read_errors,
+    };
+    memcpy(st->temps, live->temps, sizeof(st->temps));
+
+    for(int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        cl = &c->clients[i];
+        if(cl->fd < 0 || cl->every == 0 || live->tick % cl->every != 0)
+            continue;
+        st->hdr = (struct rpifan_ctl_hdr) { .len = sizeof(*st), .version = RPIFAN_CTL_VERSION, .type = RPIFAN_CTL_EVENT, .seq = cl->seq };
+        // The tick never waits for a subscriber, one that is behind misses the event.
+        if(send(cl->fd, st, sizeof(*st), MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+            if(errno == EAGAIN)
+                c->dropped++;
+            else
+                drop_client(c, cl);
+        }
+    }
+}
+
+// Hands a manual duty cycle set over the socket to the tick, once.
+int control_poll_manual(struct control *c, double *duty, unsigned *secs) {
+    if(!c->manual_pending)
+        return 0;
+    c->manual_pending = 0;
+    *duty = c->manual_duty;
+    *secs = c->manual_s;
+    return 1;
+}
+
+// Stops serving. The socket file is only removed while it is still this one.
+void control_close(struct control *c) {
+    struct stat sb;
+
+    for(int i = 0; i < CONTROL_MAX_CLIENTS; i++) {
+        if(c->clients[i].fd >= 0)
+            drop_client(c, &c->clients[i]);
+    }
+    if(c->sock >= 0)
+        close(c->sock);
+    if(c->path[0] != '\0' && stat(c->path, &sb) == 0 && sb.st_dev == c->dev && sb.st_ino == c->ino)
+        unlink(c->path);
+    c->sock = -1;
+    c->path[0] = '\0';
+    c->manual_pending = c->wake = 0;
+}
@@ -0,0 +1,57 @@
+/*
+ *  file: control.h
+ *
+ *  Control socket of the adaptive process, the server side of rpifan_ctl.h. The listening
+ *  socket and every client are waited for in the epoll of the tick, so a request is answered
+ *  as soon as it arrives from what the last tick published, without touching the sensors or
+ *  the driver. A manual duty cycle is handed to the next tick the same way as one left in the
+ *  heartbeat by 'rpi_fan_util -c'.
+ *
+ *  Only the process in control of the fan serves the socket. It binds it when it gets control,
+ *  replacing the socket of a process that lost it, and closes it when it loses control; until
+ *  then requests that need the owner are answered with -EBUSY or -EAGAIN.
+ *
+ * */
+
+#ifndef RPIFAN_CONTROL_H
+#define RPIFAN_CONTROL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rpifan_ctl.h"
+#include "standby.h"
+
+#define CONTROL_MAX_CLIENTS 8
+#define CONTROL_PATH_SIZE 108       // sun_path of a unix socket.
+
+struct control_client {
+    int fd;                         // -1 for a free slot.
+    uint32_t every;                 // Events every n ticks, 0 without a subscription.
+    uint32_t seq;                   // Of the subscribe request, carried by the events.
+};
+
+struct control {
+    int sock;                       // Listening socket, -1 when closed.
+    int ep;
+    const struct standby *sb;       // Tells whether the process is in control.
+    char path[CONTROL_PATH_SIZE];
+    dev_t dev;                      // Of the socket file, only this one is removed on close.
+    ino_t ino;
+    struct control_client clients[CONTROL_MAX_CLIENTS];
+    struct rpifan_ctl_state state;  // Of the last tick, answers GET_STATE.
+    int manual_pending;             // A SET_DUTY the tick did not take yet.
+    double manual_duty;
+    unsigned manual_s;
+    int wake;                       // A WAKE request, cleared by the adaptive process.
+    uint64_t requests, dropped;     // Requests served, events a slow subscriber missed.
+};
+
+void control_init(struct control *c, int ep, const struct standby *sb);
+int control_open(struct control *c, const char *path);
+int control_handle(struct control *c, int fd);
+void control_publish(struct control *c, const struct standby_live *live);
+int control_poll_manual(struct control *c, double *duty, unsigned *secs);
+void control_close(struct control *c);
+
+#endif
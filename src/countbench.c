@@ -0,0 +1,158 @@
+/*
+ *  file: countbench.c
+ *
+ *  Micro-benchmark of the event counters under concurrent threads. Every thread adds to a
+ *  counter in a tight loop, in three layouts:
+ *
+ *      sharded     the counters of stats.h, a padded shard per thread written with plain stores,
+ *      shared      a single counter that every thread adds to with an atomic increment,
+ *      packed      a counter per thread written like a shard, but next to each other in one
+ *                  cache line, so the line bounces between the cores all the same.
+ *
+ *  The time per increment of the sharded counters should not grow with the threads, the
+ *  other two show what the padding and the sharding save.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rpifan.h"
+#include "stats.h"
+
+#define COUNTBENCH_DEFAULT_N 50000000ull
+
+enum layout { LAYOUT_SHARDED, LAYOUT_SHARED, LAYOUT_PACKED, LAYOUT_COUNT };
+
+static const char *layout_names[LAYOUT_COUNT] = { "sharded", "shared", "packed" };
+
+struct count_run {
+    enum layout layout;
+    uint64_t n;
+    int cpu;
+    pthread_barrier_t *start;
+    uint64_t ns;
+};
+
+static struct counters sharded;
+static uint64_t shared_counter;
+static uint64_t packed[COUNTER_SHARDS] __attribute__((aligned(CACHE_LINE)));
+
+static void *count_thread(void *arg) {
+    struct count_run *r = arg;
+    struct counter_shard *s = NULL;
+    uint64_t *slot = &packed[r->cpu % COUNTER_SHARDS], t0;
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(r->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if(r->layout == LAYOUT_SHARDED)
+        s = counters_shard(&sharded);
+    pthread_barrier_wait(r->start);
+
+    t0 = now_ns();
+    switch(r->layout) {
+        case LAYOUT_SHARDED:
+            for(uint64_t i = 0; i < r->n; i++)
+                counter_add(s, CNT_TICKS, 1);
+            break;
+        case LAYOUT_SHARED:
+            for(uint64_t i = 0; i < r->n; i++)
+                __atomic_fetch_add(&shared_counter, 1, __ATOMIC_RELAXED);
+            break;
+        default:
+            for(uint64_t i = 0; i < r->n; i++)
+                __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+            break;
+    }
+    r->ns = now_ns() - t0;
+    return NULL;
+}
+
+// Runs the layout on the given amount of threads. Returns the sum the counters reached.
+static uint64_t run_layout(enum layout layout, int threads, uint64_t n, double *ns_per_add) {
+    struct count_run runs[COUNTER_SHARDS];
+    pthread_t tids[COUNTER_SHARDS];
+    pthread_barrier_t start;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t sum = 0, worst = 0;
+
+    memset(&sharded, 0, sizeof(sharded));
+    shared_counter = 0;
+    memset(packed, 0, sizeof(packed));
+    pthread_barrier_init(&start, NULL, threads);
+    for(int i = 0; i < threads; i++) {
+        runs[i] = (struct count_run) { .layout = layout, .n = n, .cpu = ncpus > 0 ? i % ncpus : 0, .start = &start };
+        pthread_create(&tids[i], NULL, count_thread, &runs[i]);
+    }
+    for(int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        worst = runs[i].ns > worst ? runs[i].ns : worst;
+    }
+    pthread_barrier_destroy(&start);
+
+    *ns_per_add = (double) worst / n;
+    switch(layout) {
+        case LAYOUT_SHARDED:
+            sum = counter_read(&sharded, CNT_TICKS);
+            break;
+        case LAYOUT_SHARED:
+            sum = shared_counter;
+            break;
+        default:
+            // Each thread owns its slot, so only the threads on distinct cpus are summed right.
+            for(int i = 0; i < COUNTER_SHARDS; i++)
+                sum += packed[i];
+            break;
+    }
+    return sum;
+}
+
+/*
+ * Counter contention benchmark, on 1 up to the given amount of threads.
+ *
+ *      rpi_fan_util countbench [-t threads] [-n increments per thread]
+ * */
+int countbench_cmd(int argc, char **argv) {
+    uint64_t n = COUNTBENCH_DEFAULT_N, sum;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = ncpus > 0 ? (int) ncpus : 1, opt;
+    double ns;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch(opt) {
+            case 't': threads = atoi(optarg); break;
+            case 'n': n = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: rpi_fan_util countbench [-t threads] [-n increments]\n");
+                return -1;
+        }
+    }
+    if(threads < 1)
+        threads = 1;
+    if(threads > COUNTER_SHARDS)
+        threads = COUNTER_SHARDS;
+    if(ncpus > 0 && threads > ncpus)
+        threads = (int) ncpus;
+    if(n == 0)
+        n = 1;
+
+    fprintf(stdout, "%-8s %8s %12s %8s\n", "layout", "threads", "ns/add", "exact");
+    for(int l = 0; l < LAYOUT_COUNT; l++) {
+        // Doubling the threads, the last step is always the full amount.
+        for(int t = 1; t <= threads; t = t < threads && t * 2 > threads ? threads : t * 2) {
+            sum = run_layout(l, t, n, &ns);
+            fprintf(stdout, "%-8s %8d %12.2f %8s\n", layout_names[l], t, ns, sum == n * t ? "yes" : "no");
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ *  file: ctl.c
+ *
+ *  Client of the binary control protocol, see rpifan_ctl.h. Only needs libc, so it can be
+ *  built into other programs as it is.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rpifan_ctl.h"
+
+int rpifan_ctl_open(struct rpifan_ctl *c, const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    memset(c, 0, sizeof(*c));
+    if(path == NULL)
+        path = RPIFAN_CTL_SOCKET;
+    if(strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+    if((c->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return -errno;
+    if(connect(c->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        int err = -errno;
+
+        close(c->fd);
+        c->fd = -1;
+        return err;
+    }
+    return 0;
+}
+
+// Sends the request and waits for its reply, keeping the events that come in between.
+static int transact(struct rpifan_ctl *c, void *req, uint16_t len, uint8_t type, void *reply, uint16_t reply_len) {
+    struct rpifan_ctl_hdr *hdr = req;
+    uint8_t buf[RPIFAN_CTL_MAX_SIZE];
+    const struct rpifan_ctl_hdr *in = (const void*) buf;
+    ssize_t n;
+
+    *hdr = (struct rpifan_ctl_hdr) { .len = len, .version = RPIFAN_CTL_VERSION, .type = type, .seq = ++c->seq };
+    if(send(c->fd, req, len, MSG_NOSIGNAL) != len)
+        return -errno;
+
+    for(;;) {
+        if((n = recv(c->fd, buf, sizeof(buf), 0)) <= 0)
+            return n < 0 ? -errno : -ECONNRESET;
+        if((size_t) n < sizeof(*in) || in->len != n || in->version != RPIFAN_CTL_VERSION)
+            return -EPROTO;
+        if(in->type == RPIFAN_CTL_EVENT && n == sizeof(c->event)) {
+            memcpy(&c->event, buf, sizeof(c->event));
+            c->has_event = 1;
+            continue;
+        }
+        if(in->seq != hdr->seq)
+            continue;   // A reply to a request that was given up on.
+        // The daemon answers anything it does not understand with a bare status.
+        if(in->type != (type | RPIFAN_CTL_REPLY) || (n != reply_len && n != sizeof(struct rpifan_ctl_status)))
+            return -EPROTO;
+        memcpy(reply, buf, n);
+        return ((const struct rpifan_ctl_status*) buf)->status;
+    }
+}
+
+int rpifan_ctl_set_duty(struct rpifan_ctl *c, double duty, unsigned hold_s) {
+    struct rpifan_ctl_set_duty req = { .duty = duty > 1.0 ? 1.0 : duty, .hold_s = hold_s };
+    struct rpifan_ctl_status reply;
+
+    return transact(c, &req, sizeof(req), RPIFAN_CTL_SET_DUTY, &reply, sizeof(reply));
+}
+
+int rpifan_ctl_get_state(struct rpifan_ctl *c, struct rpifan_ctl_state *st) {
+    struct rpifan_ctl_hdr req;
+
+    return transact(c, &req, sizeof(req), RPIFAN_CTL_GET_STATE, st, sizeof(*st));
+}
+
+int rpifan_ctl_subscribe(struct rpifan_ctl *c, unsigned every) {
+    struct rpifan_ctl_subscribe req = { .every = every };
+    struct rpifan_ctl_status reply;
+
+    return transact(c, &req, sizeof(req), RPIFAN_CTL_SUBSCRIBE, &reply, sizeof(reply));
+}
+
+// Hint of a workload that is about to start, the process returns from a deep sleep.
+int rpifan_ctl_wake(struct rpifan_ctl *c) {
+    struct rpifan_ctl_hdr req;
+    struct rpifan_ctl_status reply;
+
+    return transact(c, &req, sizeof(req), RPIFAN_CTL_WAKE, &reply, sizeof(reply));
+}
+
+// Waits for the next event of the subscription.
+int rpifan_ctl_next(struct rpifan_ctl *c, struct rpifan_ctl_state *st) {
+    uint8_t buf[RPIFAN_CTL_MAX_SIZE];
+    const struct rpifan_ctl_hdr *in = (const void*) buf;
+    ssize_t n;
+
+    if(c->has_event) {
+        c->has_event = 0;
+        *st = c->event;
+        return st->status;
+    }
+    for(;;) {
+        if((n = recv(c->fd, buf, sizeof(buf), 0)) <= 0)
+            return n < 0 ? -errno : -ECONNRESET;
+        if((size_t) n < sizeof(*in) || in->len != n || in->version != RPIFAN_CTL_VERSION)
+            return -EPROTO;
+        if(in->type == RPIFAN_CTL_EVENT && n == sizeof(*st)) {
+            memcpy(st, buf, sizeof(*st));
+            return st->status;
+        }
+    }
+}
+
+void rpifan_ctl_close(struct rpifan_ctl *c) {
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
@@ -0,0 +1,88 @@
+/*
+ *  file: ctlbench.c
+ *
+ *  Round-trip latency of the control socket of a running adaptive process, measured through
+ *  the client API of rpifan_ctl.h the same way an orchestration agent would use it.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "rpifan.h"
+#include "rpifan_ctl.h"
+#include "stats.h"
+
+#define CTLBENCH_DEFAULT_N 100000
+
+/*
+ * Control socket benchmark.
+ *
+ *      rpi_fan_util ctlbench [-s socket] [-n requests] [-d duty]
+ *
+ * Times GET_STATE round trips and, with -d, SET_DUTY round trips holding that duty cycle in
+ * percent. The override is ended again at the end.
+ * */
+int ctlbench_cmd(int argc, char **argv) {
+    const char *path = RPIFAN_CTL_SOCKET;
+    struct lat_hist get = { 0 }, set = { 0 };
+    struct rpifan_ctl c;
+    struct rpifan_ctl_state st;
+    long n = CTLBENCH_DEFAULT_N;
+    double duty = -1.0;
+    uint64_t t, start;
+    int opt, err;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "s:n:d:")) != -1) {
+        switch(opt) {
+            case 's': path = optarg; break;
+            case 'n': n = strtol(optarg, NULL, 10); break;
+            case 'd': duty = strtod(optarg, NULL) / 100.0; break;
+            default:
+                fprintf(stderr, "Usage: rpi_fan_util ctlbench [-s socket] [-n requests] [-d duty]\n");
+                return -1;
+        }
+    }
+    if((err = rpifan_ctl_open(&c, path)) < 0) {
+        fprintf(stderr, "Unable to connect to '%s': %s.\n", path, strerror(-err));
+        return -1;
+    }
+
+    start = now_ns();
+    for(long i = 0; i < n; i++) {
+        t = now_ns();
+        err = rpifan_ctl_get_state(&c, &st);
+        lat_add(&get, now_ns() - t);
+        if(err < 0 && err != -EAGAIN)
+            goto _fail;
+    }
+    fprintf(stdout, "%ld requests in %.3f s.\n", n, (now_ns() - start) / 1e9);
+    lat_print(stdout, "GET_STATE", &get);
+
+    if(duty >= 0.0 && duty <= 1.0) {
+        for(long i = 0; i < n; i++) {
+            t = now_ns();
+            err = rpifan_ctl_set_duty(&c, duty, 0);
+            lat_add(&set, now_ns() - t);
+            if(err < 0)
+                goto _fail;
+        }
+        lat_print(stdout, "SET_DUTY", &set);
+        rpifan_ctl_set_duty(&c, -1.0, 0);
+    }
+
+    if(rpifan_ctl_get_state(&c, &st) == 0)
+        fprintf(stdout, "Tick %lu: %.1f C, duty %.0f %%, %lu writes.\n", st.tick, st.temp, st.duty * 100.0, st.writes);
+    rpifan_ctl_close(&c);
+    return 0;
+
+_fail:
+    fprintf(stderr, "Control request failed: %s.\n", strerror(-err));
+    rpifan_ctl_close(&c);
+    return -1;
+}
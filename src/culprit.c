@@ -0,0 +1,286 @@
+/*
+ *  file: culprit.c
+ *
+ *  Top CPU consumers of a thermal incident, from two samples of /proc/[pid]/stat.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "rpifan.h"
+#include "culprit.h"
+
+#define CULPRIT_PATH_SIZE 32
+#define CULPRIT_CGROUP_SIZE 128
+#define CULPRIT_MAX_GROUPS 64
+#define CULPRIT_UTIME_FIELD 14      // Fields of /proc/[pid]/stat, counted from 1.
+
+struct culprit_cgroup {
+    char path[CULPRIT_CGROUP_SIZE];
+    uint64_t ticks;
+};
+
+// Reads a file of the process into the reused buffer. Returns its length or -1.
+static ssize_t read_pid_file(struct culprit *c, int pid, const char *name) {
+    char path[CULPRIT_PATH_SIZE];
+    ssize_t n;
+    int fd;
+
+    snprintf(path, sizeof(path), "%d/%s", pid, name);
+    if((fd = openat(dirfd(c->proc), path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -1;
+    n = read(fd, c->buf, sizeof(c->buf) - 1);
+    close(fd);
+    if(n <= 0)
+        return -1;
+    c->buf[n] = '\0';
+    return n;
+}
+
+// Parses the command name and utime + stime. The name may contain spaces and parentheses.
+static int parse_stat(const char *buf, struct culprit_proc *p) {
+    const char *open = strchr(buf, '('), *close = strrchr(buf, ')'), *s;
+    char *end;
+    size_t len;
+    int field = 2;
+
+    if(open == NULL || close == NULL || close < open)
+        return -1;
+    len = close - open - 1 < CULPRIT_COMM_SIZE - 1 ? close - open - 1 : CULPRIT_COMM_SIZE - 1;
+    memcpy(p->comm, open + 1, len);
+    p->comm[len] = '\0';
+
+    for(s = close + 1; *s && field < CULPRIT_UTIME_FIELD; s++) {
+        if(*s == ' ' && s[1] != ' ')
+            field++;
+    }
+    p->ticks = strtoull(s, &end, 10);
+    if(end == s)
+        return -1;
+    p->ticks += strtoull(end, NULL, 10);
+    return 0;
+}
+
+static int by_pid(const void *a, const void *b) {
+    return ((const struct culprit_proc*) a)->pid - ((const struct culprit_proc*) b)->pid;
+}
+
+static int by_ticks(const void *a, const void *b) {
+    uint64_t ta = ((const struct culprit_proc*) a)->ticks, tb = ((const struct culprit_proc*) b)->ticks;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+static int cgroup_by_ticks(const void *a, const void *b) {
+    uint64_t ta = ((const struct culprit_cgroup*) a)->ticks, tb = ((const struct culprit_cgroup*) b)->ticks;
+
+    return ta < tb ? 1 : ta > tb ? -1 : 0;
+}
+
+// Samples the CPU time of every process into 'procs', sorted by pid. Returns the amount.
+static int sample(struct culprit *c, struct culprit_proc *procs) {
+    struct dirent *de;
+    int n = 0, pid;
+
+    rewinddir(c->proc);
+    while(n < CULPRIT_MAX_PROCS && (de = readdir(c->proc)) != NULL) {
+        if(!isdigit((unsigned char) de->d_name[0]))
+            continue;
+        pid = atoi(de->d_name);
+        if(read_pid_file(c, pid, "stat") < 0 || parse_stat(c->buf, &procs[n]) < 0)
+            continue;
+        procs[n++].pid = pid;
+    }
+    qsort(procs, n, sizeof(*procs), by_pid);
+    return n;
+}
+
+// Unified hierarchy path of the process' cgroup, or the last controller's one on v1.
+static void read_cgroup(struct culprit *c, int pid, char *dst) {
+    char *line, *path = NULL, *nl;
+
+    strcpy(dst, "?");
+    if(read_pid_file(c, pid, "cgroup") < 0)
+        return;
+    for(line = c->buf; *line; line = nl + 1) {
+        if((nl = strchr(line, '\n')) != NULL)
+            *nl = '\0';
+        if((path = strchr(line, ':')) != NULL && (path = strchr(path + 1, ':')) != NULL)
+            snprintf(dst, CULPRIT_CGROUP_SIZE, "%s", path + 1);
+        if(strncmp(line, "0::", 3) == 0 || nl == NULL)
+            break;
+    }
+}
+
+// Starts an incident when the temperature crosses 'incident_temp' upwards.
+int culprit_check(struct culprit *c, double temp, uint64_t epoch_ms) {
+    double limit = c->conf->incident_temp, prev = c->prev_temp;
+    char reason[64];
+
+    c->prev_temp = temp;
+    if(limit <= 0.0 || temp < limit || prev >= limit)
+        return 0;
+    snprintf(reason, sizeof(reason), "temperature %.1f C over %.1f C", temp, limit);
+    return culprit_start(c, reason, epoch_ms);
+}
+
+/*
+ * Hands an incident to the worker, unless one was recorded in the incident window or is still
+ * being recorded. Returns 1 when it did.
+ * */
+int culprit_start(struct culprit *c, const char *reason, uint64_t epoch_ms) {
+    uint64_t one = 1;
+
+    if(!c->running || __atomic_load_n(&c->pending, __ATOMIC_ACQUIRE))
+        return 0;
+    if(c->last_ms && epoch_ms - c->last_ms < c->conf->incident_window_s * 1000ull)
+        return 0;
+    c->last_ms = epoch_ms;
+    snprintf(c->reason, sizeof(c->reason), "%s", reason);
+    __atomic_store_n(&c->pending, 1, __ATOMIC_RELEASE);
+    if(write(c->wake, &one, sizeof(one)) != sizeof(one)) {
+        __atomic_store_n(&c->pending, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Appends the top processes and cgroups by the CPU time between the samples to the incident
+ * log, in percent of one CPU.
+ * */
+static void record(struct culprit *c) {
+    static struct culprit_cgroup groups[CULPRIT_MAX_GROUPS];
+    struct culprit_proc *p, *b;
+    int n, ntop, ngroups = 0, g;
+    double scale;
+    FILE *f;
+
+    n = sample(c, c->cur);
+    scale = 100.0 / sysconf(_SC_CLK_TCK) / ((now_ns() - c->base_ns) / 1e9);
+
+    // Deltas against the first sample. A process that started in between counts from 0.
+    for(int i = 0; i < n; i++) {
+        p = &c->cur[i];
+        b = bsearch(p, c->base, c->nbase, sizeof(*p), by_pid);
+        p->ticks -= b != NULL && b->ticks <= p->ticks ? b->ticks : 0;
+    }
+    qsort(c->cur, n, sizeof(*c->cur), by_ticks);
+    ntop = n < (int) c->conf->incident_top ? n : (int) c->conf->incident_top;
+    if(ntop > CULPRIT_MAX_TOP)
+        ntop = CULPRIT_MAX_TOP;
+
+    if((f = fopen_nofollow(c->conf->incident_log, "a")) == NULL) {
+        perror("Unable to open the incident log");
+        return;
+    }
+    fprintf(f, "%lu incident: %s.\n", c->last_ms, c->reason);
+    fprintf(f, "  %8s %7s  %-15s %s\n", "pid", "cpu%", "command", "cgroup");
+    // The cgroups sum up all the busy processes, not only the top ones.
+    for(int i = 0; i < n && c->cur[i].ticks && ngroups < CULPRIT_MAX_GROUPS; i++) {
+        p = &c->cur[i];
+        read_cgroup(c, p->pid, groups[ngroups].path);
+        if(i < ntop)
+            fprintf(f, "  %8d %7.1f  %-15s %s\n", p->pid, p->ticks * scale, p->comm, groups[ngroups].path);
+        for(g = 0; g < ngroups && strcmp(groups[g].path, groups[ngroups].path) != 0; g++)
+            ;
+        if(g == ngroups)
+            groups[ngroups++].ticks = 0;
+        groups[g].ticks += p->ticks;
+    }
+    qsort(groups, ngroups, sizeof(*groups), cgroup_by_ticks);
+    fprintf(f, "  %7s  %s\n", "cpu%", "cgroup");
+    for(int i = 0; i < ngroups && i < (int) c->conf->incident_top; i++)
+        fprintf(f, "  %7.1f  %s\n", groups[i].ticks * scale, groups[i].path);
+    fclose(f);
+
+    dfprintf("Incident recorded to %s: %s, top process '%s'.\n", c->conf->incident_log, c->reason, ntop ? c->cur[0].comm : "none");
+}
+
+// Takes the two samples of each incident it is handed, a stop ends the wait between them.
+static void *worker(void *arg) {
+    struct culprit *c = arg;
+    struct pollfd pfd = { .fd = c->wake, .events = POLLIN };
+    uint64_t n;
+
+    while(poll(&pfd, 1, -1) >= 0 || errno == EINTR) {
+        if(read(c->wake, &n, sizeof(n)) < 0 || __atomic_load_n(&c->stop, __ATOMIC_ACQUIRE))
+            break;
+        if(!__atomic_load_n(&c->pending, __ATOMIC_ACQUIRE))
+            continue;
+        c->nbase = sample(c, c->base);
+        c->base_ns = now_ns();
+        if(poll(&pfd, 1, CULPRIT_SAMPLE_MS) > 0)
+            break;
+        record(c);
+        __atomic_store_n(&c->pending, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+int culprit_open(struct culprit *c, const struct fan_conf *conf) {
+    sigset_t all, old;
+    int err;
+
+    c->conf = conf;
+    c->pending = c->stop = c->running = 0;
+    c->last_ms = 0;
+    c->prev_temp = 0.0;
+    c->wake = -1;
+    c->proc = NULL;
+    // Nothing can start an incident, so neither /proc nor the worker is needed.
+    if(conf->incident_temp <= 0.0 && conf->anomaly_h <= 0.0)
+        return 0;
+    c->proc = opendir("/proc");
+    if(c->proc == NULL) {
+        perror("Unable to open /proc");
+        return -1;
+    }
+
+    // Signals stay with the control thread.
+    if((c->wake = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("Unable to create the incident wake-up");
+        culprit_close(c);
+        return -1;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&c->worker, NULL, worker, c);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0) {
+        fprintf(stderr, "Unable to start the incident worker.\n");
+        culprit_close(c);
+        return -1;
+    }
+    c->running = 1;
+    return 0;
+}
+
+void culprit_close(struct culprit *c) {
+    uint64_t one = 1;
+
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+    if(c->running && write(c->wake, &one, sizeof(one)) == sizeof(one))
+        pthread_join(c->worker, NULL);
+    c->running = 0;
+    if(c->wake >= 0)
+        close(c->wake);
+    c->wake = -1;
+    if(c->proc != NULL)
+        closedir(c->proc);
+    c->proc = NULL;
+}
@@ -0,0 +1,60 @@
+/*
+ *  file: culprit.h
+ *
+ *  Culprit attribution of thermal incidents. When the temperature crosses 'incident_temp' or
+ *  the heat rise detector raises an alarm, the CPU time of every process is sampled twice, a
+ *  second apart, and the processes and cgroups that used the most in between are appended
+ *  to the incident log. At most one incident is recorded per 'incident_window'.
+ *
+ *  A pass over /proc takes long on a busy board, so the samples are taken by a worker thread
+ *  and the tick only hands the incident over. /proc is opened once and the tables are
+ *  preallocated and reused, so an incident costs a pass over /proc/[pid]/stat per sample and
+ *  nothing in between.
+ *
+ * */
+
+#ifndef RPIFAN_CULPRIT_H
+#define RPIFAN_CULPRIT_H
+
+#include <stdint.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include "conf.h"
+
+#define CULPRIT_MAX_PROCS 2048
+#define CULPRIT_MAX_TOP 16
+#define CULPRIT_COMM_SIZE 16
+#define CULPRIT_SAMPLE_MS 1000      // Between the two samples of an incident.
+#define CULPRIT_BUF_SIZE 1024
+
+struct culprit_proc {
+    int pid;
+    uint64_t ticks;                 // utime + stime, cumulative in the samples, then the delta.
+    char comm[CULPRIT_COMM_SIZE];
+};
+
+struct culprit {
+    const struct fan_conf *conf;
+    DIR *proc;
+    struct culprit_proc base[CULPRIT_MAX_PROCS];    // First sample, sorted by pid.
+    struct culprit_proc cur[CULPRIT_MAX_PROCS];
+    int nbase;
+    uint64_t base_ns;
+    int pending;                    // Handed to the worker, until it wrote the log.
+    uint64_t last_ms;               // Start of the last incident.
+    double prev_temp;
+    char reason[128];
+    char buf[CULPRIT_BUF_SIZE];
+    int wake;                       // Eventfd of the worker: an incident, or stop.
+    int stop;
+    int running;
+    pthread_t worker;
+};
+
+int culprit_open(struct culprit *c, const struct fan_conf *conf);
+int culprit_check(struct culprit *c, double temp, uint64_t epoch_ms);
+int culprit_start(struct culprit *c, const char *reason, uint64_t epoch_ms);
+void culprit_close(struct culprit *c);
+
+#endif
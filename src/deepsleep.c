@@ -0,0 +1,206 @@
+/*
+ *  file: deepsleep.c
+ *
+ *  Wake-up sources of the deep sleep: thermal netlink events and the CPU pressure trigger.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/thermal.h>
+
+#include "rpifan.h"
+#include "deepsleep.h"
+
+#define GENL_BUF_SIZE 4096
+#define PSI_WINDOW_US 1000000
+#define NLA_DATA(a) ((char*)(a) + NLA_HDRLEN)
+
+// Attribute of the given type within [a, end), NULL if there is none.
+static struct nlattr *nla_find(struct nlattr *a, const char *end, int type) {
+    for(; (char*) a + NLA_HDRLEN <= end && a->nla_len >= NLA_HDRLEN && (char*) a + a->nla_len <= end;
+            a = (struct nlattr*)((char*) a + NLA_ALIGN(a->nla_len))) {
+        if((a->nla_type & NLA_TYPE_MASK) == type)
+            return a;
+    }
+    return NULL;
+}
+
+/*
+ * Joins the 'event' multicast group of the 'thermal' generic netlink family. Its id is only
+ * known at runtime, the generic netlink controller tells it together with the family.
+ * */
+static int genl_open(void) {
+    struct {
+        struct nlmsghdr n;
+        struct genlmsghdr g;
+        struct nlattr a;
+        char name[16];
+    } req = {
+        .n = { .nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN) + NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME),
+               .nlmsg_type = GENL_ID_CTRL, .nlmsg_flags = NLM_F_REQUEST, .nlmsg_seq = 1 },
+        .g = { .cmd = CTRL_CMD_GETFAMILY, .version = 1 },
+        .a = { .nla_len = NLA_HDRLEN + sizeof(THERMAL_GENL_FAMILY_NAME), .nla_type = CTRL_ATTR_FAMILY_NAME },
+        .name = THERMAL_GENL_FAMILY_NAME,
+    };
+    struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+    char buf[GENL_BUF_SIZE], *end;
+    struct nlmsghdr *n = (struct nlmsghdr*) buf;
+    struct nlattr *groups, *grp, *name, *id;
+    int sock, len;
+
+    if((sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC)) < 0)
+        return -1;
+    if(bind(sock, (struct sockaddr*) &sa, sizeof(sa)) < 0 || send(sock, &req, req.n.nlmsg_len, 0) < 0
+            || (len = recv(sock, buf, sizeof(buf), 0)) < (int) NLMSG_LENGTH(GENL_HDRLEN)
+            || !NLMSG_OK(n, len) || n->nlmsg_type == NLMSG_ERROR)
+        goto _fail;
+
+    // Nested: the groups, each with its name and id.
+    end = (char*) n + n->nlmsg_len;
+    groups = nla_find((struct nlattr*)((char*) NLMSG_DATA(n) + GENL_HDRLEN), end, CTRL_ATTR_MCAST_GROUPS);
+    for(grp = groups ? (struct nlattr*) NLA_DATA(groups) : NULL; grp != NULL && (char*) grp + NLA_HDRLEN <= (char*) groups + groups->nla_len;
+            grp = (struct nlattr*)((char*) grp + NLA_ALIGN(grp->nla_len))) {
+        if(grp->nla_len < NLA_HDRLEN)
+            break;
+        name = nla_find((struct nlattr*) NLA_DATA(grp), (char*) grp + grp->nla_len, CTRL_ATTR_MCAST_GRP_NAME);
+        id = nla_find((struct nlattr*) NLA_DATA(grp), (char*) grp + grp->nla_len, CTRL_ATTR_MCAST_GRP_ID);
+        if(name == NULL || id == NULL || strcmp(NLA_DATA(name), THERMAL_GENL_EVENT_GROUP_NAME) != 0)
+            continue;
+        if(setsockopt(sock, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, NLA_DATA(id), sizeof(uint32_t)) < 0)
+            break;
+        fcntl(sock, F_SETFL, O_NONBLOCK);
+        return sock;
+    }
+
+_fail:
+    close(sock);
+    return -1;
+}
+
+// Arms the trigger, 'stall_ms' of some CPU stall within a second.
+static int psi_open(unsigned stall_ms) {
+    char trig[64];
+    int fd, n;
+
+    if((fd = open("/proc/pressure/cpu", O_RDWR | O_NONBLOCK | O_CLOEXEC)) < 0)
+        return -1;
+    n = snprintf(trig, sizeof(trig), "some %u %u", stall_ms * 1000, PSI_WINDOW_US);
+    if(write(fd, trig, n + 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int deep_open(struct deep_sleep *d, const struct fan_conf *conf, int ep) {
+    memset(d, 0, sizeof(*d));
+    d->ep = ep;
+    d->genl = d->psi = -1;
+    if(conf->sleep_below <= 0.0)
+        return 0;
+    if((d->genl = genl_open()) < 0)
+        fprintf(stderr, "Thermal netlink events are not available, trip points do not wake the deep sleep.\n");
+    if(conf->sleep_psi_ms && (d->psi = psi_open(conf->sleep_psi_ms < 1000 ? conf->sleep_psi_ms : 1000)) < 0)
+        fprintf(stderr, "CPU pressure trigger is not available, load does not wake the deep sleep.\n");
+    return 0;
+}
+
+/*
+ * Follows whether the process may sleep: quiet (no override or alarm running) and below
+ * 'sleep_below'. Returns 1 once that lasted for 'sleep_after' seconds.
+ * */
+int deep_idle(struct deep_sleep *d, const struct fan_conf *conf, double temp, int quiet, uint64_t now) {
+    if(conf->sleep_below <= 0.0 || temp >= conf->sleep_below || !quiet) {
+        d->below_ns = 0;
+        return 0;
+    }
+    if(d->below_ns == 0)
+        d->below_ns = now;
+    return !d->asleep && now - d->below_ns >= conf->sleep_after_s * 1000000000ull;
+}
+
+// Drops the events of the time awake, they are no news any more.
+static void drain(struct deep_sleep *d) {
+    char buf[GENL_BUF_SIZE];
+    struct pollfd pfd = { .fd = d->psi, .events = POLLPRI };
+
+    while(d->genl >= 0 && recv(d->genl, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    if(d->psi >= 0)
+        poll(&pfd, 1, 0);
+}
+
+void deep_enter(struct deep_sleep *d, uint64_t now) {
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    drain(d);
+    ev.data.fd = d->genl;
+    if(d->genl >= 0 && epoll_ctl(d->ep, EPOLL_CTL_ADD, d->genl, &ev) < 0)
+        perror("Unable to wait for thermal events");
+    ev = (struct epoll_event) { .events = EPOLLPRI, .data.fd = d->psi };
+    if(d->psi >= 0 && epoll_ctl(d->ep, EPOLL_CTL_ADD, d->psi, &ev) < 0)
+        perror("Unable to wait for CPU pressure");
+    d->asleep = 1;
+    d->woken = NULL;
+    d->since_ns = now;
+    d->sleeps++;
+}
+
+/*
+ * Handles a ready descriptor of the epoll. Returns -1 when it is not one of the deep sleep's,
+ * otherwise sets 'woken' when it ends the sleep.
+ * */
+int deep_handle(struct deep_sleep *d, int fd) {
+    char buf[GENL_BUF_SIZE];
+    struct nlmsghdr *n;
+    struct genlmsghdr *g;
+    int len;
+
+    if(fd < 0 || (fd != d->genl && fd != d->psi))
+        return -1;
+    if(fd == d->psi) {
+        d->woken = "CPU pressure";
+        return 0;
+    }
+    while((len = recv(d->genl, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        for(n = (struct nlmsghdr*) buf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len)) {
+            if(n->nlmsg_len < NLMSG_LENGTH(GENL_HDRLEN))
+                continue;
+            g = NLMSG_DATA(n);
+            if(g->cmd == THERMAL_GENL_EVENT_TZ_TRIP_UP)
+                d->woken = "thermal trip point crossed";
+            else if(g->cmd == THERMAL_GENL_EVENT_CDEV_STATE_UPDATE && d->woken == NULL)
+                d->woken = "kernel cooling device changed";
+        }
+    }
+    return 0;
+}
+
+void deep_leave(struct deep_sleep *d, uint64_t now) {
+    if(d->genl >= 0)
+        epoll_ctl(d->ep, EPOLL_CTL_DEL, d->genl, NULL);
+    if(d->psi >= 0)
+        epoll_ctl(d->ep, EPOLL_CTL_DEL, d->psi, NULL);
+    d->asleep = 0;
+    d->below_ns = 0;
+    d->slept_ns += now - d->since_ns;
+    dfprintf("Woke from deep sleep after %lu s: %s.\n", (unsigned long)((now - d->since_ns) / 1000000000ull),
+            d->woken != NULL ? d->woken : "temperature");
+}
+
+void deep_close(struct deep_sleep *d) {
+    if(d->genl >= 0)
+        close(d->genl);
+    if(d->psi >= 0)
+        close(d->psi);
+    d->genl = d->psi = -1;
+}
@@ -0,0 +1,49 @@
+/*
+ *  file: deepsleep.h
+ *
+ *  Deep sleep of an idle board. After the hottest sensor stayed below 'sleep_below' for
+ *  'sleep_after' seconds, the adaptive process stops its periodic work: the tick is stretched
+ *  to 'sleep_interval', or stopped when that is 0 and only the heartbeat goes on. The ambient
+ *  sensor, telemetry and history timers are suspended and the 1-Wire worker is parked. The
+ *  fan keeps the duty cycle it had.
+ *
+ *  Only then the wake-up sources are waited for next to the timer:
+ *      - trip point crossings and cooling device changes of the kernel thermal framework,
+ *        on the 'event' group of the 'thermal' generic netlink family,
+ *      - a PSI trigger on /proc/pressure/cpu, 'sleep_psi' ms of stall within a second,
+ *      - workload hints: SET_DUTY and WAKE on the control socket, hotplugged devices and
+ *        signals.
+ *  Any of them, or a long tick that is not below 'sleep_below' any more, returns to the
+ *  normal ticks at once.
+ *
+ * */
+
+#ifndef RPIFAN_DEEPSLEEP_H
+#define RPIFAN_DEEPSLEEP_H
+
+#include <stdint.h>
+
+#include "conf.h"
+
+#define DEEP_BEAT_MS 60000          // Heartbeat of a deep sleep without ticks.
+
+struct deep_sleep {
+    int genl;                       // Thermal netlink events, -1 without.
+    int psi;                        // CPU pressure trigger, -1 without.
+    int ep;
+    int asleep;
+    const char *woken;              // What ended the sleep, NULL while nothing did.
+    uint64_t below_ns;              // Since when the temperature is below 'sleep_below', 0 if not.
+    uint64_t since_ns;              // Start of the current sleep.
+    uint64_t sleeps;
+    uint64_t slept_ns;
+};
+
+int deep_open(struct deep_sleep *d, const struct fan_conf *conf, int ep);
+int deep_idle(struct deep_sleep *d, const struct fan_conf *conf, double temp, int quiet, uint64_t now);
+void deep_enter(struct deep_sleep *d, uint64_t now);
+int deep_handle(struct deep_sleep *d, int fd);
+void deep_leave(struct deep_sleep *d, uint64_t now);
+void deep_close(struct deep_sleep *d);
+
+#endif
@@ -0,0 +1,357 @@
+/*
+ *  file: expr.c
+ *
+ *  Compiler and interpreter of the policy expression language.
+ *
+ *  The grammar is small on purpose:
+ *
+ *      expr    := sum [ ('<' | '>' | '<=' | '>=') sum ]
+ *      sum     := term { ('+' | '-') term }
+ *      term    := unary { ('*' | '/') unary }
+ *      unary   := '-' unary | primary
+ *      primary := number | variable | function '(' expr { ',' expr } ')' | '(' expr ')'
+ *
+ *  The recursive descent parser emits register code directly. Every parse function returns
+ *  an operand which is either a register or a known constant, so any operation over constants
+ *  only is evaluated right away and never reaches the bytecode.
+ *
+ * */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "expr.h"
+
+enum expr_op {
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_NEG,
+    OP_ABS,
+    OP_MIN,
+    OP_MAX,
+    OP_CLAMP,
+    OP_LERP,
+    OP_SEL,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+};
+
+static const char *var_names[EXPR_NVARS] = {
+    [EXPR_VAR_T] = "t",
+    [EXPR_VAR_TMAX] = "tmax",
+    [EXPR_VAR_PREV] = "prev",
+    [EXPR_VAR_PSI] = "psi",
+    [EXPR_VAR_LOAD] = "load",
+    [EXPR_VAR_TIME] = "time",
+    [EXPR_VAR_AMB] = "amb",
+};
+
+static const struct {
+    const char *name;
+    uint8_t op;
+    uint8_t nargs;
+} functions[] = {
+    { "abs",   OP_ABS,   1 },
+    { "min",   OP_MIN,   2 },
+    { "max",   OP_MAX,   2 },
+    { "clamp", OP_CLAMP, 3 },   // clamp(x, lo, hi)
+    { "lerp",  OP_LERP,  3 },   // lerp(x, a, b): position of x between a and b, in range 0..1.
+    { "if",    OP_SEL,   3 },   // if(cond, a, b): a when cond is non zero, b otherwise.
+};
+
+struct operand {
+    int reg;
+    int is_const;
+    double val;
+};
+
+struct compiler {
+    struct expr *e;
+    const char *src, *p;
+    int tmp;            // Next free temporary register.
+    int cst;            // Lowest used constant register.
+    char *err;
+    size_t errlen;
+    int failed;
+};
+
+static struct operand parse_expr(struct compiler*);
+
+// Single implementation of every operation, shared by constant folding and the interpreter.
+static inline double apply(int op, double a, double b, double c) {
+    switch(op) {
+        case OP_ADD: return a + b;
+        case OP_SUB: return a - b;
+        case OP_MUL: return a * b;
+        case OP_DIV: return b != 0.0 ? a / b : 0.0;
+        case OP_NEG: return -a;
+        case OP_ABS: return a < 0.0 ? -a : a;
+        case OP_MIN: return a < b ? a : b;
+        case OP_MAX: return a > b ? a : b;
+        case OP_CLAMP: return a < b ? b : (a > c ? c : a);
+        case OP_LERP:
+            if(c == b)
+                return a >= c ? 1.0 : 0.0;
+            a = (a - b) / (c - b);
+            return a < 0.0 ? 0.0 : (a > 1.0 ? 1.0 : a);
+        case OP_SEL: return a != 0.0 ? b : c;
+        case OP_LT: return a < b;
+        case OP_GT: return a > b;
+        case OP_LE: return a <= b;
+        case OP_GE: return a >= b;
+    }
+    return 0.0;
+}
+
+// Only the first error is reported, the rest of parsing is a no-op afterwards.
+static struct operand fail(struct compiler *c, const char *fmt, ...) {
+    struct operand none = { 0, 1, 0.0 };
+    va_list args;
+    int n;
+
+    if(!c->failed) {
+        c->failed = 1;
+        n = snprintf(c->err, c->errlen, "column %d: ", (int)(c->p - c->src) + 1);
+        if(n >= 0 && (size_t)n < c->errlen) {
+            va_start(args, fmt);
+            vsnprintf(c->err + n, c->errlen - n, fmt, args);
+            va_end(args);
+        }
+    }
+    return none;
+}
+
+static void skip_space(struct compiler *c) {
+    while(isspace((unsigned char)*c->p))
+        c->p++;
+}
+
+static int accept(struct compiler *c, char ch) {
+    skip_space(c);
+    if(*c->p == ch) {
+        c->p++;
+        return 1;
+    }
+    return 0;
+}
+
+// Places the constant into a register, reusing an existing one with the same value.
+static int const_reg(struct compiler *c, double val) {
+    for(int r = c->cst; r < EXPR_MAX_REGS; r++) {
+        if(memcmp(&c->e->regs[r], &val, sizeof(val)) == 0)
+            return r;
+    }
+    if(c->cst - 1 < c->tmp) {
+        fail(c, "expression is too complex");
+        return 0;
+    }
+    c->e->regs[--c->cst] = val;
+    return c->cst;
+}
+
+/*
+ * Emits one instruction or folds it when all operands are constant.
+ *
+ * Temporaries are consumed in stack order (the tree is emitted in post-order), so freeing the
+ * operand registers and allocating the result right after keeps the register use minimal.
+ * */
+static struct operand emit(struct compiler *c, int op, int nargs, struct operand *args) {
+    struct operand res = { 0, 1, 0.0 };
+    uint8_t regs[3] = { 0, 0, 0 };
+    int all_const = 1;
+
+    if(c->failed)
+        return res;
+
+    for(int i = 0; i < nargs; i++)
+        all_const &= args[i].is_const;
+
+    if(all_const) {
+        res.val = apply(op,
+                args[0].val,
+                nargs > 1 ? args[1].val : 0.0,
+                nargs > 2 ? args[2].val : 0.0);
+        return res;
+    }
+
+    for(int i = nargs - 1; i >= 0; i--) {
+        if(!args[i].is_const && args[i].reg >= EXPR_NVARS)
+            c->tmp--;
+    }
+    for(int i = 0; i < nargs; i++)
+        regs[i] = args[i].is_const ? const_reg(c, args[i].val) : args[i].reg;
+
+    if(c->e->ncode >= EXPR_MAX_CODE || c->tmp >= c->cst)
+        return fail(c, "expression is too complex");
+
+    res.is_const = 0;
+    res.reg = c->tmp++;
+    c->e->code[c->e->ncode++] = (struct expr_insn) {
+        .op = op, .dst = res.reg, .a = regs[0], .b = regs[1], .c = regs[2],
+    };
+    return res;
+}
+
+static struct operand parse_primary(struct compiler *c) {
+    struct operand res = { 0, 1, 0.0 }, args[3];
+    char name[16];
+    size_t len = 0;
+    char *end;
+
+    skip_space(c);
+    if(c->failed)
+        return res;
+
+    if(accept(c, '(')) {
+        res = parse_expr(c);
+        if(!accept(c, ')'))
+            return fail(c, "expected ')'");
+        return res;
+    }
+
+    if(isdigit((unsigned char)*c->p) || *c->p == '.') {
+        res.val = strtod(c->p, &end);
+        if(end == c->p)
+            return fail(c, "invalid number");
+        c->p = end;
+        return res;
+    }
+
+    if(!isalpha((unsigned char)*c->p) && *c->p != '_')
+        return fail(c, *c->p ? "unexpected '%c'" : "unexpected end of expression", *c->p);
+
+    while(isalnum((unsigned char)c->p[len]) || c->p[len] == '_')
+        len++;
+    if(len >= sizeof(name))
+        return fail(c, "identifier is too long");
+    memcpy(name, c->p, len);
+    name[len] = '\0';
+    c->p += len;
+
+    if(!accept(c, '(')) {
+        for(int v = 0; v < EXPR_NVARS; v++) {
+            if(strcmp(name, var_names[v]) == 0) {
+                c->e->uses |= 1u << v;
+                res.is_const = 0;
+                res.reg = v;
+                return res;
+            }
+        }
+        return fail(c, "unknown variable '%s'", name);
+    }
+
+    for(size_t f = 0; f < sizeof(functions) / sizeof(functions[0]); f++) {
+        if(strcmp(name, functions[f].name) != 0)
+            continue;
+
+        for(int i = 0; i < functions[f].nargs; i++) {
+            if(i > 0 && !accept(c, ','))
+                return fail(c, "function '%s' takes %d arguments", name, functions[f].nargs);
+            args[i] = parse_expr(c);
+        }
+        if(!accept(c, ')'))
+            return fail(c, "function '%s' takes %d arguments", name, functions[f].nargs);
+        return emit(c, functions[f].op, functions[f].nargs, args);
+    }
+    return fail(c, "unknown function '%s'", name);
+}
+
+static struct operand parse_unary(struct compiler *c) {
+    struct operand arg;
+
+    if(accept(c, '-')) {
+        arg = parse_unary(c);
+        return emit(c, OP_NEG, 1, &arg);
+    }
+    return parse_primary(c);
+}
+
+static struct operand parse_term(struct compiler *c) {
+    struct operand args[2];
+    int op;
+
+    args[0] = parse_unary(c);
+    for(;;) {
+        if(accept(c, '*'))
+            op = OP_MUL;
+        else if(accept(c, '/'))
+            op = OP_DIV;
+        else
+            return args[0];
+        args[1] = parse_unary(c);
+        args[0] = emit(c, op, 2, args);
+    }
+}
+
+static struct operand parse_sum(struct compiler *c) {
+    struct operand args[2];
+    int op;
+
+    args[0] = parse_term(c);
+    for(;;) {
+        if(accept(c, '+'))
+            op = OP_ADD;
+        else if(accept(c, '-'))
+            op = OP_SUB;
+        else
+            return args[0];
+        args[1] = parse_term(c);
+        args[0] = emit(c, op, 2, args);
+    }
+}
+
+static struct operand parse_expr(struct compiler *c) {
+    struct operand args[2];
+    int op;
+
+    args[0] = parse_sum(c);
+    if(accept(c, '<'))
+        op = accept(c, '=') ? OP_LE : OP_LT;
+    else if(accept(c, '>'))
+        op = accept(c, '=') ? OP_GE : OP_GT;
+    else
+        return args[0];
+    args[1] = parse_sum(c);
+    return emit(c, op, 2, args);
+}
+
+/*
+ * Compiles the expression source. On failure returns -1 and leaves a human readable
+ * message in err.
+ * */
+int expr_compile(struct expr *e, const char *src, char *err, size_t errlen) {
+    struct compiler c = {
+        .e = e, .src = src, .p = src,
+        .tmp = EXPR_NVARS, .cst = EXPR_MAX_REGS,
+        .err = err, .errlen = errlen,
+    };
+    struct operand res;
+
+    memset(e, 0, sizeof(*e));
+    res = parse_expr(&c);
+    skip_space(&c);
+    if(!c.failed && *c.p != '\0')
+        fail(&c, "unexpected '%c'", *c.p);
+
+    if(!c.failed)
+        e->out = res.is_const ? const_reg(&c, res.val) : res.reg;
+    return c.failed ? -1 : 0;
+}
+
+// Runs the compiled code. Called on every tick, so this must stay small.
+double expr_eval(struct expr *e, const double *vars) {
+    double *r = e->regs;
+    const struct expr_insn *in = e->code, *end = e->code + e->ncode;
+
+    memcpy(r, vars, EXPR_NVARS * sizeof(double));
+    for(; in < end; in++)
+        r[in->dst] = apply(in->op, r[in->a], r[in->b], r[in->c]);
+    return r[e->out];
+}
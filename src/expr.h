@@ -0,0 +1,62 @@
+/*
+ *  file: expr.h
+ *
+ *  Policy expression language. A control law written in the configuration file, e.g.
+ *
+ *      duty = clamp(lerp(t, 45, 75), 0.2, 1.0) + 0.3*psi
+ *
+ *  is compiled once at load time into a small register bytecode (constants are folded
+ *  during compilation) and evaluated by the adaptive process on every tick.
+ *
+ * */
+
+#ifndef RPIFAN_EXPR_H
+#define RPIFAN_EXPR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EXPR_MAX_CODE 128
+#define EXPR_MAX_REGS 64
+
+/*
+ * Input variables of an expression. They always occupy the first registers, so the
+ * interpreter only has to copy them in before running the code.
+ * */
+enum expr_var {
+    EXPR_VAR_T,         // Current temperature in C.
+    EXPR_VAR_TMAX,      // Maximal temperature observed since the start in C.
+    EXPR_VAR_PREV,      // Previous duty cycle in range 0..1.
+    EXPR_VAR_PSI,       // CPU pressure stall information (some avg10) in range 0..1.
+    EXPR_VAR_LOAD,      // 1 minute load average divided by the number of CPUs.
+    EXPR_VAR_TIME,      // Seconds since the adaptive process was started.
+    EXPR_VAR_AMB,       // Estimated ambient temperature in C, 0 while unknown.
+    EXPR_NVARS,
+};
+
+#define EXPR_USES(e, var) ((e)->uses & (1u << (var)))
+
+struct expr_insn {
+    uint8_t op;
+    uint8_t dst;
+    uint8_t a, b, c;
+};
+
+/*
+ * Compiled expression
+ *
+ * Registers are split in three areas: variables at the bottom, temporaries growing
+ * upwards right after them and constants growing downwards from the top.
+ * */
+struct expr {
+    struct expr_insn code[EXPR_MAX_CODE];
+    double regs[EXPR_MAX_REGS];
+    uint16_t ncode;
+    uint8_t out;
+    uint32_t uses;      // Bit mask of used variables.
+};
+
+int expr_compile(struct expr *e, const char *src, char *err, size_t errlen);
+double expr_eval(struct expr *e, const double *vars);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ *  file: fans.c
+ *
+ *  Per-fan write phases and latencies of the adaptive process.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+
+#include "rpifan.h"
+#include "fans.h"
+
+/*
+ * Rebuilds the fans from the configured one and the hotplugged ones, after the set changed.
+ * Fans that stay keep their statistics, but every fan is written again: a new one starts
+ * with whatever it had. The writes are 'stagger_ms' apart, or spread over the first half of
+ * the interval when that is 0 or would not fit into it.
+ * */
+void fans_sync(struct fans *fs, int fd, const struct hotplug *hp, uint64_t interval_ms, unsigned stagger_ms) {
+    static struct fans old;
+    uint64_t spacing;
+
+    old = *fs;
+    memset(fs, 0, sizeof(*fs));
+    fs->dc = old.dc;
+    fs->f[0] = old.n ? old.f[0] : (struct fan_slot) { .fd = fd };
+    fs->f[0].fd = fd;
+    fs->n = 1;
+    for(int i = 0; i < hp->nfans && fs->n < FANS_MAX; i++) {
+        struct fan_slot *s = &fs->f[fs->n++];
+
+        *s = (struct fan_slot) { .fd = hp->fans[i].fd };
+        strcpy(s->devname, hp->fans[i].devname);
+        for(int j = 1; j < old.n; j++) {
+            if(strcmp(old.f[j].devname, s->devname) == 0) {
+                s->writes = old.f[j].writes;
+                s->errors = old.f[j].errors;
+                s->lat = old.f[j].lat;
+            }
+        }
+    }
+
+    spacing = stagger_ms;
+    if(spacing == 0 || spacing * (fs->n - 1) >= interval_ms)
+        spacing = interval_ms / (2 * fs->n);
+    for(int i = 0; i < fs->n; i++)
+        fs->f[i].phase_ms = i * spacing;
+    fans_invalidate(fs);
+    if(fs->n > 1)
+        dfprintf("%d fans written %lu ms apart.\n", fs->n, spacing);
+}
+
+// The fans may hold anything, e.g. after control was taken over from another process.
+void fans_invalidate(struct fans *fs) {
+    for(int i = 0; i < fs->n; i++)
+        fs->f[i].written = UINT64_MAX;
+}
+
+// Writes the decided duty cycle to a fan. Returns 1 when written, 0 when it already has it.
+int fans_write(struct fans *fs, int i) {
+    struct fan_slot *s = &fs->f[i];
+    uint64_t dc = fs->dc, t;
+    int err;
+
+    if(s->written == dc)
+        return 0;
+    t = now_ns();
+    err = ioctl(s->fd, WR_PWM_VALUE, &dc);
+    lat_add(&s->lat, now_ns() - t);
+    if(err) {
+        s->errors++;
+        return -1;
+    }
+    s->written = dc;
+    s->writes++;
+    return 1;
+}
+
+void fans_print(FILE *f, const struct fans *fs) {
+    char name[HOTPLUG_PATH_SIZE + 96];
+
+    for(int i = 0; i < fs->n; i++) {
+        snprintf(name, sizeof(name), "Fan %s at +%u ms, %lu writes, %lu errors, ioctl",
+                i ? fs->f[i].devname : "device", fs->f[i].phase_ms, fs->f[i].writes, fs->f[i].errors);
+        lat_print(f, name, &fs->f[i].lat);
+    }
+}
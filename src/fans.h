@@ -0,0 +1,47 @@
+/*
+ *  file: fans.h
+ *
+ *  Staggered writes of the fans. The tick decides one duty cycle for all of them but only
+ *  writes the configured fan itself. Every hotplugged fan is written by a one-shot timer at its
+ *  own phase after the tick, evenly spaced within the interval, so the ioctls and the current
+ *  steps of the fans spinning up never come in one burst, and the tick costs the same with
+ *  any number of fans.
+ *
+ *  A fan is only written while its value differs from the decided one, so one whose write
+ *  failed tries again at its phase of the next tick. The duration of every ioctl is kept per
+ *  fan and goes out with the telemetry.
+ *
+ * */
+
+#ifndef RPIFAN_FANS_H
+#define RPIFAN_FANS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hotplug.h"
+#include "stats.h"
+
+#define FANS_MAX (1 + HOTPLUG_MAX_FANS)
+
+struct fan_slot {
+    char devname[HOTPLUG_PATH_SIZE];    // Empty for the configured fan.
+    int fd;
+    uint64_t written;                   // Last duty cycle written, UINT64_MAX while unknown.
+    uint32_t phase_ms;                  // Offset of the write after the tick.
+    uint64_t writes, errors;
+    struct lat_hist lat;                // Duration of the ioctl.
+};
+
+struct fans {
+    struct fan_slot f[FANS_MAX];        // The configured fan first, then the hotplugged ones.
+    int n;
+    uint64_t dc;                        // Decided on the last tick.
+};
+
+void fans_sync(struct fans *fs, int fd, const struct hotplug *hp, uint64_t interval_ms, unsigned stagger_ms);
+void fans_invalidate(struct fans *fs);
+int fans_write(struct fans *fs, int i);
+void fans_print(FILE *f, const struct fans *fs);
+
+#endif
@@ -0,0 +1,177 @@
+/*
+ *  file: fresh.c
+ *
+ *  Update cadence and phase of the sensors.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rpifan.h"
+#include "fresh.h"
+
+#define FRESH_GUARD_MIN_NS 1000000ull   // Least distance kept after an update.
+
+void fresh_init(struct fresh *f, uint64_t seed_ns, int learn) {
+    memset(f, 0, sizeof(*f));
+    f->seed_ns = f->period_ns = seed_ns;
+    f->learn = learn;
+}
+
+// Whether a read now can not return anything new, an eighth of the period is left for drift.
+int fresh_skip(struct fresh *f, uint64_t now) {
+    if(!f->period_ns || !f->lo_ns || now + f->period_ns / 8 >= f->lo_ns)
+        return 0;
+    f->skipped++;
+    return 1;
+}
+
+static void relearn(struct fresh *f, uint64_t now) {
+    dfprintf("Sensor updates left their cadence of %lu ms, learning it again.\n", f->period_ns / 1000000);
+    f->period_ns = 0;
+    f->lo_ns = f->hi_ns = 0;
+    f->changes = f->misses = 0;
+    f->change_ns = now;
+}
+
+// The period from the intervals between changes, once enough of them were seen.
+static void learn(struct fresh *f, uint64_t interval, uint64_t tick_ns) {
+    uint64_t *d = f->learn_ns, median, sum = 0, periods = 0, v;
+    int j;
+
+    // Kept in order, the median is in the middle.
+    for(j = f->changes++; j > 0 && d[j - 1] > interval; j--)
+        d[j] = d[j - 1];
+    d[j] = interval;
+    if(f->changes < FRESH_LEARN)
+        return;
+    f->changes = 0;
+    median = (d[FRESH_LEARN / 2 - 1] + d[FRESH_LEARN / 2]) / 2;
+    for(int i = 0; i < FRESH_LEARN; i++) {
+        v = (d[i] + median / 2) / median;
+        sum += d[i];
+        periods += v ? v : 1;
+    }
+    if(sum / periods >= 2 * tick_ns) {
+        f->period_ns = sum / periods;
+        dfprintf("Sensor updates every %lu ms.\n", f->period_ns / 1000000);
+    }
+}
+
+// Restarts the window from a change seen between the two reads.
+static void restart(struct fresh *f, uint64_t prev, uint64_t now) {
+    if(now - prev > f->period_ns)
+        prev = now - f->period_ns;
+    f->lo_ns = prev + f->period_ns;
+    f->hi_ns = now + f->period_ns;
+}
+
+// Takes a read of the sensor at 'now' and narrows or moves the window of the next update.
+void fresh_update(struct fresh *f, uint64_t now, int64_t value, uint64_t tick_ns) {
+    uint64_t prev = f->read_ns, lo, hi, m, m0;
+    int changed = value != f->value;
+
+    f->reads++;
+    f->value = value;
+    f->read_ns = now;
+    if(prev == 0) {
+        if(f->seed_ns < 2 * tick_ns)
+            f->seed_ns = f->period_ns = 0;
+        return;
+    }
+
+    if(!f->period_ns) {
+        if(!changed || !f->learn)
+            return;
+        if(f->change_ns)
+            learn(f, now - f->change_ns, tick_ns);
+        f->change_ns = now;
+        if(!f->period_ns)
+            return;
+    }
+
+    // The first change under a known period starts the window.
+    if(!f->lo_ns) {
+        if(changed)
+            restart(f, prev, now);
+        return;
+    }
+    if(now <= f->lo_ns) {
+        if(changed)
+            goto _miss;
+        return;
+    }
+
+    // Windows that overlap the interval since the last read, from m0 to m.
+    m0 = prev < f->hi_ns ? 0 : (prev - f->hi_ns) / f->period_ns + 1;
+    m = (now - f->lo_ns - 1) / f->period_ns;
+    lo = f->lo_ns + m * f->period_ns;
+    hi = f->hi_ns + m * f->period_ns;
+    if(!changed) {
+        // Still the old value inside the window, the update is yet to come. One that passed kept it.
+        if(now <= hi) {
+            f->lo_ns = now;
+            f->hi_ns = hi;
+        } else {
+            f->lo_ns = lo + f->period_ns;
+            f->hi_ns = hi + f->period_ns;
+        }
+        return;
+    }
+    if(m < m0)
+        goto _miss;
+    f->misses = 0;
+
+    // Only a single window tells which of the updates brought the change.
+    if(m == m0) {
+        lo = prev > lo ? prev : lo;
+        hi = now < hi ? now : hi;
+    }
+    if(m > m0 && now <= hi) {
+        f->lo_ns = lo;
+        f->hi_ns = hi;
+    } else {
+        f->lo_ns = lo + f->period_ns;
+        f->hi_ns = hi + f->period_ns;
+    }
+    return;
+
+    // A change outside of the window does not fit the cadence.
+_miss:
+    if(++f->misses >= FRESH_MISSES && !f->seed_ns)
+        relearn(f, now);
+    else
+        restart(f, prev, now);
+}
+
+/*
+ * How far to move the tick after 'next_tick' so that it lands in the window of the updates.
+ * Zero when the period is unknown or not a whole number of ticks, or the tick is there.
+ * */
+int64_t fresh_shift(const struct fresh *f, uint64_t tick_ns, uint64_t next_tick) {
+    uint64_t n, off, guard, target, base = next_tick + tick_ns;
+    int64_t shift;
+
+    if(!f->period_ns || !f->lo_ns || !tick_ns)
+        return 0;
+    n = (f->period_ns + tick_ns / 2) / tick_ns;
+    off = f->period_ns > n * tick_ns ? f->period_ns - n * tick_ns : n * tick_ns - f->period_ns;
+    if(n == 0 || off > tick_ns / 16)
+        return 0;
+
+    guard = f->period_ns / 64 > FRESH_GUARD_MIN_NS ? f->period_ns / 64 : FRESH_GUARD_MIN_NS;
+    target = f->hi_ns - f->lo_ns > 2 * guard ? f->lo_ns + (f->hi_ns - f->lo_ns) / 2 : f->hi_ns + guard;
+    shift = target >= base ? (int64_t)((target - base) % tick_ns) : -(int64_t)((base - target) % tick_ns);
+    if(shift > (int64_t)(tick_ns / 2))
+        shift -= tick_ns;
+    else if(shift < -(int64_t)(tick_ns / 2))
+        shift += tick_ns;
+    // A step at a time, the next ticks take the rest.
+    if(shift > (int64_t)(tick_ns / FRESH_SHIFT_DIV))
+        shift = tick_ns / FRESH_SHIFT_DIV;
+    else if(shift < -(int64_t)(tick_ns / FRESH_SHIFT_DIV))
+        shift = -(int64_t)(tick_ns / FRESH_SHIFT_DIV);
+    return shift;
+}
@@ -0,0 +1,57 @@
+/*
+ *  file: fresh.h
+ *
+ *  Update cadence of a sensor. Many sensors do not measure on every read: hwmon drivers cache
+ *  for their 'update_interval' and some thermal drivers only refresh at their polling delay,
+ *  so a tick that is faster than the sensor reads the same value again, and one that is not
+ *  in phase with it reads values that are almost a period old.
+ *
+ *  The period is seeded from 'update_interval' where the sensor has one. Only on request it is
+ *  otherwise learned from the intervals between changes of the value: their median tells how
+ *  many periods each one spans (an update may keep the value), and their sum over the amount
+ *  of periods gives the period without the rounding to ticks. That is a guess, a sensor that
+ *  measures on every read but quantizes a slow drift looks just like a slow one. Only periods
+ *  of at least two ticks are tracked, reads a period apart would each see exactly one update
+ *  and tell nothing of its phase.
+ *
+ *  From then on the tracker keeps the window in which the next update must come, narrowed by
+ *  every read: one that sees no change moves the start of the window up to it,
+ *  one that sees a change ends it there. Reads before the window are skipped. Updates that
+ *  keep arriving outside of the window make it learn the period again.
+ *
+ *  When the period is a whole number of ticks, the tick is moved into the window, first to
+ *  its middle, which halves it on every update, and then just after its end, so that the
+ *  control runs on values that are a few milliseconds old. It moves by at most an eighth of
+ *  the tick at a time, so the gaps between the ticks stay far from what a standby takes for
+ *  a hung process.
+ *
+ * */
+
+#ifndef RPIFAN_FRESH_H
+#define RPIFAN_FRESH_H
+
+#include <stdint.h>
+
+#define FRESH_LEARN 8           // Changes seen before the learned period is trusted.
+#define FRESH_MISSES 3          // Updates in a row outside of the window until it is learned again.
+#define FRESH_SHIFT_DIV 8       // The tick moves by at most this fraction of it at a time.
+
+struct fresh {
+    int64_t value;              // Last value read.
+    uint64_t read_ns;           // Time of the last read, 0 before the first one.
+    uint64_t change_ns;         // Read that saw the last change.
+    uint64_t period_ns;         // Update period, 0 while unknown.
+    uint64_t seed_ns;           // Period given by the sensor, 0 if it has none.
+    int learn;                  // Whether to learn the period when the sensor does not give it.
+    uint64_t lo_ns, hi_ns;      // Window of the next update, (lo, hi], 0 while unknown.
+    uint64_t learn_ns[FRESH_LEARN]; // Change intervals while learning, in order.
+    unsigned changes, misses;
+    uint64_t reads, skipped;
+};
+
+void fresh_init(struct fresh *f, uint64_t seed_ns, int learn);
+int fresh_skip(struct fresh *f, uint64_t now);
+void fresh_update(struct fresh *f, uint64_t now, int64_t value, uint64_t tick_ns);
+int64_t fresh_shift(const struct fresh *f, uint64_t tick_ns, uint64_t next_tick);
+
+#endif
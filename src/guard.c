@@ -0,0 +1,175 @@
+/*
+ *  file: guard.c
+ *
+ *  Probation of a new configuration and its promotion to the known-good one.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rpifan.h"
+#include "guard.h"
+
+#define GUARD_COPY_SIZE 4096
+
+// Reads a whole file into a new buffer. Returns its length, -1 when it could not be read.
+static long read_file(const char *path, char **out) {
+    long len = 0, cap = GUARD_COPY_SIZE;
+    char *buf = malloc(cap), *tmp;
+    FILE *f = fopen(path, "r");
+    size_t n;
+
+    while(f != NULL && buf != NULL && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if(len == cap) {
+            if((tmp = realloc(buf, cap * 2)) == NULL)
+                break;
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    if(f == NULL || buf == NULL || ferror(f) || !feof(f)) {
+        len = -1;
+        free(buf);
+        buf = NULL;
+    }
+    if(f != NULL)
+        fclose(f);
+    *out = buf;
+    return len;
+}
+
+/*
+ * Starts the probation, unless the configuration is the known-good one already. The file is
+ * kept as it is now, so only what went through the probation can be promoted, not a later edit.
+ * */
+void guard_start(struct guard *g, const struct fan_conf *conf, uint64_t epoch_ms, const struct counters *c) {
+    char *good;
+    long len;
+
+    memset(g, 0, sizeof(*g));
+    g->conf = conf;
+    g->state = GUARD_OFF;
+    if(conf->probation_s == 0 || conf->path[0] == '\0')
+        return;
+    if((g->len = read_file(conf->path, &g->snapshot)) < 0) {
+        fprintf(stderr, "Unable to read '%s', it can not become the known-good configuration.\n", conf->path);
+        return;
+    }
+    len = read_file(conf->known_good, &good);
+    if(len == g->len && memcmp(good, g->snapshot, len) == 0) {
+        dfprintf("Configuration '%s' is the known-good one, no probation.\n", conf->path);
+        free(good);
+        guard_close(g);
+        return;
+    }
+    free(good);
+
+    g->state = GUARD_PROBATION;
+    g->start_ms = g->last_ms = epoch_ms;
+    g->writes0 = counter_read(c, CNT_WRITES);
+    g->errors0 = counter_read(c, CNT_READ_ERRORS) + counter_read(c, CNT_WRITE_ERRORS);
+    dfprintf("Configuration '%s' is on probation for %u seconds.\n", conf->path, conf->probation_s);
+}
+
+/*
+ * Checks the guard metrics of one tick. Returns GUARD_FAILED or GUARD_PASSED once, when the
+ * probation ends, and GUARD_PROBATION or GUARD_OFF otherwise.
+ * */
+enum guard_state guard_check(struct guard *g, const struct rpifan_state *st, const struct counters *c, uint64_t epoch_ms) {
+    const struct fan_conf *conf = g->conf;
+    uint64_t writes, errors, budget;
+
+    if(g->state != GUARD_PROBATION)
+        return GUARD_OFF;
+    if(g->last_ms == g->start_ms)
+        g->start_temp = st->temp;
+
+    if(conf->guard_above > 0.0 && st->temp > conf->guard_above)
+        g->above_ms += epoch_ms - g->last_ms;
+    g->last_ms = epoch_ms;
+    writes = counter_read(c, CNT_WRITES) - g->writes0;
+    errors = counter_read(c, CNT_READ_ERRORS) + counter_read(c, CNT_WRITE_ERRORS) - g->errors0;
+    budget = (uint64_t) conf->guard_writes * conf->probation_s / 60;
+
+    // Only heat that the new policy adds counts, not the temperature it started with.
+    if(conf->guard_temp > 0.0 && st->temp > conf->guard_temp && st->temp > g->start_temp)
+        snprintf(g->reason, sizeof(g->reason), "temperature %.1f C over the %.1f C limit", st->temp, conf->guard_temp);
+    else if(conf->guard_above_s && g->above_ms > conf->guard_above_s * 1000ull)
+        snprintf(g->reason, sizeof(g->reason), "%lu s above %.1f C, limit %u s", g->above_ms / 1000, conf->guard_above, conf->guard_above_s);
+    else if(conf->guard_writes && writes > (budget ? budget : 1))
+        snprintf(g->reason, sizeof(g->reason), "%lu writes, over %u per minute", writes, conf->guard_writes);
+    else if(conf->guard_errors && errors > conf->guard_errors)
+        snprintf(g->reason, sizeof(g->reason), "%lu sensor or driver errors, limit %u", errors, conf->guard_errors);
+    else if(epoch_ms - g->start_ms >= conf->probation_s * 1000ull)
+        return g->state = GUARD_PASSED;
+    else
+        return GUARD_PROBATION;
+
+    return g->state = GUARD_FAILED;
+}
+
+/*
+ * Checks only the error limit, on a tick whose sensors could not be read. Nothing else can be
+ * told then, so the probation never passes on such a tick.
+ * */
+enum guard_state guard_errors(struct guard *g, const struct counters *c) {
+    uint64_t errors;
+
+    if(g->state != GUARD_PROBATION)
+        return GUARD_OFF;
+    errors = counter_read(c, CNT_READ_ERRORS) + counter_read(c, CNT_WRITE_ERRORS) - g->errors0;
+    if(!g->conf->guard_errors || errors <= g->conf->guard_errors)
+        return GUARD_PROBATION;
+    snprintf(g->reason, sizeof(g->reason), "%lu sensor or driver errors, limit %u", errors, g->conf->guard_errors);
+    return g->state = GUARD_FAILED;
+}
+
+// Makes the configuration the known-good one. The copy is renamed over, so it is never partial.
+int guard_promote(const struct guard *g) {
+    char tmp[CONF_LINE_SIZE + 8];
+    FILE *out;
+    int ret = 0;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g->conf->known_good);
+    if(g->snapshot == NULL || (out = fopen_nofollow(tmp, "w")) == NULL) {
+        perror("Unable to save the known-good configuration");
+        return -1;
+    }
+    if(fwrite(g->snapshot, 1, g->len, out) != (size_t) g->len)
+        ret = -1;
+    if(fclose(out) != 0)
+        ret = -1;
+    if(ret == 0 && rename(tmp, g->conf->known_good) < 0)
+        ret = -1;
+    if(ret < 0)
+        remove(tmp);
+    return ret;
+}
+
+// Records the outcome of the probation on stderr and in '<known_good>.log'.
+void guard_log(const struct guard *g, uint64_t epoch_ms) {
+    char path[CONF_LINE_SIZE + 8], line[CONF_LINE_SIZE * 2 + 160];
+    FILE *f;
+
+    if(g->state == GUARD_FAILED)
+        snprintf(line, sizeof(line), "%lu %s: rolled back to '%s': %s.\n", epoch_ms, g->conf->path, g->conf->known_good, g->reason);
+    else
+        snprintf(line, sizeof(line), "%lu %s: passed probation of %u s.\n", epoch_ms, g->conf->path, g->conf->probation_s);
+    fputs(line, stderr);
+
+    snprintf(path, sizeof(path), "%s.log", g->conf->known_good);
+    if((f = fopen_nofollow(path, "a")) != NULL) {
+        fputs(line, f);
+        fclose(f);
+    }
+}
+
+void guard_close(struct guard *g) {
+    free(g->snapshot);
+    g->snapshot = NULL;
+    g->len = 0;
+}
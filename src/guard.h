@@ -0,0 +1,49 @@
+/*
+ *  file: guard.h
+ *
+ *  Rollback guardrails. A configuration that differs from the last known-good one starts on
+ *  probation: for the probation window the adaptive process watches the peak temperature,
+ *  the time above a threshold, the write rate and the sensor and driver errors. When any of
+ *  them goes over its limit, the policy of the known-good configuration takes over and the
+ *  reason is logged. A configuration that passes the window becomes the new known-good one.
+ *
+ * */
+
+#ifndef RPIFAN_GUARD_H
+#define RPIFAN_GUARD_H
+
+#include <stdint.h>
+
+#include "conf.h"
+#include "stats.h"
+#include "rpifan_plugin.h"
+
+enum guard_state {
+    GUARD_OFF,          // No probation, disabled or already known-good.
+    GUARD_PROBATION,
+    GUARD_PASSED,       // Returned once, when the window is over.
+    GUARD_FAILED,       // Returned once, when a limit is exceeded.
+};
+
+struct guard {
+    enum guard_state state;
+    const struct fan_conf *conf;
+    uint64_t start_ms;
+    uint64_t last_ms;
+    uint64_t above_ms;          // Time spent above the 'guard_above' temperature.
+    double start_temp;          // Temperature inherited from before the probation.
+    uint64_t writes0;           // Counters when the probation started.
+    uint64_t errors0;
+    char *snapshot;             // The configuration file as it was when the probation started.
+    long len;
+    char reason[128];
+};
+
+void guard_start(struct guard *g, const struct fan_conf *conf, uint64_t epoch_ms, const struct counters *c);
+enum guard_state guard_check(struct guard *g, const struct rpifan_state *st, const struct counters *c, uint64_t epoch_ms);
+enum guard_state guard_errors(struct guard *g, const struct counters *c);
+int guard_promote(const struct guard *g);
+void guard_log(const struct guard *g, uint64_t epoch_ms);
+void guard_close(struct guard *g);
+
+#endif
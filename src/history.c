@@ -0,0 +1,436 @@
+/*
+ *  file: history.c
+ *
+ *  Compressed sample history.
+ *
+ *  Each block starts with a raw sample, so every block can be decoded on its own. Then:
+ *
+ *      timestamp:  delta-of-delta, '0' when unchanged, otherwise a prefix of 2-4 bits
+ *                  followed by 7, 9, 12 or 64 bits of the signed difference.
+ *      value:      XOR with the previous value, '0' when unchanged, '10' + meaningful bits
+ *                  when they fit into the previous window, otherwise '11' + 5 bits of
+ *                  leading zeros + 6 bits of length + meaningful bits.
+ *
+ *  A sample is only started in a block when its worst case encoding still fits, so no
+ *  sample ever spans two blocks.
+ *
+ * */
+
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+
+#include "rpifan.h"
+#include "history.h"
+
+#define HIST_WORST_BITS(n) (4 + 64 + (n) * (2 + 5 + 6 + 64))
+#define HIST_NO_WINDOW 0xff
+
+struct hist_file_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t nvalues;
+    uint32_t block_size;
+};
+
+struct hist_section {
+    uint32_t tag;
+    uint32_t len;
+};
+
+struct bit_reader {
+    const uint64_t *words;
+    uint32_t pos;
+    uint32_t end;               // Bits written to the block, reading past them ends the block.
+};
+
+static void put_bits(struct hist_block *b, uint64_t v, int n) {
+    uint32_t idx = b->nbits >> 6;
+    int room = 64 - (b->nbits & 63);
+
+    if(n == 0)
+        return;
+    if(n < 64)
+        v &= (1ull << n) - 1;
+
+    if(n <= room) {
+        b->words[idx] |= v << (room - n);
+    } else {
+        b->words[idx] |= v >> (n - room);
+        b->words[idx + 1] |= v << (64 - (n - room));
+    }
+    b->nbits += n;
+}
+
+static uint64_t get_bits(struct bit_reader *r, int n) {
+    uint32_t idx = r->pos >> 6;
+    int room = 64 - (r->pos & 63);
+    uint64_t v;
+
+    if(n == 0)
+        return 0;
+    if(r->pos + n > r->end) {
+        r->pos = r->end + 1;
+        return 0;
+    }
+
+    if(n <= room)
+        v = r->words[idx] >> (room - n);
+    else
+        v = (r->words[idx] << (n - room)) | (r->words[idx + 1] >> (64 - (n - room)));
+    r->pos += n;
+    return n < 64 ? v & ((1ull << n) - 1) : v;
+}
+
+// Sign extension of an n bits wide two's complement value.
+static int64_t sign_extend(uint64_t v, int n) {
+    return n < 64 && (v >> (n - 1)) & 1 ? (int64_t)(v | ~((1ull << n) - 1)) : (int64_t) v;
+}
+
+static uint64_t dbits(double d) {
+    uint64_t u;
+
+    memcpy(&u, &d, sizeof(u));
+    return u;
+}
+
+static double bitsd(uint64_t u) {
+    double d;
+
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+/*
+ * Allocates the ring for the given memory budget. There are always at least two blocks, so
+ * starting a new block never drops the samples that were just written.
+ * */
+int hist_init(struct history *h, int nvalues, size_t bytes) {
+    memset(h, 0, sizeof(*h));
+    h->nvalues = nvalues;
+    h->nblocks = bytes / sizeof(struct hist_block);
+    if(h->nblocks < 2)
+        h->nblocks = 2;
+
+    h->blocks = calloc(h->nblocks, sizeof(struct hist_block));
+    if(h->blocks == NULL) {
+        perror("Unable to allocate the sample history");
+        return -1;
+    }
+    return 0;
+}
+
+void hist_free(struct history *h) {
+    free(h->blocks);
+    h->blocks = NULL;
+    h->count = 0;
+}
+
+static void put_ts(struct history *h, struct hist_block *b, uint64_t ts) {
+    int64_t delta = ts - h->prev_ts, dod = delta - h->prev_delta;
+
+    if(dod == 0) {
+        put_bits(b, 0, 1);
+    } else if(dod >= -64 && dod <= 63) {
+        put_bits(b, 0x2, 2);
+        put_bits(b, dod, 7);
+    } else if(dod >= -256 && dod <= 255) {
+        put_bits(b, 0x6, 3);
+        put_bits(b, dod, 9);
+    } else if(dod >= -2048 && dod <= 2047) {
+        put_bits(b, 0xe, 4);
+        put_bits(b, dod, 12);
+    } else {
+        put_bits(b, 0xf, 4);
+        put_bits(b, dod, 64);
+    }
+    h->prev_delta = delta;
+    h->prev_ts = ts;
+}
+
+static void put_val(struct history *h, struct hist_block *b, int i, uint64_t v) {
+    uint64_t x = v ^ h->prev_vals[i];
+    int lead, trail, sig;
+
+    h->prev_vals[i] = v;
+    if(x == 0) {
+        put_bits(b, 0, 1);
+        return;
+    }
+
+    lead = __builtin_clzll(x);
+    trail = __builtin_ctzll(x);
+    if(lead > 31)
+        lead = 31;
+
+    if(h->prev_lead[i] != HIST_NO_WINDOW && lead >= h->prev_lead[i] && trail >= h->prev_trail[i]) {
+        put_bits(b, 0x2, 2);
+        put_bits(b, x >> h->prev_trail[i], 64 - h->prev_lead[i] - h->prev_trail[i]);
+        return;
+    }
+
+    sig = 64 - lead - trail;
+    put_bits(b, 0x3, 2);
+    put_bits(b, lead, 5);
+    put_bits(b, sig - 1, 6);
+    put_bits(b, x >> trail, sig);
+    h->prev_lead[i] = lead;
+    h->prev_trail[i] = trail;
+}
+
+// Appends one sample. Never allocates, the oldest block is dropped when the ring is full.
+void hist_add(struct history *h, uint64_t ts, const double *vals) {
+    struct hist_block *b = &h->blocks[h->head];
+
+    if(h->count == 0 || b->nbits + HIST_WORST_BITS(h->nvalues) > HIST_BLOCK_BITS) {
+        if(h->count > 0)
+            h->head = (h->head + 1) % h->nblocks;
+        if(h->count < h->nblocks)
+            h->count++;
+
+        b = &h->blocks[h->head];
+        memset(b, 0, sizeof(*b));
+        b->first_ts = ts;
+
+        // First sample of a block is stored raw.
+        put_bits(b, ts, 64);
+        for(int i = 0; i < h->nvalues; i++) {
+            h->prev_vals[i] = dbits(vals[i]);
+            h->prev_lead[i] = HIST_NO_WINDOW;
+            put_bits(b, h->prev_vals[i], 64);
+        }
+        h->prev_ts = ts;
+        h->prev_delta = 0;
+    } else {
+        put_ts(h, b, ts);
+        for(int i = 0; i < h->nvalues; i++)
+            put_val(h, b, i, dbits(vals[i]));
+    }
+
+    b->last_ts = ts;
+    b->nsamples++;
+}
+
+uint64_t hist_samples(const struct history *h) {
+    uint64_t n = 0;
+
+    for(int i = 0; i < h->count; i++)
+        n += h->blocks[(h->head - i + h->nblocks) % h->nblocks].nsamples;
+    return n;
+}
+
+// Compressed size of the stored samples in bytes.
+size_t hist_bytes(const struct history *h) {
+    size_t n = 0;
+
+    for(int i = 0; i < h->count; i++)
+        n += (h->blocks[(h->head - i + h->nblocks) % h->nblocks].nbits + 7) / 8;
+    return n;
+}
+
+static void decode_block(const struct hist_block *b, int nvalues,
+        uint64_t from, uint64_t to, hist_cb cb, void *ctx) {
+    struct bit_reader r = { b->words, 0, b->nbits };
+    uint64_t vals[HIST_MAX_VALUES], x;
+    uint8_t lead[HIST_MAX_VALUES] = { 0 }, trail[HIST_MAX_VALUES] = { 0 };
+    double out[HIST_MAX_VALUES];
+    uint64_t ts;
+    int64_t delta = 0, dod;
+    int sig;
+
+    ts = get_bits(&r, 64);
+    for(int i = 0; i < nvalues; i++)
+        vals[i] = get_bits(&r, 64);
+
+    for(uint32_t s = 0; s < b->nsamples; s++) {
+        if(s > 0) {
+            if(get_bits(&r, 1) == 0)
+                dod = 0;
+            else if(get_bits(&r, 1) == 0)
+                dod = sign_extend(get_bits(&r, 7), 7);
+            else if(get_bits(&r, 1) == 0)
+                dod = sign_extend(get_bits(&r, 9), 9);
+            else if(get_bits(&r, 1) == 0)
+                dod = sign_extend(get_bits(&r, 12), 12);
+            else
+                dod = (int64_t) get_bits(&r, 64);
+            delta += dod;
+            ts += delta;
+
+            for(int i = 0; i < nvalues; i++) {
+                if(get_bits(&r, 1) == 0)
+                    continue;
+                if(get_bits(&r, 1) == 0) {
+                    x = get_bits(&r, 64 - lead[i] - trail[i]) << trail[i];
+                } else {
+                    lead[i] = get_bits(&r, 5);
+                    sig = get_bits(&r, 6) + 1;
+                    if(lead[i] + sig > 64)
+                        return;     // No encoder writes that, the block is corrupted.
+                    trail[i] = 64 - lead[i] - sig;
+                    x = get_bits(&r, sig) << trail[i];
+                }
+                vals[i] ^= x;
+            }
+        }
+        if(r.pos > r.end)
+            return;
+
+        if(ts < from)
+            continue;
+        if(ts > to)
+            return;
+        for(int i = 0; i < nvalues; i++)
+            out[i] = bitsd(vals[i]);
+        cb(ctx, ts, out, nvalues);
+    }
+}
+
+// Decodes samples within [from, to] in time order. Blocks outside of the range are skipped.
+void hist_query(const struct history *h, uint64_t from, uint64_t to, hist_cb cb, void *ctx) {
+    const struct hist_block *b;
+
+    for(int i = h->count - 1; i >= 0; i--) {
+        b = &h->blocks[(h->head - i + h->nblocks) % h->nblocks];
+        if(b->nsamples == 0 || b->last_ts < from || b->first_ts > to)
+            continue;
+        decode_block(b, h->nvalues, from, to, cb, ctx);
+    }
+}
+
+/*
+ * Writes the history file: a header followed by tagged sections, one for each block from the
+ * oldest one, then the extra sections. Blocks are stored as they are in memory, there is no
+ * need to recompress. The file is written next to it and renamed over, so it is never partial.
+ * */
+int hist_save(const struct history *h, const char *path, const struct hist_extra *extra, int nextra) {
+    struct hist_file_header hdr = {
+        .magic = HIST_MAGIC, .version = HIST_VERSION,
+        .nvalues = h->nvalues, .block_size = HIST_BLOCK_SIZE,
+    };
+    struct hist_section sec = { .tag = HIST_SECTION_BLOCK };
+    const struct hist_block *b;
+    size_t head = offsetof(struct hist_block, words), words;
+    char tmp[PATH_MAX];
+    int failed;
+    FILE *f;
+
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp) || (f = fopen_nofollow(tmp, "wb")) == NULL) {
+        perror("Unable to create history file");
+        return -1;
+    }
+
+    fwrite(&hdr, sizeof(hdr), 1, f);
+    for(int i = h->count - 1; i >= 0; i--) {
+        b = &h->blocks[(h->head - i + h->nblocks) % h->nblocks];
+        words = (b->nbits + 63) / 64;
+        sec.len = head + words * sizeof(uint64_t);
+        fwrite(&sec, sizeof(sec), 1, f);
+        fwrite(b, head, 1, f);
+        fwrite(b->words, sizeof(uint64_t), words, f);
+    }
+    for(int i = 0; i < nextra; i++) {
+        sec.tag = extra[i].tag;
+        sec.len = extra[i].len;
+        fwrite(&sec, sizeof(sec), 1, f);
+        fwrite(extra[i].data, extra[i].len, 1, f);
+    }
+
+    // A short write, e.g. on a full disk, leaves the last good file in place.
+    failed = ferror(f);
+    if(fclose(f) != 0 || failed || rename(tmp, path) < 0) {
+        perror("Unable to write history file");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Whether the bits of a block read from a file can hold its samples. The first one is raw, every
+ * other one takes at least a bit for the time and one for each value.
+ * */
+static int block_fits(const struct hist_block *b, int nvalues) {
+    uint32_t raw = 64 * (1 + nvalues);
+
+    if(b->nbits > HIST_BLOCK_BITS)
+        return 0;
+    return b->nsamples == 0 || (b->nbits >= raw && b->nsamples - 1 <= (b->nbits - raw) / (1 + nvalues));
+}
+
+/*
+ * Loads a history file written by hist_save(), with a ring exactly as large as needed. Other
+ * sections are passed to the callback, or skipped when there is none.
+ * */
+int hist_load(struct history *h, const char *path, hist_section_cb cb, void *ctx) {
+    struct hist_file_header hdr;
+    struct hist_section sec;
+    struct hist_block *b, *blocks;
+    size_t head = offsetof(struct hist_block, words);
+    void *data;
+    FILE *f;
+
+    memset(h, 0, sizeof(*h));
+    f = fopen(path, "rb");
+    if(f == NULL) {
+        perror("Unable to open history file");
+        return -1;
+    }
+
+    if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, HIST_MAGIC, 4) != 0
+            || hdr.version != HIST_VERSION || hdr.block_size != HIST_BLOCK_SIZE
+            || hdr.nvalues == 0 || hdr.nvalues > HIST_MAX_VALUES) {
+        fprintf(stderr, "'%s' is not a history file of a supported version.\n", path);
+        fclose(f);
+        return -1;
+    }
+    h->nvalues = hdr.nvalues;
+
+    while(fread(&sec, sizeof(sec), 1, f) == 1) {
+        if(sec.tag != HIST_SECTION_BLOCK) {
+            if(cb == NULL || (data = malloc(sec.len)) == NULL) {
+                fseek(f, sec.len, SEEK_CUR);
+                continue;
+            }
+            if(fread(data, sec.len, 1, f) != 1) {
+                fprintf(stderr, "Truncated section in history file '%s'.\n", path);
+                free(data);
+                goto _fail;
+            }
+            cb(ctx, sec.tag, data, sec.len);
+            free(data);
+            continue;
+        }
+
+        if(sec.len < head || sec.len > sizeof(struct hist_block)) {
+            fprintf(stderr, "Corrupted block in history file '%s'.\n", path);
+            goto _fail;
+        }
+        blocks = realloc(h->blocks, (h->count + 1) * sizeof(struct hist_block));
+        if(blocks == NULL) {
+            perror("Unable to allocate the sample history");
+            goto _fail;
+        }
+        h->blocks = blocks;
+        b = &h->blocks[h->count];
+        memset(b, 0, sizeof(*b));
+        if(fread(b, sec.len, 1, f) != 1 || (b->nbits + 63) / 64 * sizeof(uint64_t) != sec.len - head
+                || !block_fits(b, h->nvalues)) {
+            fprintf(stderr, "Corrupted block in history file '%s'.\n", path);
+            goto _fail;
+        }
+        h->count++;
+    }
+
+    fclose(f);
+    h->nblocks = h->count > 0 ? h->count : 1;
+    h->head = h->count > 0 ? h->count - 1 : 0;
+    return 0;
+
+_fail:
+    fclose(f);
+    hist_free(h);
+    return -1;
+}
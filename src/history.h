@@ -0,0 +1,75 @@
+/*
+ *  file: history.h
+ *
+ *  In-memory sample history of the adaptive process. Samples are compressed Gorilla-style
+ *  into fixed size blocks: timestamps as delta-of-delta, values as XOR against the previous
+ *  value of the same column. Blocks form a ring, so the memory is allocated once and the
+ *  oldest block is reused when the ring is full.
+ *
+ *  The compression is lossless. Values are stored as doubles, so columns should hold
+ *  integral quantities (millidegrees, PWM nanoseconds) which compress far better than
+ *  decimal fractions.
+ *
+ * */
+
+#ifndef RPIFAN_HISTORY_H
+#define RPIFAN_HISTORY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "rpifan_plugin.h"
+
+#define HIST_BLOCK_SIZE 4096
+#define HIST_BLOCK_BITS (HIST_BLOCK_SIZE * 8)
+#define HIST_MAX_VALUES (RPIFAN_MAX_ZONES + 1)
+
+// History file sections, see hist_save().
+#define HIST_MAGIC "RFHS"
+#define HIST_VERSION 1
+#define HIST_SECTION_BLOCK 0x4b4c4221   // "!BLK"
+
+struct hist_block {
+    uint64_t first_ts;          // Milliseconds since the epoch.
+    uint64_t last_ts;
+    uint32_t nsamples;
+    uint32_t nbits;
+    uint64_t words[HIST_BLOCK_SIZE / 8];
+};
+
+struct history {
+    int nvalues;                // Values of each sample.
+    int nblocks;                // Capacity of the ring.
+    int head;                   // Block being written.
+    int count;                  // Blocks in use, including the head.
+    struct hist_block *blocks;
+
+    // Encoder state of the head block.
+    uint64_t prev_ts;
+    int64_t prev_delta;
+    uint64_t prev_vals[HIST_MAX_VALUES];
+    uint8_t prev_lead[HIST_MAX_VALUES];
+    uint8_t prev_trail[HIST_MAX_VALUES];
+};
+
+typedef void (*hist_cb)(void *ctx, uint64_t ts, const double *vals, int nvalues);
+typedef void (*hist_section_cb)(void *ctx, uint32_t tag, const void *data, uint32_t len);
+
+// Additional data stored in the history file next to the samples.
+struct hist_extra {
+    uint32_t tag;
+    uint32_t len;
+    const void *data;
+};
+
+int hist_init(struct history *h, int nvalues, size_t bytes);
+void hist_free(struct history *h);
+void hist_add(struct history *h, uint64_t ts, const double *vals);
+uint64_t hist_samples(const struct history *h);
+size_t hist_bytes(const struct history *h);
+void hist_query(const struct history *h, uint64_t from, uint64_t to, hist_cb cb, void *ctx);
+
+int hist_save(const struct history *h, const char *path, const struct hist_extra *extra, int nextra);
+int hist_load(struct history *h, const char *path, hist_section_cb cb, void *ctx);
+
+#endif
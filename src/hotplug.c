@@ -0,0 +1,337 @@
+/*
+ *  file: hotplug.c
+ *
+ *  Netlink uevent listener and the hotplugged sensor and fan sets.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "rpifan.h"
+#include "hotplug.h"
+
+#define UEVENT_BUF_SIZE 4096
+#define UEVENT_GROUP_KERNEL 1
+#define HWMON_NAME_SIZE 64
+#define HOTPLUG_BUF_SIZE (CONF_LINE_SIZE + HOTPLUG_PATH_SIZE + 32)
+
+struct uevent {
+    const char *action;
+    const char *devpath;
+    const char *subsystem;
+    const char *devname;
+};
+
+// Whether the chip name is one of the configured 'hwmon' names.
+static int wanted_chip(const struct fan_conf *conf, const char *name) {
+    const char *p = conf->hwmon;
+    size_t len = strlen(name);
+
+    while(*p) {
+        while(*p == ' ' || *p == ',' || *p == '\t')
+            p++;
+        if(strncmp(p, name, len) == 0 && (p[len] == '\0' || p[len] == ' ' || p[len] == ',' || p[len] == '\t'))
+            return 1;
+        while(*p && *p != ' ' && *p != ',' && *p != '\t')
+            p++;
+    }
+    return 0;
+}
+
+// Milliseconds the chip caches its readings for, 0 if it does not tell.
+static unsigned long update_interval(struct hotplug *hp, const char *devpath) {
+    char path[HOTPLUG_BUF_SIZE];
+    unsigned long ms = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s%s/update_interval", hp->conf->sysfs, devpath);
+    if((f = fopen(path, "r")) == NULL)
+        return 0;
+    if(fscanf(f, "%lu", &ms) != 1)
+        ms = 0;
+    fclose(f);
+    return ms;
+}
+
+static void add_sensor(struct hotplug *hp, const char *devpath) {
+    char path[HOTPLUG_BUF_SIZE], name[HWMON_NAME_SIZE];
+    struct hp_sensor *s;
+    FILE *f;
+    int fd;
+
+    for(int i = 0; i < hp->nsensors; i++) {
+        if(strcmp(hp->sensors[i].devpath, devpath) == 0)
+            return;
+    }
+
+    snprintf(path, sizeof(path), "%s%s/name", hp->conf->sysfs, devpath);
+    if((f = fopen(path, "r")) == NULL)
+        return;
+    if(fgets(name, sizeof(name), f) == NULL)
+        name[0] = '\0';
+    fclose(f);
+    name[strcspn(name, "\n")] = '\0';
+    if(!wanted_chip(hp->conf, name))
+        return;
+
+    if(hp->nsensors == HOTPLUG_MAX_SENSORS || hp->conf->nzones + hp->nsensors == RPIFAN_MAX_ZONES) {
+        fprintf(stderr, "No room for hwmon sensor '%s' at %s.\n", name, devpath);
+        return;
+    }
+    snprintf(path, sizeof(path), "%s%s/temp1_input", hp->conf->sysfs, devpath);
+    if((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to open hwmon sensor '%s'.\n", path);
+        return;
+    }
+
+    s = &hp->sensors[hp->nsensors++];
+    strncpy(s->devpath, devpath, HOTPLUG_PATH_SIZE - 1);
+    s->devpath[HOTPLUG_PATH_SIZE - 1] = '\0';
+    s->fd = fd;
+    fresh_init(&s->fresh, update_interval(hp, devpath) * 1000000ull, hp->conf->sensor_learn);
+    hp->changed = 1;
+    dfprintf("Hwmon sensor '%s' added from %s.\n", name, devpath);
+}
+
+static void remove_sensor(struct hotplug *hp, const char *devpath) {
+    for(int i = 0; i < hp->nsensors; i++) {
+        if(strcmp(hp->sensors[i].devpath, devpath) != 0)
+            continue;
+        close(hp->sensors[i].fd);
+        hp->sensors[i] = hp->sensors[--hp->nsensors];
+        hp->changed = 1;
+        dfprintf("Hwmon sensor at %s removed.\n", devpath);
+        return;
+    }
+}
+
+// Additional fans are named like the configured device followed by a number.
+static int fan_name(const struct fan_conf *conf, const char *devname) {
+    const char *base = strrchr(conf->device, '/');
+    size_t len;
+
+    if(conf->sim)
+        return 0;
+    base = base != NULL ? base + 1 : conf->device;
+    len = strlen(base);
+    if(strncmp(devname, base, len) != 0 || devname[len] == '\0')
+        return 0;
+    for(const char *p = devname + len; *p; p++) {
+        if(!isdigit((unsigned char) *p))
+            return 0;
+    }
+    return 1;
+}
+
+static void add_fan(struct hotplug *hp, const char *devname) {
+    char path[HOTPLUG_BUF_SIZE];
+    const char *slash = strrchr(hp->conf->device, '/');
+    int fd;
+
+    for(int i = 0; i < hp->nfans; i++) {
+        if(strcmp(hp->fans[i].devname, devname) == 0)
+            return;
+    }
+    if(hp->nfans == HOTPLUG_MAX_FANS) {
+        fprintf(stderr, "No room for fan device '%s'.\n", devname);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%.*s/%s", slash != NULL ? (int)(slash - hp->conf->device) : 1,
+            slash != NULL ? hp->conf->device : ".", devname);
+    if((fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to open fan device '%s'.\n", path);
+        return;
+    }
+
+    strncpy(hp->fans[hp->nfans].devname, devname, HOTPLUG_PATH_SIZE - 1);
+    hp->fans[hp->nfans++].fd = fd;
+    hp->changed = 1;
+    dfprintf("Fan device '%s' added.\n", path);
+}
+
+static void remove_fan(struct hotplug *hp, const char *devname) {
+    for(int i = 0; i < hp->nfans; i++) {
+        if(strcmp(hp->fans[i].devname, devname) != 0)
+            continue;
+        close(hp->fans[i].fd);
+        hp->fans[i] = hp->fans[--hp->nfans];
+        hp->changed = 1;
+        dfprintf("Fan device '%s' removed.\n", devname);
+        return;
+    }
+}
+
+// Sensors and fans that were already there before the process started.
+static void scan(struct hotplug *hp) {
+    char path[HOTPLUG_BUF_SIZE], real[PATH_MAX];
+    size_t sysfs_len = strlen(hp->conf->sysfs);
+    struct dirent *e;
+    DIR *d;
+
+    snprintf(path, sizeof(path), "%s/class/hwmon", hp->conf->sysfs);
+    if((d = opendir(path)) != NULL) {
+        while((e = readdir(d)) != NULL) {
+            if(e->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/class/hwmon/%s", hp->conf->sysfs, e->d_name);
+            if(realpath(path, real) != NULL && strncmp(real, hp->conf->sysfs, sysfs_len) == 0)
+                add_sensor(hp, real + sysfs_len);
+        }
+        closedir(d);
+    }
+
+    snprintf(path, sizeof(path), "%s", hp->conf->device);
+    *(strrchr(path, '/') != NULL ? strrchr(path, '/') : path) = '\0';
+    if((d = opendir(path[0] ? path : ".")) != NULL) {
+        while((e = readdir(d)) != NULL) {
+            if(fan_name(hp->conf, e->d_name))
+                add_fan(hp, e->d_name);
+        }
+        closedir(d);
+    }
+}
+
+int hotplug_open(struct hotplug *hp, const struct fan_conf *conf) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = UEVENT_GROUP_KERNEL };
+    int on = 1;
+
+    memset(hp, 0, sizeof(*hp));
+    hp->sock = -1;
+    hp->conf = conf;
+    if(!conf->hotplug)
+        return 0;
+
+    hp->sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(hp->sock < 0 || bind(hp->sock, (struct sockaddr*) &addr, sizeof(addr)) < 0
+            || setsockopt(hp->sock, SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+        perror("Unable to listen for uevents");
+        if(hp->sock >= 0)
+            close(hp->sock);
+        hp->sock = -1;
+        return -1;
+    }
+    scan(hp);
+    return 0;
+}
+
+// Splits 'action@devpath\0KEY=value\0...' into the fields of interest.
+static int parse_uevent(char *buf, size_t len, struct uevent *ev) {
+    memset(ev, 0, sizeof(*ev));
+    if(len == 0 || strchr(buf, '@') == NULL)
+        return -1;  // Also skips the 'libudev' messages of the udev daemon.
+
+    for(char *p = buf + strlen(buf) + 1; p < buf + len; p += strlen(p) + 1) {
+        if(strncmp(p, "ACTION=", 7) == 0)
+            ev->action = p + 7;
+        else if(strncmp(p, "DEVPATH=", 8) == 0)
+            ev->devpath = p + 8;
+        else if(strncmp(p, "SUBSYSTEM=", 10) == 0)
+            ev->subsystem = p + 10;
+        else if(strncmp(p, "DEVNAME=", 8) == 0)
+            ev->devname = p + 8;
+    }
+    return ev->action != NULL && ev->devpath != NULL && ev->subsystem != NULL ? 0 : -1;
+}
+
+// Applies all pending uevents. Only called between the ticks.
+void hotplug_handle(struct hotplug *hp) {
+    char buf[UEVENT_BUF_SIZE], cbuf[CMSG_SPACE(sizeof(struct ucred))];
+    struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) - 1 };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+    struct sockaddr_nl from;
+    struct cmsghdr *cm;
+    struct uevent ev;
+    ssize_t n;
+    int add;
+
+    for(;;) {
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if((n = recvmsg(hp->sock, &msg, MSG_DONTWAIT)) <= 0)
+            return;
+        buf[n] = '\0';
+
+        // Only the kernel and root may change the sets.
+        cm = CMSG_FIRSTHDR(&msg);
+        if(cm == NULL || cm->cmsg_type != SCM_CREDENTIALS || ((struct ucred*) CMSG_DATA(cm))->uid != 0)
+            continue;
+        if(parse_uevent(buf, n, &ev) < 0)
+            continue;
+
+        add = strcmp(ev.action, "add") == 0;
+        if(!add && strcmp(ev.action, "remove") != 0)
+            continue;
+        if(strcmp(ev.subsystem, "hwmon") == 0) {
+            if(add)
+                add_sensor(hp, ev.devpath);
+            else
+                remove_sensor(hp, ev.devpath);
+        } else if(ev.devname != NULL && fan_name(hp->conf, ev.devname)) {
+            if(add)
+                add_fan(hp, ev.devname);
+            else
+                remove_fan(hp, ev.devname);
+        }
+    }
+}
+
+void hotplug_close(struct hotplug *hp) {
+    for(int i = 0; i < hp->nsensors; i++)
+        close(hp->sensors[i].fd);
+    for(int i = 0; i < hp->nfans; i++)
+        close(hp->fans[i].fd);
+    if(hp->sock >= 0)
+        close(hp->sock);
+    hp->nsensors = hp->nfans = 0;
+    hp->sock = -1;
+}
+
+/*
+ * Sends a synthetic uevent to the listeners of kernel uevents. Needs root.
+ *
+ *      rpi_fan_util uevent <add|remove> <devpath> <subsystem> [devname]
+ * */
+int uevent_cmd(int argc, char **argv) {
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = UEVENT_GROUP_KERNEL };
+    char buf[UEVENT_BUF_SIZE];
+    int sock, len;
+
+    if(argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: rpi_fan_util uevent <add|remove> <devpath> <subsystem> [devname]\n");
+        return -1;
+    }
+
+    len = snprintf(buf, sizeof(buf), "%s@%s%cACTION=%s%cDEVPATH=%s%cSUBSYSTEM=%s%c", argv[1], argv[2], 0,
+            argv[1], 0, argv[2], 0, argv[3], 0);
+    if(argc == 5 && len < (int) sizeof(buf))
+        len += snprintf(buf + len, sizeof(buf) - len, "DEVNAME=%s%c", argv[4], 0);
+    if(len >= (int) sizeof(buf)) {
+        fprintf(stderr, "Uevent is too long.\n");
+        return -1;
+    }
+
+    sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if(sock < 0 || sendto(sock, buf, len, 0, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        perror("Unable to send the uevent");
+        if(sock >= 0)
+            close(sock);
+        return -1;
+    }
+    close(sock);
+    return 0;
+}
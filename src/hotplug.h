@@ -0,0 +1,52 @@
+/*
+ *  file: hotplug.h
+ *
+ *  Sensors and fans that come and go at runtime. The adaptive process listens for kernel
+ *  uevents on a netlink socket and keeps a set of hwmon temperature sensors (USB and I2C
+ *  chips named by 'hwmon' in the configuration) and of additional fan devices ('rpifan1',
+ *  'rpifan2', ... next to the configured device). Their files are opened when the uevent
+ *  arrives, between the ticks, so a tick only ever reads and writes descriptors that are
+ *  already open.
+ *
+ *  Synthetic uevents can be injected with 'rpi_fan_util uevent' as root.
+ *
+ * */
+
+#ifndef RPIFAN_HOTPLUG_H
+#define RPIFAN_HOTPLUG_H
+
+#include "conf.h"
+#include "fresh.h"
+
+#define HOTPLUG_MAX_SENSORS 4
+#define HOTPLUG_MAX_FANS 4
+#define HOTPLUG_PATH_SIZE 256
+
+struct hp_sensor {
+    char devpath[HOTPLUG_PATH_SIZE];    // Path under sysfs, as in the uevent.
+    int fd;                             // 'temp1_input' of the chip.
+    struct fresh fresh;                 // Seeded from the 'update_interval' of the chip.
+};
+
+struct hp_fan {
+    char devname[HOTPLUG_PATH_SIZE];    // Name under the device directory.
+    int fd;
+};
+
+struct hotplug {
+    int sock;                           // -1 when hotplug is disabled.
+    const struct fan_conf *conf;
+    struct hp_sensor sensors[HOTPLUG_MAX_SENSORS];
+    int nsensors;
+    struct hp_fan fans[HOTPLUG_MAX_FANS];
+    int nfans;
+    int changed;                        // Set when the sets changed, cleared by the user.
+};
+
+int hotplug_open(struct hotplug *hp, const struct fan_conf *conf);
+void hotplug_handle(struct hotplug *hp);
+void hotplug_close(struct hotplug *hp);
+
+int uevent_cmd(int argc, char **argv);
+
+#endif
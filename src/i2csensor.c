@@ -0,0 +1,164 @@
+/*
+ *  file: i2csensor.c
+ *
+ *  Direct i2c-dev backend of the LM75 and TMP102 class temperature chips.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/i2c-dev.h>
+
+#include "rpifan.h"
+#include "i2csensor.h"
+
+#define I2C_PATH_SIZE 32
+#define TMP102_REG_TEMP 0x00
+#define TMP102_REG_CONF 0x01
+#define TMP102_CONF_EM 0x10         // Extended mode bit, in the second byte of the configuration.
+
+static int open_bus(struct i2c_bus *b, int nr) {
+    char path[I2C_PATH_SIZE];
+    unsigned long funcs;
+
+    b->nr = nr;
+    b->nmsgs = 0;
+    snprintf(path, sizeof(path), "/dev/i2c-%d", nr);
+    if((b->fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+        fprintf(stderr, "Unable to open I2C bus '%s'.\n", path);
+        return -1;
+    }
+    if(ioctl(b->fd, I2C_FUNCS, &funcs) < 0)
+        funcs = 0;
+    if(funcs & I2C_FUNC_I2C) {
+        b->smbus = 0;
+    } else if(funcs & I2C_FUNC_SMBUS_READ_WORD_DATA) {
+        b->smbus = 1;
+        dfprintf("I2C bus %d only speaks SMBus, reading a register at a time.\n", nr);
+    } else {
+        fprintf(stderr, "I2C bus '%s' can not read words.\n", path);
+        close(b->fd);
+        b->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Appends the pointer write and the read of every register of the chip to its bus.
+static void add_msgs(struct i2c_bus *b, struct i2c_chip *c) {
+    for(int r = 0; r < c->nregs; r++) {
+        b->msgs[b->nmsgs++] = (struct i2c_msg) { .addr = c->conf->addr, .flags = 0, .len = 1, .buf = &c->ptr[r] };
+        b->msgs[b->nmsgs++] = (struct i2c_msg) { .addr = c->conf->addr, .flags = I2C_M_RD, .len = 2, .buf = c->regs[r] };
+    }
+}
+
+int i2c_open(struct i2c_sensors *is, const struct fan_conf *conf) {
+    int failed[CONF_MAX_I2C], nfailed = 0, b, f;
+    struct i2c_chip *c;
+
+    // A bus that does not open leaves out its chips only, the others are still read.
+    memset(is, 0, sizeof(*is));
+    for(int i = 0; i < conf->ni2c; i++) {
+        for(f = 0; f < nfailed && failed[f] != conf->i2c[i].bus; f++)
+            ;
+        if(f < nfailed)
+            continue;
+
+        for(b = 0; b < is->nbuses && is->buses[b].nr != conf->i2c[i].bus; b++)
+            ;
+        if(b == is->nbuses) {
+            if(b == I2C_MAX_BUSES) {
+                fprintf(stderr, "At most %d I2C buses are supported, bus %d is left out.\n", I2C_MAX_BUSES, conf->i2c[i].bus);
+                failed[nfailed++] = conf->i2c[i].bus;
+                continue;
+            }
+            if(open_bus(&is->buses[b], conf->i2c[i].bus) < 0) {
+                failed[nfailed++] = conf->i2c[i].bus;
+                continue;
+            }
+            is->nbuses++;
+        }
+
+        c = &is->chips[is->nchips++];
+        c->conf = &conf->i2c[i];
+        c->ptr[c->nregs++] = TMP102_REG_TEMP;
+        if(c->conf->chip == CONF_I2C_TMP102)
+            c->ptr[c->nregs++] = TMP102_REG_CONF;
+        c->bus = b;
+        add_msgs(&is->buses[b], c);
+    }
+    if(conf->ni2c && is->nchips == 0)
+        return -1;
+
+    if(is->nchips && i2c_read(is) < 0)
+        fprintf(stderr, "I2C sensors did not answer yet, retrying on every tick.\n");
+    return 0;
+}
+
+// SMBus fallback, a word read per register. SMBus sends the low byte first, the chips the high one.
+static int read_smbus(struct i2c_bus *b, struct i2c_chip *c) {
+    union i2c_smbus_data data;
+    struct i2c_smbus_ioctl_data args = { .read_write = I2C_SMBUS_READ, .size = I2C_SMBUS_WORD_DATA, .data = &data };
+
+    if(ioctl(b->fd, I2C_SLAVE, (unsigned long) c->conf->addr) < 0)
+        return -1;
+    for(int r = 0; r < c->nregs; r++) {
+        args.command = c->ptr[r];
+        if(ioctl(b->fd, I2C_SMBUS, &args) < 0)
+            return -1;
+        c->regs[r][0] = data.word & 0xff;
+        c->regs[r][1] = data.word >> 8;
+    }
+    return 0;
+}
+
+/*
+ * The temperature is left aligned in the top 12 bits, in 1/16 K, lower resolutions leave the
+ * last of them zero. The 13 bit extended mode of the TMP102 takes one more and flags it in the
+ * lowest bit.
+ * */
+static double decode(const struct i2c_chip *c) {
+    int16_t raw = (int16_t)(c->regs[0][0] << 8 | c->regs[0][1]);
+
+    if(c->conf->chip == CONF_I2C_TMP102 && (c->regs[1][1] & TMP102_CONF_EM))
+        return (raw >> 3) * 0.0625;
+    return (raw >> 4) * 0.0625;
+}
+
+// Reads every chip, a syscall per bus. Returns -1 when a bus or a chip failed.
+int i2c_read(struct i2c_sensors *is) {
+    struct i2c_rdwr_ioctl_data xfer;
+    struct i2c_bus *b;
+    struct i2c_chip *c;
+    int ok, ret = 0;
+
+    for(int i = 0; i < is->nbuses; i++) {
+        b = &is->buses[i];
+        xfer = (struct i2c_rdwr_ioctl_data) { .msgs = b->msgs, .nmsgs = b->nmsgs };
+        ok = b->smbus || ioctl(b->fd, I2C_RDWR, &xfer) == b->nmsgs;
+        for(int j = 0; j < is->nchips; j++) {
+            c = &is->chips[j];
+            if(c->bus != i)
+                continue;
+            c->ok = ok && (!b->smbus || read_smbus(b, c) == 0);
+            if(c->ok)
+                c->temp = decode(c);
+            else
+                ret = -1;
+        }
+    }
+    return ret;
+}
+
+void i2c_close(struct i2c_sensors *is) {
+    for(int i = 0; i < is->nbuses; i++) {
+        if(is->buses[i].fd >= 0)
+            close(is->buses[i].fd);
+    }
+    is->nbuses = 0;
+    is->nchips = 0;
+}
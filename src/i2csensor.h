@@ -0,0 +1,55 @@
+/*
+ *  file: i2csensor.h
+ *
+ *  External temperature chips (LM75 and TMP102 class) read straight from '/dev/i2c-N', without
+ *  a kernel hwmon driver bound to them. Every chip on a bus is read in one combined I2C_RDWR
+ *  transaction per tick: a pointer write and a register read for each register, with repeated
+ *  starts in between. A TMP102 also returns its configuration register in the same transaction,
+ *  so a switch to 13 bit extended mode or a reset of the chip is followed on the next tick. A
+ *  chip that does not answer fails the whole transaction of its bus.
+ *
+ *  Adapters that only speak SMBus (i2c-stub among them) fall back to a word read per register.
+ *
+ * */
+
+#ifndef RPIFAN_I2CSENSOR_H
+#define RPIFAN_I2CSENSOR_H
+
+#include <stdint.h>
+#include <linux/i2c.h>
+
+#include "conf.h"
+
+#define I2C_MAX_BUSES 4
+#define I2C_MAX_REGS 2              // Registers read from one chip per tick.
+
+struct i2c_chip {
+    const struct conf_i2c *conf;
+    int bus;                        // Index in the buses.
+    uint8_t ptr[I2C_MAX_REGS];      // Register pointers, written before each read.
+    uint8_t regs[I2C_MAX_REGS][2];  // Big-endian contents, as on the wire.
+    int nregs;
+    int ok;                         // Whether the last read returned this chip.
+    double temp;
+};
+
+struct i2c_bus {
+    int nr;
+    int fd;
+    int smbus;                      // Only SMBus word reads, no combined transactions.
+    struct i2c_msg msgs[CONF_MAX_I2C * I2C_MAX_REGS * 2];
+    int nmsgs;
+};
+
+struct i2c_sensors {
+    struct i2c_chip chips[CONF_MAX_I2C];
+    int nchips;
+    struct i2c_bus buses[I2C_MAX_BUSES];
+    int nbuses;
+};
+
+int i2c_open(struct i2c_sensors *is, const struct fan_conf *conf);
+int i2c_read(struct i2c_sensors *is);
+void i2c_close(struct i2c_sensors *is);
+
+#endif
@@ -0,0 +1,432 @@
+/*
+ *  file: loadreplay.c
+ *
+ *  Replays a recorded CPU utilisation profile on the board, so that the policies can be
+ *  benchmarked under the load shape of production instead of a synthetic stress. One worker
+ *  process per core, pinned to it, runs a duty-cycled busy loop: in every short period it
+ *  spins until it has used its share of CPU time, then sleeps until the period ends. The
+ *  fan policy runs as usual in the adaptive process next to it.
+ *
+ *  The parent samples /proc/stat, the temperature and the duty cycle once per step, so the
+ *  utilisation that was achieved is reported next to the thermal results.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <math.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "rpifan.h"
+#include "conf.h"
+#include "sim.h"
+
+#define REPLAY_MAX_CORES 64
+#define REPLAY_MAX_STEPS 1000000
+#define REPLAY_STAT_SIZE 8192
+#define REPLAY_TZ_PATH_SIZE 64
+
+// Cumulative CPU time of one core, in clock ticks.
+struct core_time {
+    uint64_t busy;
+    uint64_t total;
+};
+
+struct replay_trace {
+    float *util;            // Target of step s on core c at [s * ncores + c], 0..1.
+    long nsteps;
+    int ncores;
+};
+
+static volatile sig_atomic_t replay_stop = 0;
+
+static void on_replay_signal(int sig) {
+    replay_stop = 1;
+}
+
+/*
+ * Parses a 'cpuN ...' line of /proc/stat. Returns the core, -1 for the aggregate 'cpu' line
+ * and -2 for other lines. Idle and iowait are the time not busy.
+ * */
+static int parse_cpu_line(const char *line, struct core_time *ct) {
+    uint64_t v[8] = { 0 };
+    char *end;
+    int core = -1;
+
+    if(strncmp(line, "cpu", 3) != 0)
+        return -2;
+    line += 3;
+    if(*line >= '0' && *line <= '9')
+        core = strtol(line, (char**) &line, 10);
+    ct->total = 0;
+    for(int i = 0; i < 8; i++) {
+        v[i] = strtoull(line, &end, 10);
+        if(end == line)
+            break;
+        line = end;
+        ct->total += v[i];
+    }
+    ct->busy = ct->total - v[3] - v[4];
+    return core;
+}
+
+// Samples the CPU time of the first 'ncores' cores.
+static int read_cores(int fd, char *buf, struct core_time *ct, int ncores) {
+    struct core_time t;
+    char *line, *nl;
+    ssize_t n;
+    int core;
+
+    if((n = pread(fd, buf, REPLAY_STAT_SIZE - 1, 0)) <= 0)
+        return -1;
+    buf[n] = '\0';
+    for(line = buf; line != NULL && *line; line = nl != NULL ? nl + 1 : NULL) {
+        nl = strchr(line, '\n');
+        core = parse_cpu_line(line, &t);
+        if(core >= 0 && core < ncores)
+            ct[core] = t;
+        else if(core == -2)
+            break;
+    }
+    return 0;
+}
+
+static int add_step(struct replay_trace *tr, long *cap, const float *util, int ncores) {
+    float *tmp;
+
+    if(tr->nsteps == *cap) {
+        if(*cap == REPLAY_MAX_STEPS || (tmp = realloc(tr->util, *cap * 2 * tr->ncores * sizeof(float))) == NULL)
+            return -1;
+        tr->util = tmp;
+        *cap *= 2;
+    }
+    // A single column loads every core alike.
+    for(int c = 0; c < tr->ncores; c++)
+        tr->util[tr->nsteps * tr->ncores + c] = util[ncores == 1 ? 0 : c];
+    tr->nsteps++;
+    return 0;
+}
+
+/*
+ * Loads a trace, in one of two formats:
+ *
+ *  - a /proc/stat capture, consecutive copies of the file taken one step apart, e.g.
+ *    'while :; do cat /proc/stat; sleep 1; done'. Every pair of copies gives one step.
+ *  - one line per step with the utilisation in percent, either one value for all cores or
+ *    one per core, separated by spaces or commas. '#' starts a comment.
+ *
+ * 'ncores' is the amount of cores to replay on, a trace of more cores is cut. A capture of
+ * fewer cores lowers tr->ncores to the cores it has.
+ * */
+static int load_trace(const char *path, struct replay_trace *tr, int ncores) {
+    char line[CONF_LINE_SIZE], *p, *end;
+    struct core_time prev[REPLAY_MAX_CORES] = { 0 }, cur[REPLAY_MAX_CORES] = { 0 }, ct;
+    float util[REPLAY_MAX_CORES] = { 0 };
+    int lineno = 0, n, core, capture = -1, have_prev = 0, seen = 0, ncaptured = 0;
+    long cap = 1024;
+    FILE *f;
+
+    if((f = fopen(path, "r")) == NULL) {
+        perror("Unable to open the trace");
+        return -1;
+    }
+    tr->ncores = ncores;
+    tr->nsteps = 0;
+    if((tr->util = malloc(cap * ncores * sizeof(float))) == NULL)
+        goto _fail;
+
+    while(fgets(line, sizeof(line), f) != NULL) {
+        lineno++;
+        if(capture < 0 && line[0] != '#' && line[strspn(line, " \t\r\n")] != '\0')
+            capture = strncmp(line, "cpu", 3) == 0;
+
+        if(capture == 1) {
+            core = parse_cpu_line(line, &ct);
+            if(core == -1 && seen) {
+                // The aggregate line starts the next copy, the previous one is complete.
+                if(!have_prev && ncaptured < ncores)
+                    tr->ncores = ncores = ncaptured;
+                for(int c = 0; have_prev && c < ncores; c++) {
+                    util[c] = cur[c].total > prev[c].total ?
+                        (double)(cur[c].busy - prev[c].busy) / (cur[c].total - prev[c].total) : 0.0;
+                }
+                if(have_prev && add_step(tr, &cap, util, ncores) < 0)
+                    goto _fail;
+                memcpy(prev, cur, sizeof(prev));
+                have_prev = 1;
+            }
+            if(core >= 0 && core < ncores) {
+                cur[core] = ct;
+                if(!have_prev && core >= ncaptured)
+                    ncaptured = core + 1;
+            }
+            seen |= core >= 0;
+            continue;
+        }
+
+        if((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        for(n = 0, p = line; n < REPLAY_MAX_CORES; p = end, n++) {
+            while(*p == ' ' || *p == '\t' || *p == ',')
+                p++;
+            util[n] = strtod(p, &end) / 100.0;
+            if(end == p)
+                break;
+            if(util[n] < 0.0 || util[n] > 1.0) {
+                fprintf(stderr, "%s:%d: expected a utilisation from 0 to 100.\n", path, lineno);
+                goto _fail;
+            }
+        }
+        if(n == 0)
+            continue;
+        if(n != 1 && n < ncores) {
+            fprintf(stderr, "%s:%d: expected 1 or at least %d values.\n", path, lineno, ncores);
+            goto _fail;
+        }
+        if(add_step(tr, &cap, util, n) < 0)
+            goto _fail;
+    }
+
+    // The last copy of a capture has no aggregate line after it.
+    if(capture == 1 && have_prev && seen) {
+        for(int c = 0; c < ncores; c++) {
+            util[c] = cur[c].total > prev[c].total ?
+                (double)(cur[c].busy - prev[c].busy) / (cur[c].total - prev[c].total) : 0.0;
+        }
+        if(add_step(tr, &cap, util, ncores) < 0)
+            goto _fail;
+    }
+    fclose(f);
+    return 0;
+
+_fail:
+    fclose(f);
+    free(tr->util);
+    tr->util = NULL;
+    return -1;
+}
+
+static uint64_t thread_cpu_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * Worker of one core. The busy part of each period is measured in CPU time, not wall time,
+ * so time the worker is preempted for does not count towards its share. Deadlines are
+ * absolute from the common start.
+ * */
+static void worker(const struct replay_trace *tr, int core, uint64_t start, uint64_t step_ns, uint64_t period_ns) {
+    uint64_t periods = step_ns / period_ns, deadline, busy, cpu0;
+    cpu_set_t set;
+
+    // Stopped by the parent, whose handlers were inherited.
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) < 0)
+        perror("Unable to pin the load worker");
+
+    for(long s = 0; s < tr->nsteps; s++) {
+        busy = tr->util[s * tr->ncores + core] * period_ns;
+        for(uint64_t p = 0; p < periods; p++) {
+            deadline = start + s * step_ns + (p + 1) * period_ns;
+            cpu0 = thread_cpu_ns();
+            while(thread_cpu_ns() - cpu0 < busy && now_ns() < deadline)
+                ;
+            sleep_until(deadline);
+        }
+    }
+    _exit(0);
+}
+
+static double read_temp(int fd) {
+    char buf[16];
+    ssize_t n;
+
+    if(fd < 0 || (n = pread(fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return NAN;
+    buf[n] = '\0';
+    return atoi(buf) / 1000.0;
+}
+
+/*
+ * Replays a utilisation trace.
+ *
+ *      rpi_fan_util loadreplay [-s step ms] [-p period ms] [-c cores] [-z zone] [-d device] [-o csv] <trace>
+ *
+ * Reports how closely the achieved utilisation followed the trace, as the mean and largest
+ * absolute error over all steps and cores, and the temperature and duty cycle meanwhile.
+ * */
+int loadreplay_cmd(int argc, char **argv) {
+    const char *device = CONF_DEVICE, *csv = NULL;
+    struct replay_trace tr = { 0 };
+    struct core_time t0[REPLAY_MAX_CORES], t1[REPLAY_MAX_CORES];
+    pid_t pids[REPLAY_MAX_CORES];
+    char tz_path[REPLAY_TZ_PATH_SIZE], *statbuf = NULL;
+    uint64_t start, step_ns, period_ms = 100, step_ms = 1000, dc;
+    double target, achieved, util, err, err_sum = 0.0, err_max = 0.0, bias = 0.0, temp, temp_sum = 0.0, temp_max = 0.0;
+    double duty_sum = 0.0, *rows = NULL;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN), done = 0, nduty = 0, ntemp = 0;
+    int opt, ncores = 0, zone = 0, stat_fd = -1, tz_fd = -1, fd = -1, ret = -1, spawned = 0;
+    FILE *f;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "s:p:c:z:d:o:")) != -1) {
+        switch(opt) {
+            case 's': step_ms = strtoul(optarg, NULL, 10); break;
+            case 'p': period_ms = strtoul(optarg, NULL, 10); break;
+            case 'c': ncores = atoi(optarg); break;
+            case 'z': zone = atoi(optarg); break;
+            case 'd': device = optarg; break;
+            case 'o': csv = optarg; break;
+            default:
+                goto _usage;
+        }
+    }
+    if(optind != argc - 1)
+        goto _usage;
+    if(ncores <= 0 || ncores > ncpus)
+        ncores = ncpus;
+    if(ncores > REPLAY_MAX_CORES)
+        ncores = REPLAY_MAX_CORES;
+    if(period_ms == 0 || step_ms < period_ms) {
+        fprintf(stderr, "Period must be between 1 ms and the step.\n");
+        return -1;
+    }
+
+    if(load_trace(argv[optind], &tr, ncores) < 0)
+        return -1;
+    ncores = tr.ncores;
+    if(tr.nsteps == 0) {
+        fprintf(stderr, "Trace '%s' has no steps.\n", argv[optind]);
+        goto _free;
+    }
+    statbuf = malloc(REPLAY_STAT_SIZE);
+    rows = malloc(tr.nsteps * 4 * sizeof(double));
+    if(statbuf == NULL || rows == NULL || (stat_fd = open("/proc/stat", O_RDONLY)) < 0) {
+        perror("Unable to prepare the replay");
+        goto _free;
+    }
+
+    // Thermal results are optional, the replay alone still measures the fidelity.
+    snprintf(tz_path, sizeof(tz_path), "/sys/class/thermal/thermal_zone%d/temp", zone);
+    tz_fd = open(tz_path, O_RDONLY);
+    if(strcmp(device, SIM_DEVICE) != 0)
+        fd = open(device, O_RDONLY);
+    if(tz_fd < 0)
+        fprintf(stderr, "Unable to open 'thermal_zone%d', the temperature is not reported.\n", zone);
+
+    signal(SIGINT, on_replay_signal);
+    signal(SIGTERM, on_replay_signal);
+
+    fprintf(stdout, "Replaying %ld steps of %lu ms on %d core(s).\n", tr.nsteps, step_ms, ncores);
+    step_ns = step_ms * 1000000ull;
+    start = now_ns() + step_ns;
+    for(int c = 0; c < ncores; c++) {
+        if((pids[c] = fork()) == 0)
+            worker(&tr, c, start, step_ns, period_ms * 1000000ull);
+        if(pids[c] < 0) {
+            perror("Unable to start the load workers");
+            replay_stop = 1;
+            goto _stop;
+        }
+        spawned++;
+    }
+
+    sleep_until(start);
+    read_cores(stat_fd, statbuf, t0, ncores);
+    for(; done < tr.nsteps && !replay_stop; done++) {
+        sleep_until(start + (done + 1) * step_ns);
+        read_cores(stat_fd, statbuf, t1, ncores);
+
+        target = achieved = 0.0;
+        for(int c = 0; c < ncores; c++) {
+            util = t1[c].total > t0[c].total ? (double)(t1[c].busy - t0[c].busy) / (t1[c].total - t0[c].total) : 0.0;
+            target += tr.util[done * ncores + c];
+            achieved += util;
+            err = util - tr.util[done * ncores + c];
+            bias += err;
+            err_sum += fabs(err);
+            if(fabs(err) > err_max)
+                err_max = fabs(err);
+        }
+        memcpy(t0, t1, sizeof(t0));
+
+        temp = read_temp(tz_fd);
+        if(!isnan(temp)) {
+            temp_sum += temp;
+            temp_max = ntemp++ == 0 || temp > temp_max ? temp : temp_max;
+        }
+        rows[done * 4 + 3] = NAN;
+        if(fd >= 0 && ioctl(fd, R_PWM_VALUE, &dc) == 0) {
+            rows[done * 4 + 3] = (double) dc / PWM_PERIOD;
+            duty_sum += rows[done * 4 + 3];
+            nduty++;
+        }
+        rows[done * 4] = target / ncores;
+        rows[done * 4 + 1] = achieved / ncores;
+        rows[done * 4 + 2] = temp;
+    }
+
+    fprintf(stdout, "%ld of %ld steps replayed.\n", done, tr.nsteps);
+    if(done) {
+        fprintf(stdout, "Utilisation error: mean %.1f %%, max %.1f %%, bias %+.1f %%.\n",
+                100.0 * err_sum / (done * ncores), 100.0 * err_max, 100.0 * bias / (done * ncores));
+    }
+    if(ntemp)
+        fprintf(stdout, "Temperature: mean %.1f C, max %.1f C.\n", temp_sum / ntemp, temp_max);
+    if(nduty)
+        fprintf(stdout, "Duty cycle: mean %.1f %%.\n", 100.0 * duty_sum / nduty);
+
+    if(csv != NULL) {
+        if((f = fopen(csv, "w")) == NULL) {
+            perror("Unable to write the replay file");
+            goto _stop;
+        }
+        fprintf(f, "step,time_ms,target,achieved,temp,duty\n");
+        for(long i = 0; i < done; i++) {
+            fprintf(f, "%ld,%lu,%.3f,%.3f,%.1f,%.3f\n", i, i * step_ms, rows[i * 4], rows[i * 4 + 1],
+                    rows[i * 4 + 2], rows[i * 4 + 3]);
+        }
+        fclose(f);
+    }
+    ret = 0;
+
+_stop:
+    for(int c = 0; c < spawned; c++) {
+        if(replay_stop)
+            kill(pids[c], SIGTERM);
+        waitpid(pids[c], NULL, 0);
+    }
+_free:
+    if(stat_fd >= 0)
+        close(stat_fd);
+    if(tz_fd >= 0)
+        close(tz_fd);
+    if(fd >= 0)
+        close(fd);
+    free(statbuf);
+    free(rows);
+    free(tr.util);
+    return ret;
+
+_usage:
+    fprintf(stderr, "Usage: rpi_fan_util loadreplay [-s step ms] [-p period ms] [-c cores] [-z zone] [-d device] [-o csv] <trace>\n"
+            "The trace is a /proc/stat capture taken once per step, or one line per step with the\n"
+            "utilisation in percent, for all cores or one value per core.\n");
+    return -1;
+}
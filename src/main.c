@@ -12,23 +12,55 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
 #include <sys/ioctl.h>
 
+#include "rpifan.h"
+#include "conf.h"
+#include "policy.h"
+#include "adaptive.h"
+#include "history.h"
+#include "sketch.h"
+#include "telemetry.h"
+#include "shadow.h"
+#include "hotplug.h"
+#include "standby.h"
+#include "rpifan_ctl.h"
+
 #define PWM_GPIOS 12:case 13:case 18:case 19
-#define ADAPTIVE_PROCESS "adaptive_rpifan_pwm        "
 #define KBUF_SIZE 4
-#define TZ_BUF_SIZE 6
-#define PWM_PERIOD 50000000
-
-// Only prints in debug mode.
-#define dfprintf(format, ...)           \
-    if(debug) {                         \
-        printf("\033[1;33m> "format"\033[0m", ##__VA_ARGS__);  \
-    }
-
-void adaptive(int, uint64_t, char*);
+#define BENCH_BUDGET_NS 1000
+
+int spawn_adaptive(int, uint64_t, char*, struct fan_conf*, struct policy*, struct shadows*);
+int bench(struct policy*, uint64_t);
+int history_cmd(int, char**);
+int quantile_cmd(int, char**);
+int stepbench_cmd(int, char**);
+int play_cmd(int, char**);
+int loadreplay_cmd(int, char**);
+int top_cmd(int, char**);
+int countbench_cmd(int, char**);
+int ctlbench_cmd(int, char**);
 void usage(void);
 
+// Subcommands, given as the first argument instead of flags.
+static const struct {
+    const char *name;
+    int (*run)(int, char**);
+} commands[] = {
+    { "history", history_cmd },
+    { "quantile", quantile_cmd },
+    { "collect", collect_cmd },
+    { "stepbench", stepbench_cmd },
+    { "play", play_cmd },
+    { "loadreplay", loadreplay_cmd },
+    { "top", top_cmd },
+    { "uevent", uevent_cmd },
+    { "countbench", countbench_cmd },
+    { "ctlbench", ctlbench_cmd },
+};
+
 /* 
  * Fan configuration structure
  *
@@ -44,21 +76,26 @@ union fan_config {
     };
 };
 
-// Those are defined in rpi.h
-#define WR_PWM_VALUE _IOW('r', 'a', uint64_t*)
-#define R_PWM_VALUE _IOR('r', 'b', uint64_t*)
-
 // FLAGS
-static int debug = 0;
+int debug = 0;
 
 int main(int argc, char **argv) {
     union fan_config config, old_config;
     char value[KBUF_SIZE], old_value[KBUF_SIZE];
-    char *pwm_value = NULL, *gpio_value = NULL, *duty_cycle = NULL;
-    uint64_t adapt_ms = 0;
-    int fd, opt = 0;
+    char *pwm_value = NULL, *gpio_value = NULL, *duty_cycle = NULL, *conf_path = NULL;
+    uint64_t adapt_ms = 0, bench_n = 0;
+    struct fan_conf conf;
+    struct policy policy;
+    struct shadows shadows = { 0 };
+    unsigned hold_s = 0;
+    int fd, opt = 0, standby = 0;
+
+    for(size_t i = 0; argc > 1 && i < sizeof(commands) / sizeof(commands[0]); i++) {
+        if(strcmp(argv[1], commands[i].name) == 0)
+            return commands[i].run(argc - 1, argv + 1);
+    }
 
-    while((opt = getopt(argc, argv, "dha:p:g:c:")) != -1) {
+    while((opt = getopt(argc, argv, "dha:p:g:c:f:b:St:")) != -1) {
         switch(opt) {
             case 'd':
                 debug = 1;
@@ -77,11 +114,41 @@ int main(int argc, char **argv) {
             case 'g':
                 gpio_value = optarg; // Argument for GPIO pin.
                 break;
-            case 'c':
+            case 'c': {
+                char *end;
+                long dc = strtol(optarg, &end, 10);
+
+                // Only 'auto' hands the fan back, a negative or partial number is a typo.
+                if(strcmp(optarg, "auto") != 0 && (end == optarg || *end != '\0' || dc < 0 || dc > 100)) {
+                    fprintf(stderr, "Custom PWM duty cycle must be between 0 and 100, or 'auto'.\n");
+                    return -1;
+                }
                 duty_cycle = optarg;
                 break;
+            }
+            case 'f':
+                conf_path = optarg; // Configuration file for the adaptive PWM.
+                break;
+            case 'b':
+                bench_n = strtoull(optarg, NULL, 10);
+                break;
+            case 'S':
+                standby = 1;    // Hot standby of another adaptive PWM process.
+                break;
+            case 't': {
+                char *end;
+                unsigned long secs = strtoul(optarg, &end, 10);
+
+                // How long -c overrides a running adaptive PWM, 0 leaves it to its 'manual_hold'.
+                if(*optarg < '0' || *optarg > '9' || *end != '\0' || secs > UINT_MAX) {
+                    fprintf(stderr, "Hold time must be a number of seconds.\n");
+                    return -1;
+                }
+                hold_s = secs;
+                break;
+            }
             case '?':
-                if(optopt == 'p' || optopt == 'a' || optopt == 'c' || optopt == 'g') {
+                if(optopt == 'p' || optopt == 'a' || optopt == 'c' || optopt == 'g' || optopt == 'f' || optopt == 'b' || optopt == 't') {
                     fprintf(stderr, "Option -%c requires an argument. Use -h for info.\n", optopt);
                     return -1;
                 } 
@@ -90,8 +157,67 @@ int main(int argc, char **argv) {
         }
     }
 
+    // Loading the configuration before anything else, so errors are seen before forking.
+    if(conf_path != NULL) {
+        if(conf_load(conf_path, &conf) < 0)
+            return -1;
+    } else {
+        conf_default(&conf);
+    }
+    conf.standby = standby;
+
+    // A running adaptive PWM would overwrite a plain write on its next tick, it takes an override.
+    if(duty_cycle != NULL && !adapt_ms) {
+        double manual = strcmp(duty_cycle, "auto") == 0 ? -1.0 : atoi(duty_cycle) / 100.0;
+        struct rpifan_ctl ctl;
+        int sent = -ENOTCONN;
+
+        // The socket also wakes a process in deep sleep, the heartbeat is only seen on its next tick.
+        if(manual <= 1.0 && conf.control[0] != '\0' && rpifan_ctl_open(&ctl, conf.control) == 0) {
+            sent = rpifan_ctl_set_duty(&ctl, manual, hold_s);
+            rpifan_ctl_close(&ctl);
+        }
+        // One that lost control answers -EBUSY, the owner may still be found through the heartbeat.
+        if(sent < 0 && sent != -ENOTCONN && sent != -EBUSY && sent != -ECONNRESET) {
+            fprintf(stderr, "Adaptive PWM refused the duty cycle: %s.\n", strerror(-sent));
+            return -1;
+        }
+        if(manual <= 1.0 && (sent == 0 || standby_manual(conf.heartbeat, manual, hold_s) == 0)) {
+            if(manual < 0.0)
+                fprintf(stdout, "Adaptive PWM returns to automatic control.\n");
+            else if(hold_s)
+                fprintf(stdout, "Adaptive PWM holds %.0f %% for %u seconds.\n", manual * 100.0, hold_s);
+            else
+                fprintf(stdout, "Adaptive PWM holds %.0f %% for its 'manual_hold'.\n", manual * 100.0);
+            return 0;
+        }
+        if(manual < 0.0) {
+            fprintf(stderr, "No adaptive PWM process is running.\n");
+            return -1;
+        }
+    }
+    // Only the adaptive PWM and its benchmark run a policy, plain writes skip loading it.
+    if((adapt_ms || bench_n) && policy_init(&policy, &conf) < 0)
+        return -1;
+
+    if(bench_n)
+        return bench(&policy, bench_n);
+
+    // Shadows only run next to the adaptive PWM, but their errors are also seen before forking.
+    if(adapt_ms && shadows_init(&shadows, &conf) < 0)
+        return -1;
+
+    // The simulated board has no driver, only the adaptive PWM makes sense for it.
+    if(conf.sim) {
+        if(!adapt_ms) {
+            fprintf(stderr, "The simulated device only supports adaptive PWM (-a).\n");
+            return -1;
+        }
+        return spawn_adaptive(-1, adapt_ms, argv[0], &conf, &policy, &shadows);
+    }
+
     // Opening the device.
-    fd = open("/dev/rpifan", O_RDWR);
+    fd = open(conf.device, O_RDWR);
     if(fd < 0) {
         fprintf(stderr, "Unable to open 'rpifan' device.\n");
         return -1;
@@ -133,15 +259,9 @@ int main(int argc, char **argv) {
         config.pwm_mode = (uint8_t) pwm_v;
     }
 
-    // Manual duty cycle.
+    // Manual duty cycle, already checked to be within 0 and 100.
     if(duty_cycle != NULL) {
         uint64_t duty_c = (atoi(duty_cycle) * PWM_PERIOD) / 100;
-        
-        if (duty_c < 0 || duty_c > PWM_PERIOD) {
-            fprintf(stderr, "Custom PWM duty cycle must be between 1 and 100.\n");
-            close(fd);
-            return -1;
-        }
 
         if(ioctl(fd, WR_PWM_VALUE, &duty_c)) {
             fprintf(stderr, "Unable to write value to the driver via IOCTL call.\n"); 
@@ -174,18 +294,11 @@ int main(int argc, char **argv) {
     if(adapt_ms) {
         switch(old_config.gpio_num) {
             case PWM_GPIOS: 
-                int pid = fork();
-                if(pid < 0) {
-                    perror("Failed to fork process");
+                if(spawn_adaptive(fd, adapt_ms, argv[0], &conf, &policy, &shadows) < 0) {
                     close(fd);
                     return -1;
-                } else if (pid == 0) {
-                    adaptive(fd, adapt_ms, argv[0]);
-                    return 0;
-                } else {
-                    fprintf(stdout, "Adaptive PWM process started with PID: %d\n", pid);
-                    goto _exit;  // Work of this process is done.
                 }
+                goto _exit;  // Work of this process is done.
             default:
                 fprintf(stderr, "Current GPIO pin is not a PWM pin. Unable to use adaptive PWM.\n");    
         }
@@ -209,56 +322,193 @@ _exit:
     return 0;
 }
 
-// This function will only be executed from a child process. The fd would be provided to child.
-void adaptive(int fd, uint64_t timeout, char *proc_name) {
-    uint64_t curr_temp, max_temp = 0, new_dc;
-    char tzbuf[TZ_BUF_SIZE];
+// Forks the adaptive PWM process. Only returns in the parent.
+int spawn_adaptive(int fd, uint64_t ms, char *proc_name, struct fan_conf *conf, struct policy *policy, struct shadows *sh) {
+    int pid = fork();
+
+    if(pid < 0) {
+        perror("Failed to fork process");
+        return -1;
+    } else if(pid == 0) {
+        adaptive(fd, ms, proc_name, conf, policy, sh);
+    }
+    fprintf(stdout, "Adaptive PWM process started with PID: %d\n", pid);
+    return 0;
+}
+
+/*
+ * Measures the per tick cost of the configured policy.
+ *
+ * Inputs are swept over a realistic range, so the result is not a best case of one cached
+ * path. Only the policy step itself is measured, sensor reads are not part of it.
+ * */
+int bench(struct policy *policy, uint64_t n) {
+    struct rpifan_state st = {
+        .abi = RPIFAN_PLUGIN_ABI,
+        .size = sizeof(struct rpifan_state),
+        .interval_ms = 1000,
+        .ntemps = 1,
+        .temp_max = 90.0,
+    };
+    uint64_t start, ns;
+    double per_tick;
+
+    start = now_ns();
+    for(st.tick = 0; st.tick < n; st.tick++) {
+        st.temps[0] = st.temp = 30.0 + (st.tick % 600) / 10.0;
+        st.psi = (st.tick % 100) / 100.0;
+        st.load = (st.tick % 400) / 100.0;
+        st.time_ns = st.tick * 1000000000ull;
+        st.prev_duty = policy_step(policy, &st);
+    }
+    ns = now_ns() - start;
+    per_tick = (double) ns / n;
+
+    fprintf(stdout, "Policy: %s\n", policy->name);
+    if(policy->kind == POLICY_EXPR)
+        fprintf(stdout, "Bytecode: %u instructions.\n", policy->expr->ncode);
+    fprintf(stdout, "%lu steps in %lu us, %.1f ns per tick (budget %d ns): %s.\n",
+            n, ns / 1000, per_tick, BENCH_BUDGET_NS, per_tick <= BENCH_BUDGET_NS ? "ok" : "over budget");
+    lat_print(stdout, "Step cost", &policy->cost);
+    policy_teardown(policy);
+    return per_tick <= BENCH_BUDGET_NS ? 0 : -1;
+}
 
-    setsid();
+static void print_sample(void *ctx, uint64_t ts, const double *vals, int nvalues) {
+    fprintf(stdout, "%lu.%03lu", ts / 1000, ts % 1000);
+    for(int i = 0; i < nvalues - 1; i++)
+        fprintf(stdout, ",%.3f", vals[i] / 1000.0);
+    fprintf(stdout, ",%.2f\n", vals[nvalues - 1] * 100.0 / PWM_PERIOD);
+}
 
-    int tz_fd = open("/sys/class/thermal/thermal_zone0/temp", O_RDONLY);
-    if(tz_fd < 0) {
-        fprintf(stderr, "Unable to open 'thermal_zone' device, aborting...\n");
-        close(fd);
-        exit(-1);
+/*
+ * Prints samples of a history file as CSV. The range is given in seconds since the epoch,
+ * negative values are relative to the last stored sample.
+ *
+ *      rpi_fan_util history <file> [from] [to]
+ * */
+int history_cmd(int argc, char **argv) {
+    struct history hist;
+    uint64_t last = 0, from = 0, to = UINT64_MAX;
+    int64_t arg;
+
+    if(argc < 2) {
+        fprintf(stderr, "Usage: rpi_fan_util history <file> [from] [to]\n");
+        return -1;
     }
+    if(hist_load(&hist, argv[1], NULL, NULL) < 0)
+        return -1;
+    if(hist.count > 0)
+        last = hist.blocks[hist.head].last_ts;
 
-    sprintf(proc_name, ADAPTIVE_PROCESS);  // This changes the name of the child process.
+    for(int i = 2; i < argc && i < 4; i++) {
+        arg = strtoll(argv[i], NULL, 10) * 1000;
+        *(i == 2 ? &from : &to) = arg < 0 ? last + arg : (uint64_t) arg;
+    }
 
-    /* 
-     * Until a proper signal is received, would work under the curtains. 
-     *
-     * Checks the current CPU 
-     * */
-    for(;;) { 
-        if (lseek(tz_fd, 0, SEEK_SET) < 0 || read(tz_fd, tzbuf, TZ_BUF_SIZE) < 0) {
-            fprintf(stderr, "Error reading from thermal zone device");
-            close(fd);
-            close(tz_fd);
-            exit(-1);
-        }
-        curr_temp = (uint64_t) atoi(tzbuf);
-        if(curr_temp < 0) {
-            fprintf(stderr, "Unable to read data from thermal zone sensor. Retrying in %lu seconds.\n", timeout / 1000);
-        }
+    fprintf(stdout, "time");
+    for(int i = 0; i < hist.nvalues - 1; i++)
+        fprintf(stdout, ",zone%d", i);
+    fprintf(stdout, ",duty\n");
+    hist_query(&hist, from, to, print_sample, NULL);
 
-        // This part is adaptive i.e defined the maximum dynamically.
-        if(curr_temp > max_temp) {
-            max_temp = curr_temp;
-            dfprintf("New maximum temperature found. Remembering: %ld C.\n", curr_temp / 1000);
-        }
+    dfprintf("%lu samples in %zu bytes.\n", hist_samples(&hist), hist_bytes(&hist));
+    hist_free(&hist);
+    return 0;
+}
 
-        // Calculating new duty cycle based on maximal and current temperature.
-        new_dc = (curr_temp * PWM_PERIOD) / max_temp; 
+struct hourly {
+    int metric;
+    int count;
+    struct {
+        uint64_t hour;
+        struct kll k;
+    } *hours;
+};
 
-        dfprintf("CPU temperature: %ld C. Writing new duty cycle: %ld\n", curr_temp / 1000, new_dc);
-        
-        if(ioctl(fd, WR_PWM_VALUE, &new_dc)) {    //   Writing calibrated value.
-            fprintf(stderr, "Unable to write value to the driver via IOCTL call.\n"); 
-        }
+static void collect_sketch(void *ctx, uint32_t tag, const void *data, uint32_t len) {
+    struct hourly *h = ctx;
+    void *hours;
+    struct kll k;
+    uint64_t hour;
+    int metric;
+
+    if(tag != HIST_SECTION_SKETCH || sketch_unpack(data, len, &hour, &metric, &k) < 0 || metric != h->metric)
+        return;
+
+    hours = realloc(h->hours, (h->count + 1) * sizeof(*h->hours));
+    if(hours == NULL)
+        return;
+    h->hours = hours;
+    h->hours[h->count].hour = hour;
+    h->hours[h->count++].k = k;
+}
+
+static int cmp_hour(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
 
-        usleep(timeout * 1000);
+    return (x > y) - (x < y);
+}
+
+static void print_quantiles(const char *label, const struct kll *k, double *qs, int nq) {
+    fprintf(stdout, "%-16s %8lu", label, k->n);
+    for(int i = 0; i < nq; i++)
+        fprintf(stdout, " %9.2f", kll_quantile(k, qs[i]));
+    fprintf(stdout, "\n");
+}
+
+/*
+ * Prints quantiles of a metric for each hour stored in a history file, and over all of them.
+ *
+ *      rpi_fan_util quantile <file> <temp|duty|latency> [q...]
+ * */
+int quantile_cmd(int argc, char **argv) {
+    double qs[16] = { 0.5, 0.95, 0.99 };
+    struct hourly h = { .metric = -1 };
+    struct history hist;
+    struct kll all;
+    char label[32];
+    time_t t;
+    int nq = 3;
+
+    if(argc < 3) {
+        fprintf(stderr, "Usage: rpi_fan_util quantile <file> <temp|duty|latency> [q...]\n");
+        return -1;
+    }
+    for(int m = 0; m < SKETCH_NMETRICS; m++) {
+        if(strcmp(argv[2], sketch_names[m]) == 0)
+            h.metric = m;
+    }
+    if(h.metric < 0) {
+        fprintf(stderr, "Unknown metric '%s'.\n", argv[2]);
+        return -1;
+    }
+    if(argc > 3) {
+        for(nq = 0; nq < argc - 3 && nq < 16; nq++)
+            qs[nq] = strtod(argv[nq + 3], NULL);
     }
+
+    if(hist_load(&hist, argv[1], collect_sketch, &h) < 0)
+        return -1;
+    hist_free(&hist);
+
+    fprintf(stdout, "%-16s %8s", "hour", "samples");
+    for(int i = 0; i < nq; i++)
+        fprintf(stdout, "  p%-7g", qs[i] * 100.0);
+    fprintf(stdout, "\n");
+
+    kll_init(&all);
+    qsort(h.hours, h.count, sizeof(*h.hours), cmp_hour);
+    for(int i = 0; i < h.count; i++) {
+        t = h.hours[i].hour * 3600;
+        strftime(label, sizeof(label), "%Y-%m-%d %H:00", localtime(&t));
+        print_quantiles(label, &h.hours[i].k, qs, nq);
+        kll_merge(&all, &h.hours[i].k);
+    }
+    print_quantiles("all", &all, qs, nq);
+
+    free(h.hours);
+    return 0;
 }
 
 // Prints the usage methods.
@@ -272,5 +522,20 @@ void usage(void) {
             "\t-c [dc]  \t\t Changes the PWM to a custom value from 0 to 100. The value must be a PWM duty cycle in percents %%"
             "\t-g [gpio]\t\t Only changes the current GPIO number. If new GPIO is not a PWM pin, the PWM would be off."
             "\t-a [ms.] \t\t Initializes an adaptive PWM. This flag will spawn a process that works in background and tracks the current temperature of the CPU. Based on this temperature it adjusts the PWM. Only one process can be spawned this way. The ms is amount of time that the process will sleep before checking the temperature again.\n"
-            "\t-k       \t\t Kills the existing running process with adaptive PWM.\n");
+            "\t-k       \t\t Kills the existing running process with adaptive PWM.\n"
+            "\t-f [file]\t\t Loads the configuration file for the adaptive PWM, e.g. a custom 'duty = <expression>' control law or a 'plugin = <path.so>'.\n"
+            "\t-b [n]   \t\t Benchmarks the configured policy over n steps and exits.\n"
+            "\t-t [s]   \t\t With -c, how long the duty cycle overrides a running adaptive PWM process. Defaults to the 'manual_hold' of that process. '-c auto' ends the override.\n"
+            "\t-S       \t\t With -a, starts a hot standby that takes over when the adaptive PWM process stops ticking.\n"
+            "Subcommands:\n"
+            "\thistory <file> [from] [to]\t Prints the samples of a history file saved by the adaptive PWM process as CSV.\n"
+            "\tquantile <file> <metric> [q...]\t Prints hourly quantiles of temp, duty or latency from a history file.\n"
+            "\tcollect [-l port] [-o dir] [-i s] [-k kb]\t Receives telemetry of many boards and writes a history file for each.\n"
+            "\tstepbench [-i ms] [-l load] [-u load] [-w s] [-r n] [conf...]\t Measures reaction, settling and overshoot of the policies after load steps on the simulated board.\n"
+            "\tplay [-r hz] [-d device] [-o csv] [-R] <waveform|file>\t Writes a duty cycle waveform to the driver on exact deadlines and reports the timing jitter.\n"
+            "\tloadreplay [-s ms] [-p ms] [-c cores] [-z zone] [-d device] [-o csv] <trace>\t Replays a recorded CPU utilisation profile with busy loops on every core and reports the fidelity and temperatures.\n"
+            "\ttop [-i ms] [-n frames] [heartbeat...]\t Live view of the temperatures, duty cycle, writes and tick cost of running adaptive PWM processes.\n"
+            "\tuevent <add|remove> <devpath> <subsystem> [devname]\t Sends a synthetic kernel uevent, to test hotplug of sensors and fans.\n"
+            "\tcountbench [-t threads] [-n increments]\t Measures the cost of the event counters against a shared atomic and falsely shared counters on several threads.\n"
+            "\tctlbench [-s socket] [-n requests] [-d duty]\t Measures the round trip of requests on the control socket of a running adaptive PWM process.\n");
 }
@@ -0,0 +1,306 @@
+/*
+ *  file: play.c
+ *
+ *  Waveform playback for the characterisation of the fan and the driver. A duty cycle
+ *  waveform is generated or read from a file up front, then written to the driver at a fixed
+ *  update rate on absolute deadlines. The lateness of every wake-up and the duration of every
+ *  ioctl are recorded and reported, so the timing that was actually achieved is known.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <math.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "rpifan.h"
+#include "conf.h"
+#include "sim.h"
+#include "stats.h"
+
+#define PLAY_MAX_UPDATES 10000000
+#define PLAY_MAX_RATE 10000
+#define PLAY_RT_PRIORITY 50
+#define PLAY_SPEC_ARGS 5
+
+static volatile sig_atomic_t play_stop = 0;
+
+static void on_play_signal(int sig) {
+    play_stop = 1;
+}
+
+// Next bit of the x^7 + x^6 + 1 sequence, which repeats after 127 bits.
+static int prbs7(uint8_t *lfsr) {
+    int bit = ((*lfsr >> 6) ^ (*lfsr >> 5)) & 1;
+
+    *lfsr = ((*lfsr << 1) | bit) & 0x7f;
+    return bit;
+}
+
+/*
+ * Generates one of the built-in waveforms, all levels in percent:
+ *
+ *      step:<lo>:<hi>:<period s>:<duration s>      square wave
+ *      ramp:<lo>:<hi>:<duration s>                 linear ramp
+ *      chirp:<lo>:<hi>:<f0 Hz>:<f1 Hz>:<duration s>    sine with a linear frequency sweep
+ *      prbs:<lo>:<hi>:<bit s>:<duration s>         pseudo random binary sequence
+ *
+ * Returns the amount of updates, 0 if the specification is not a waveform, -1 on errors.
+ * */
+static long generate(const char *spec, double rate, double **out) {
+    double a[PLAY_SPEC_ARGS] = { 0 }, t, lo, hi, duration, f, phase = 0.0;
+    const char *p = strchr(spec, ':');
+    char kind[8];
+    uint8_t lfsr = 0x7f;
+    int nargs = 0, bit = 0, need;
+    long n;
+    char *end;
+
+    if(p == NULL || p - spec >= (long) sizeof(kind))
+        return 0;
+    memcpy(kind, spec, p - spec);
+    kind[p - spec] = '\0';
+    if(strcmp(kind, "step") == 0 || strcmp(kind, "prbs") == 0)
+        need = 4;
+    else if(strcmp(kind, "ramp") == 0)
+        need = 3;
+    else if(strcmp(kind, "chirp") == 0)
+        need = 5;
+    else
+        return 0;
+
+    while(*p == ':' && nargs < PLAY_SPEC_ARGS) {
+        a[nargs++] = strtod(p + 1, &end);
+        if(end == p + 1)
+            break;
+        p = end;
+    }
+    if(nargs != need || *p != '\0') {
+        fprintf(stderr, "Waveform '%s' expects %d numbers separated by ':'.\n", kind, need);
+        return -1;
+    }
+
+    lo = a[0] / 100.0;
+    hi = a[1] / 100.0;
+    duration = a[need - 1];
+    n = duration * rate;
+    if(n < 1 || n > PLAY_MAX_UPDATES || lo < 0.0 || lo > 1.0 || hi < 0.0 || hi > 1.0
+            || (need == 4 && a[2] <= 0.0)) {
+        fprintf(stderr, "Waveform '%s' has invalid levels, period or duration.\n", spec);
+        return -1;
+    }
+    if(need == 5 && (a[2] <= 0.0 || a[3] < a[2])) {
+        fprintf(stderr, "Waveform '%s' needs 0 < f0 <= f1.\n", spec);
+        return -1;
+    }
+    if((*out = malloc(n * sizeof(double))) == NULL)
+        return -1;
+
+    for(long i = 0; i < n; i++) {
+        t = i / rate;
+        switch(kind[0]) {
+            case 's':
+                (*out)[i] = fmod(t, a[2]) < a[2] / 2.0 ? lo : hi;
+                break;
+            case 'r':
+                (*out)[i] = lo + (hi - lo) * i / (n > 1 ? n - 1 : 1);
+                break;
+            case 'c':
+                f = a[2] + (a[3] - a[2]) * t / duration;
+                phase += 2.0 * M_PI * f / rate;
+                (*out)[i] = lo + (hi - lo) * (0.5 + 0.5 * sin(phase));
+                break;
+            case 'p':
+                if(i == 0 || (long)(t / a[2]) != (long)((i - 1) / rate / a[2]))
+                    bit = prbs7(&lfsr);
+                (*out)[i] = bit ? hi : lo;
+                break;
+        }
+    }
+    return n;
+}
+
+// Reads a waveform file: one duty cycle in percent per line, '#' starts a comment.
+static long load_file(const char *path, double **out) {
+    char line[CONF_LINE_SIZE], *end;
+    long n = 0, cap = 1024;
+    double v, *tmp;
+    FILE *f;
+
+    if((f = fopen(path, "r")) == NULL) {
+        perror("Unable to open the waveform file");
+        return -1;
+    }
+    if((*out = malloc(cap * sizeof(double))) == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    for(int lineno = 1; fgets(line, sizeof(line), f) != NULL; lineno++) {
+        if((end = strchr(line, '#')) != NULL)
+            *end = '\0';
+        v = strtod(line, &end);
+        if(end == line) {
+            while(*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+                end++;
+            if(*end == '\0')
+                continue;
+        }
+        if(end == line || v < 0.0 || v > 100.0) {
+            fprintf(stderr, "%s:%d: expected a duty cycle from 0 to 100.\n", path, lineno);
+            goto _fail;
+        }
+        if(n == cap) {
+            if(cap == PLAY_MAX_UPDATES || (tmp = realloc(*out, cap * 2 * sizeof(double))) == NULL)
+                goto _fail;
+            *out = tmp;
+            cap *= 2;
+        }
+        (*out)[n++] = v / 100.0;
+    }
+    fclose(f);
+    return n;
+
+_fail:
+    fclose(f);
+    free(*out);
+    return -1;
+}
+
+/*
+ * Plays a duty cycle waveform.
+ *
+ *      rpi_fan_util play [-r hz] [-d device] [-o csv] [-R] <waveform|file>
+ *
+ * Every update is written, also when the value does not change, so the driver latency is
+ * measured on each of them. The duty cycle that was set before is restored at the end.
+ * */
+int play_cmd(int argc, char **argv) {
+    const char *device = CONF_DEVICE, *csv = NULL;
+    struct sched_param sp = { .sched_priority = PLAY_RT_PRIORITY };
+    struct lat_hist late = { 0 }, call = { 0 };
+    uint64_t *late_ns = NULL, *call_ns = NULL, *dcs = NULL, dc, old_dc = 0, start, period_ns, t;
+    double rate = 100.0, *wave = NULL;
+    int fd = -1, opt, rt = 0, has_old = 0, ret = -1;
+    long n, done = 0, errors = 0;
+    FILE *f;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "r:d:o:R")) != -1) {
+        switch(opt) {
+            case 'r': rate = strtod(optarg, NULL); break;
+            case 'd': device = optarg; break;
+            case 'o': csv = optarg; break;
+            case 'R': rt = 1; break;
+            default:
+                goto _usage;
+        }
+    }
+    if(optind != argc - 1)
+        goto _usage;
+    if(rate <= 0.0 || rate > PLAY_MAX_RATE) {
+        fprintf(stderr, "Update rate must be between 0 and %d Hz.\n", PLAY_MAX_RATE);
+        return -1;
+    }
+
+    // Everything is prepared before the playback, the loop only sleeps and writes.
+    n = generate(argv[optind], rate, &wave);
+    if(n == 0 && (n = load_file(argv[optind], &wave)) == 0) {
+        fprintf(stderr, "Waveform file '%s' has no updates.\n", argv[optind]);
+        free(wave);
+    }
+    if(n <= 0)
+        return -1;
+    late_ns = malloc(n * sizeof(uint64_t));
+    call_ns = malloc(n * sizeof(uint64_t));
+    dcs = malloc(n * sizeof(uint64_t));
+    if(late_ns == NULL || call_ns == NULL || dcs == NULL) {
+        perror("Unable to allocate the waveform");
+        goto _free;
+    }
+    for(long i = 0; i < n; i++)
+        dcs[i] = (uint64_t)(wave[i] * PWM_PERIOD);
+
+    // 'sim' plays without a driver, which measures the timing alone.
+    if(strcmp(device, SIM_DEVICE) != 0) {
+        if((fd = open(device, O_RDWR)) < 0) {
+            fprintf(stderr, "Unable to open '%s' device.\n", device);
+            goto _free;
+        }
+        has_old = ioctl(fd, R_PWM_VALUE, &old_dc) == 0;
+    }
+
+    if(rt) {
+        if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+            perror("Unable to lock the memory");
+        if(sched_setscheduler(0, SCHED_FIFO, &sp) < 0)
+            perror("Unable to switch to real-time scheduling");
+    }
+    signal(SIGINT, on_play_signal);
+    signal(SIGTERM, on_play_signal);
+
+    fprintf(stdout, "Playing %ld updates at %.1f Hz (%.1f s).\n", n, rate, n / rate);
+    period_ns = 1e9 / rate;
+    start = now_ns() + period_ns;
+    for(; done < n && !play_stop; done++) {
+        // Deadlines from the start, so the error of one update never carries over.
+        while(!play_stop && now_ns() < start + done * period_ns)
+            sleep_until(start + done * period_ns);
+        // Interrupted before its deadline, the update was not played.
+        if(play_stop)
+            break;
+
+        t = now_ns();
+        late_ns[done] = t - (start + done * period_ns);
+        dc = dcs[done];
+        if(fd >= 0 && ioctl(fd, WR_PWM_VALUE, &dc))
+            errors++;
+        call_ns[done] = now_ns() - t;
+        lat_add(&late, late_ns[done]);
+        lat_add(&call, call_ns[done]);
+    }
+
+    if(has_old && ioctl(fd, WR_PWM_VALUE, &old_dc))
+        fprintf(stderr, "Unable to restore the previous duty cycle.\n");
+
+    fprintf(stdout, "%ld of %ld updates played, %ld write errors.\n", done, n, errors);
+    lat_print(stdout, "wake-up lateness", &late);
+    lat_print(stdout, "ioctl", &call);
+
+    if(csv != NULL) {
+        if((f = fopen(csv, "w")) == NULL) {
+            perror("Unable to write the timing file");
+            goto _free;
+        }
+        fprintf(f, "update,deadline_ns,late_ns,ioctl_ns,duty_cycle\n");
+        for(long i = 0; i < done; i++)
+            fprintf(f, "%ld,%lu,%lu,%lu,%lu\n", i, i * period_ns, late_ns[i], call_ns[i], dcs[i]);
+        fclose(f);
+    }
+    ret = errors ? -1 : 0;
+
+_free:
+    if(fd >= 0)
+        close(fd);
+    free(wave);
+    free(late_ns);
+    free(call_ns);
+    free(dcs);
+    return ret;
+
+_usage:
+    fprintf(stderr, "Usage: rpi_fan_util play [-r hz] [-d device] [-o csv] [-R] <waveform|file>\n"
+            "Waveforms, levels in percent:\n"
+            "\tstep:<lo>:<hi>:<period s>:<duration s>\n"
+            "\tramp:<lo>:<hi>:<duration s>\n"
+            "\tchirp:<lo>:<hi>:<f0 Hz>:<f1 Hz>:<duration s>\n"
+            "\tprbs:<lo>:<hi>:<bit s>:<duration s>\n");
+    return -1;
+}
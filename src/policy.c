@@ -0,0 +1,130 @@
+/*
+ *  file: policy.c
+ *
+ *  Policy selection, plugin loading and the per tick dispatch.
+ *
+ * */
+
+#include <string.h>
+#include <stdio.h>
+#include <dlfcn.h>
+
+#include "rpifan.h"
+#include "policy.h"
+
+static int plugin_open(struct policy *p, const char *path, const char *args) {
+    const struct rpifan_plugin *plugin;
+
+    p->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(p->handle == NULL) {
+        fprintf(stderr, "Unable to load policy plugin: %s\n", dlerror());
+        return -1;
+    }
+
+    plugin = dlsym(p->handle, RPIFAN_PLUGIN_SYMBOL);
+    if(plugin == NULL) {
+        fprintf(stderr, "Policy plugin '%s' does not export '%s'.\n", path, RPIFAN_PLUGIN_SYMBOL);
+        goto _close;
+    }
+    if(plugin->abi != RPIFAN_PLUGIN_ABI) {
+        fprintf(stderr, "Policy plugin '%s' is built for ABI %u, expected %u.\n",
+                path, plugin->abi, RPIFAN_PLUGIN_ABI);
+        goto _close;
+    }
+    if(plugin->init == NULL || plugin->step == NULL) {
+        fprintf(stderr, "Policy plugin '%s' has no init or step function.\n", path);
+        goto _close;
+    }
+    if(plugin->init(&p->ctx, args) != 0) {
+        fprintf(stderr, "Policy plugin '%s' failed to initialize.\n", path);
+        goto _close;
+    }
+
+    p->plugin = plugin;
+    p->name = plugin->name != NULL ? plugin->name : path;
+    dfprintf("Loaded policy plugin '%s' from %s.\n", p->name, path);
+    return 0;
+
+_close:
+    dlclose(p->handle);
+    p->handle = NULL;
+    return -1;
+}
+
+// Selects and prepares the policy described by the configuration.
+int policy_init(struct policy *p, struct fan_conf *conf) {
+    memset(p, 0, sizeof(*p));
+    p->ambient_gain = conf->ambient_gain;
+    p->ambient_ref = conf->ambient_ref;
+    if(conf->ambient_gain != 0.0)
+        p->inputs |= POLICY_IN_AMBIENT;
+
+    if(conf->plugin[0] != '\0') {
+        p->kind = POLICY_PLUGIN;
+        p->inputs = POLICY_IN_PSI | POLICY_IN_LOAD | POLICY_IN_AMBIENT;     // Unknown needs, so everything.
+        return plugin_open(p, conf->plugin, conf->plugin_args);
+    }
+
+    if(conf->has_duty) {
+        p->kind = POLICY_EXPR;
+        p->name = "expression";
+        p->expr = &conf->duty;
+        if(EXPR_USES(p->expr, EXPR_VAR_PSI))
+            p->inputs |= POLICY_IN_PSI;
+        if(EXPR_USES(p->expr, EXPR_VAR_LOAD))
+            p->inputs |= POLICY_IN_LOAD;
+        if(EXPR_USES(p->expr, EXPR_VAR_AMB))
+            p->inputs |= POLICY_IN_AMBIENT;
+        return 0;
+    }
+
+    p->kind = POLICY_BUILTIN;
+    p->name = "builtin";
+    return 0;
+}
+
+static double policy_eval(struct policy *p, const struct rpifan_state *st) {
+    double vars[EXPR_NVARS];
+    double t = st->temp;
+
+    // Warmer air makes the curve act earlier, cooler air later. Plugins do their own.
+    if(p->ambient_gain != 0.0 && (st->flags & RPIFAN_STATE_AMBIENT))
+        t += p->ambient_gain * (st->ambient - p->ambient_ref);
+
+    switch(p->kind) {
+        case POLICY_PLUGIN:
+            return p->plugin->step(p->ctx, st);
+        case POLICY_EXPR:
+            vars[EXPR_VAR_T] = t;
+            vars[EXPR_VAR_TMAX] = st->temp_max;
+            vars[EXPR_VAR_PREV] = st->prev_duty;
+            vars[EXPR_VAR_PSI] = st->psi;
+            vars[EXPR_VAR_LOAD] = st->load;
+            vars[EXPR_VAR_TIME] = st->time_ns / 1e9;
+            vars[EXPR_VAR_AMB] = st->ambient;
+            return expr_eval(p->expr, vars);
+        case POLICY_BUILTIN:
+            break;
+    }
+    // Calculating new duty cycle based on maximal and current temperature.
+    return st->temp_max > 0.0 ? t / st->temp_max : 1.0;
+}
+
+// Runs one step of the policy and accounts its cost. The result is clamped to 0..1.
+double policy_step(struct policy *p, const struct rpifan_state *st) {
+    uint64_t start = now_ns();
+    double duty = policy_eval(p, st);
+
+    lat_add(&p->cost, now_ns() - start);
+    // NaN fails both comparisons, so it is mapped to the full speed as well.
+    return duty >= 0.0 ? (duty <= 1.0 ? duty : 1.0) : (duty < 0.0 ? 0.0 : 1.0);
+}
+
+void policy_teardown(struct policy *p) {
+    if(p->kind == POLICY_PLUGIN && p->handle != NULL) {
+        if(p->plugin != NULL && p->plugin->teardown != NULL)
+            p->plugin->teardown(p->ctx);
+        dlclose(p->handle);
+        p->handle = NULL;
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ *  file: policy.h
+ *
+ *  Control policies of the adaptive process. A policy turns the state of one tick into a new
+ *  duty cycle. It is either the built-in adaptive curve, a duty expression from the
+ *  configuration file or a plugin loaded from a shared object.
+ *
+ * */
+
+#ifndef RPIFAN_POLICY_H
+#define RPIFAN_POLICY_H
+
+#include "conf.h"
+#include "stats.h"
+#include "rpifan_plugin.h"
+
+// Optional inputs, only read on each tick when the policy needs them.
+#define POLICY_IN_PSI     (1u << 0)
+#define POLICY_IN_LOAD    (1u << 1)
+#define POLICY_IN_AMBIENT (1u << 2)
+
+enum policy_kind {
+    POLICY_BUILTIN,
+    POLICY_EXPR,
+    POLICY_PLUGIN,
+};
+
+struct policy {
+    enum policy_kind kind;
+    const char *name;
+    uint32_t inputs;
+
+    struct expr *expr;
+    void *handle;
+    const struct rpifan_plugin *plugin;
+    void *ctx;
+
+    double ambient_gain;    // Shift of the temperature seen by the curve, see conf.h.
+    double ambient_ref;
+
+    struct lat_hist cost;   // Time spent in each step.
+};
+
+int policy_init(struct policy *p, struct fan_conf *conf);
+double policy_step(struct policy *p, const struct rpifan_state *st);
+void policy_teardown(struct policy *p);
+
+#endif
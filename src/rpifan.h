@@ -0,0 +1,76 @@
+/*
+ *  file: rpifan.h
+ *
+ *  Definitions shared between the modules of the utility: driver interface, PWM constants
+ *  and small helpers.
+ *
+ * */
+
+#ifndef RPIFAN_H
+#define RPIFAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#define PWM_PERIOD 50000000
+
+// Only prints in debug mode.
+#define dfprintf(format, ...)           \
+    if(debug) {                         \
+        printf("\033[1;33m> "format"\033[0m", ##__VA_ARGS__);  \
+    }
+
+// Those are defined in rpi.h
+#define WR_PWM_VALUE _IOW('r', 'a', uint64_t*)
+#define R_PWM_VALUE _IOR('r', 'b', uint64_t*)
+
+// FLAGS
+extern int debug;
+
+// Monotonic clock in nanoseconds.
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Sleeps until the given point of the monotonic clock, or until a signal arrives.
+static inline void sleep_until(uint64_t ns) {
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/*
+ * Opens a file the process writes with fopen() modes "w" and "a", without ever following a
+ * symlink. "w" always creates a new file, an "a" file has to be a plain one of this user with
+ * no other links, so a path in a shared directory can not be turned against another file.
+ * */
+static inline FILE *fopen_nofollow(const char *path, const char *mode) {
+    int flags = O_WRONLY | O_CREAT | O_NOFOLLOW | O_CLOEXEC, fd;
+    struct stat sb;
+    FILE *f;
+
+    if(mode[0] == 'w') {
+        unlink(path);
+        flags |= O_EXCL;
+    } else {
+        flags |= O_APPEND;
+    }
+    if((fd = open(path, flags, 0644)) < 0)
+        return NULL;
+    if(fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_uid != geteuid() || sb.st_nlink != 1
+            || (f = fdopen(fd, mode)) == NULL) {
+        close(fd);
+        return NULL;
+    }
+    return f;
+}
+
+#endif
@@ -0,0 +1,122 @@
+/*
+ *  file: rpifan_ctl.h
+ *
+ *  Binary control protocol of the adaptive process and its client API. The adaptive process
+ *  listens on a unix socket ('control' in the configuration file) for fixed-layout requests,
+ *  so a client can set the duty cycle, read the state of the last tick or subscribe to it
+ *  many times per second without starting a process or parsing text.
+ *
+ *  Rules of the protocol:
+ *      - The socket is SOCK_SEQPACKET, one message per packet. Every message starts with
+ *        'struct rpifan_ctl_hdr', its length is the size of the whole message.
+ *      - All fields are in the byte order of the host, the socket is local.
+ *      - A message of another RPIFAN_CTL_VERSION is answered with -EPROTO. New fields only
+ *        ever come from the reserved space, the sizes below never change within a version.
+ *      - Every request gets exactly one reply with the type of the request | RPIFAN_CTL_REPLY
+ *        and the seq of the request. A status is 0 or a negative errno.
+ *      - A subscription adds RPIFAN_CTL_EVENT messages with the state every n ticks. A client
+ *        that does not read them in time loses events, never replies.
+ *
+ *  The client side is ctl.c, which only needs libc. Build it into another program with:
+ *
+ *      gcc -O2 -Isrc -c src/ctl.c
+ *
+ * */
+
+#ifndef RPIFAN_CTL_H
+#define RPIFAN_CTL_H
+
+#include <stdint.h>
+
+#include "rpifan_plugin.h"
+
+#define RPIFAN_CTL_VERSION 1
+#define RPIFAN_CTL_SOCKET "/run/rpi_fan_util.sock"
+#define RPIFAN_CTL_MAX_SIZE 256
+
+enum rpifan_ctl_type {
+    RPIFAN_CTL_SET_DUTY = 1,            // struct rpifan_ctl_set_duty, reply struct rpifan_ctl_status.
+    RPIFAN_CTL_GET_STATE = 2,           // Header only, reply struct rpifan_ctl_state.
+    RPIFAN_CTL_SUBSCRIBE = 3,           // struct rpifan_ctl_subscribe, reply struct rpifan_ctl_status.
+    RPIFAN_CTL_EVENT = 4,               // struct rpifan_ctl_state pushed to a subscriber.
+    RPIFAN_CTL_WAKE = 5,                // Header only, ends a deep sleep. Reply struct rpifan_ctl_status.
+    RPIFAN_CTL_REPLY = 0x80,
+};
+
+struct rpifan_ctl_hdr {
+    uint16_t len;                       // Size of the whole message, the header included.
+    uint8_t version;                    // RPIFAN_CTL_VERSION.
+    uint8_t type;                       // enum rpifan_ctl_type.
+    uint32_t seq;                       // Chosen by the client, echoed in the reply.
+};
+
+// Holds the duty cycle in range 0..1 for hold_s seconds, 0 for 'manual_hold'. Negative ends it.
+struct rpifan_ctl_set_duty {
+    struct rpifan_ctl_hdr hdr;
+    float duty;
+    uint32_t hold_s;
+};
+
+// State every n ticks, 0 ends the subscription.
+struct rpifan_ctl_subscribe {
+    struct rpifan_ctl_hdr hdr;
+    uint32_t every;
+    uint32_t reserved;
+};
+
+struct rpifan_ctl_status {
+    struct rpifan_ctl_hdr hdr;
+    int32_t status;
+    uint32_t reserved;
+};
+
+// State of the last tick, temperatures in degrees of Celsius and duty cycles in range 0..1.
+struct rpifan_ctl_state {
+    struct rpifan_ctl_hdr hdr;
+    int32_t status;                     // -EAGAIN before the first tick.
+    uint32_t ntemps;
+    uint64_t tick;
+    uint64_t time_ms;                   // Wall clock of the tick.
+    uint32_t interval_ms;
+    uint32_t nfans;                     // Hotplugged fans, besides the configured one.
+    float temps[RPIFAN_MAX_ZONES];
+    float temp;                         // Hottest of the sensors.
+    float temp_max;
+    float duty;                         // Written on the tick.
+    float ambient;
+    float manual;                       // Manual duty cycle, -1 under automatic control.
+    uint32_t manual_left_s;
+    uint64_t writes;
+    uint64_t suppressed;
+    uint64_t write_errors;
+    uint64_t read_errors;
+};
+
+_Static_assert(sizeof(struct rpifan_ctl_hdr) == 8, "rpifan_ctl_hdr layout is a part of the protocol");
+_Static_assert(sizeof(struct rpifan_ctl_set_duty) == 16, "rpifan_ctl_set_duty layout is a part of the protocol");
+_Static_assert(sizeof(struct rpifan_ctl_subscribe) == 16, "rpifan_ctl_subscribe layout is a part of the protocol");
+_Static_assert(sizeof(struct rpifan_ctl_status) == 16, "rpifan_ctl_status layout is a part of the protocol");
+_Static_assert(sizeof(struct rpifan_ctl_state) == 128, "rpifan_ctl_state layout is a part of the protocol");
+
+/*
+ * Client API
+ *
+ * Calls block until the reply is there and return 0 or a negative errno. Events that come in
+ * while a reply is awaited are not lost: the newest one is kept for rpifan_ctl_next().
+ * */
+struct rpifan_ctl {
+    int fd;
+    uint32_t seq;
+    int has_event;
+    struct rpifan_ctl_state event;      // Newest event seen while waiting for a reply.
+};
+
+int rpifan_ctl_open(struct rpifan_ctl *c, const char *path);
+int rpifan_ctl_set_duty(struct rpifan_ctl *c, double duty, unsigned hold_s);
+int rpifan_ctl_get_state(struct rpifan_ctl *c, struct rpifan_ctl_state *st);
+int rpifan_ctl_subscribe(struct rpifan_ctl *c, unsigned every);
+int rpifan_ctl_next(struct rpifan_ctl *c, struct rpifan_ctl_state *st);
+int rpifan_ctl_wake(struct rpifan_ctl *c);
+void rpifan_ctl_close(struct rpifan_ctl *c);
+
+#endif
@@ -0,0 +1,72 @@
+/*
+ *  file: rpifan_plugin.h
+ *
+ *  Stable interface for policy plugins. A plugin is a shared object exporting one
+ *  'rpifan_plugin' symbol of type 'struct rpifan_plugin'. The adaptive process loads it with
+ *  dlopen() and calls its step function on every tick.
+ *
+ *  Rules of the ABI:
+ *      - Both structures below have a fixed layout. New fields are only ever taken from the
+ *        reserved space, so the size never changes within one major version.
+ *      - A plugin built against another RPIFAN_PLUGIN_ABI major version is refused.
+ *      - step() is called from the hot loop. It must not block and should not allocate,
+ *        everything it needs must be prepared in init().
+ *
+ *  Build a plugin with:
+ *
+ *      gcc -shared -fPIC -O2 -Isrc my_policy.c -o my_policy.so
+ *
+ * */
+
+#ifndef RPIFAN_PLUGIN_H
+#define RPIFAN_PLUGIN_H
+
+#include <stdint.h>
+
+#define RPIFAN_PLUGIN_ABI 1
+#define RPIFAN_PLUGIN_SYMBOL "rpifan_plugin"
+#define RPIFAN_MAX_ZONES 8
+
+// Flags of 'struct rpifan_state'.
+#define RPIFAN_STATE_AMBIENT 0x1        // 'ambient' is known.
+
+/*
+ * Inputs of a policy on one tick
+ *
+ * Temperatures are in degrees of Celsius, duty cycles and pressures are fractions in
+ * range 0..1.
+ * */
+struct rpifan_state {
+    uint32_t abi;                       // RPIFAN_PLUGIN_ABI of the daemon.
+    uint32_t size;                      // sizeof(struct rpifan_state) of the daemon.
+    uint64_t time_ns;                   // Monotonic time since the start of the process.
+    uint64_t tick;                      // Number of the current tick.
+    uint32_t interval_ms;               // Nominal interval between ticks.
+    uint32_t ntemps;                    // Valid entries in temps.
+    double temps[RPIFAN_MAX_ZONES];     // Temperature of each configured zone.
+    double temp;                        // Hottest of the zones.
+    double temp_max;                    // Hottest temperature since the start.
+    double load;                        // 1 minute load average per CPU.
+    double psi;                         // CPU pressure stall information, some avg10.
+    double prev_duty;                   // Duty cycle written on the previous tick.
+    double ambient;                     // Estimated air temperature, 0 unless RPIFAN_STATE_AMBIENT.
+    uint32_t flags;                     // RPIFAN_STATE_*.
+    uint32_t reserved32;
+    double reserved[6];
+};
+
+struct rpifan_plugin {
+    uint32_t abi;                       // Must be RPIFAN_PLUGIN_ABI.
+    const char *name;
+
+    // Creates the plugin context from the 'plugin_args' string. Returns 0 on success.
+    int (*init)(void **ctx, const char *args);
+    // Returns the new duty cycle in range 0..1.
+    double (*step)(void *ctx, const struct rpifan_state *state);
+    // Releases everything allocated by init(). May be NULL.
+    void (*teardown)(void *ctx);
+};
+
+_Static_assert(sizeof(struct rpifan_state) == 200, "rpifan_state layout is a part of the ABI");
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ *  file: shadow.c
+ *
+ *  Shadow policies of the adaptive process.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <libgen.h>
+
+#include "rpifan.h"
+#include "shadow.h"
+
+// Loads the configuration of every shadow and prepares its policy.
+int shadows_init(struct shadows *sh, const struct fan_conf *conf) {
+    char path[CONF_LINE_SIZE];
+    struct shadow *s;
+
+    memset(sh, 0, sizeof(*sh));
+    for(int i = 0; i < conf->nshadows; i++) {
+        s = &sh->s[i];
+        s->conf = malloc(sizeof(*s->conf));
+        if(s->conf == NULL || conf_load(conf->shadows[i], s->conf) < 0
+                || policy_init(&s->policy, s->conf) < 0) {
+            fprintf(stderr, "Unable to prepare shadow policy '%s'.\n", conf->shadows[i]);
+            free(s->conf);
+            shadows_teardown(sh);
+            return -1;
+        }
+
+        strcpy(path, conf->shadows[i]);
+        strncpy(s->name, basename(path), SHADOW_NAME_SIZE - 1);
+        s->written_dc = UINT64_MAX;
+        sh->inputs |= s->policy.inputs;
+        sh->n++;
+        dfprintf("Shadow policy '%s' (%s) loaded.\n", s->name, s->policy.name);
+    }
+    return 0;
+}
+
+/*
+ * Runs every shadow on the state of this tick. The duty is the one the active policy asked
+ * for, the state carries the previous duty of the active policy which is replaced by the
+ * shadow's own.
+ * */
+void shadows_step(struct shadows *sh, const struct rpifan_state *st, double duty) {
+    struct shadow *s;
+    uint64_t dc;
+    double sd, d;
+
+    for(int i = 0; i < sh->n; i++) {
+        s = &sh->s[i];
+        sd = s->st.prev_duty;
+        s->st = *st;
+        s->st.prev_duty = sd;
+
+        sd = policy_step(&s->policy, &s->st);
+        dc = (uint64_t)(sd * PWM_PERIOD);
+        if(dc != s->written_dc) {
+            dfprintf("Shadow '%s' would write duty cycle %lu.\n", s->name, dc);
+            s->written_dc = dc;
+            s->writes++;
+        }
+        if(dc != (uint64_t)(duty * PWM_PERIOD))
+            s->diverged++;
+
+        d = fabs(sd - duty);
+        s->div_sum += d;
+        if(d > s->div_max)
+            s->div_max = d;
+        s->st.prev_duty = sd;
+    }
+}
+
+void shadows_print(FILE *f, const struct shadows *sh, uint64_t active_writes) {
+    const struct shadow *s;
+    uint64_t ticks;
+
+    for(int i = 0; i < sh->n; i++) {
+        s = &sh->s[i];
+        ticks = s->policy.cost.count;
+        fprintf(f, "Shadow '%s': %lu writes (active %lu), diverged on %lu of %lu ticks, duty difference mean %.2f%% max %.2f%%.\n",
+                s->name, s->writes, active_writes, s->diverged, ticks,
+                ticks ? s->div_sum / ticks * 100.0 : 0.0, s->div_max * 100.0);
+        lat_print(f, s->name, &s->policy.cost);
+    }
+}
+
+void shadows_teardown(struct shadows *sh) {
+    for(int i = 0; i < sh->n; i++) {
+        policy_teardown(&sh->s[i].policy);
+        free(sh->s[i].conf);
+    }
+    sh->n = 0;
+}
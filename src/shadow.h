@@ -0,0 +1,49 @@
+/*
+ *  file: shadow.h
+ *
+ *  Shadow policies. Candidate policies from other configuration files run next to the active
+ *  one and see the same samples on every tick, but their duty cycle is never written. Only
+ *  what they would have done is counted: the writes, how far they are from the active policy
+ *  and what they cost per tick.
+ *
+ *  Each shadow keeps its own previous duty cycle, so a shadow behaves as if it had been in
+ *  control all along instead of following the active policy.
+ *
+ * */
+
+#ifndef RPIFAN_SHADOW_H
+#define RPIFAN_SHADOW_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "conf.h"
+#include "policy.h"
+
+#define SHADOW_NAME_SIZE 24
+
+struct shadow {
+    char name[SHADOW_NAME_SIZE];    // File name of the configuration.
+    struct fan_conf *conf;          // Kept, the policy refers into it.
+    struct policy policy;
+    struct rpifan_state st;
+
+    uint64_t written_dc;            // What the shadow would have written last.
+    uint64_t writes;                // Writes it would have done.
+    uint64_t diverged;              // Ticks on which it would have written another value.
+    double div_sum;                 // Sum and maximum of |shadow duty - active duty|.
+    double div_max;
+};
+
+struct shadows {
+    int n;
+    uint32_t inputs;                // Optional inputs needed by any of the shadows.
+    struct shadow s[CONF_MAX_SHADOWS];
+};
+
+int shadows_init(struct shadows *sh, const struct fan_conf *conf);
+void shadows_step(struct shadows *sh, const struct rpifan_state *st, double duty);
+void shadows_print(FILE *f, const struct shadows *sh, uint64_t active_writes);
+void shadows_teardown(struct shadows *sh);
+
+#endif
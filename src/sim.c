@@ -0,0 +1,35 @@
+/*
+ *  file: sim.c
+ *
+ *  Thermal model of the simulated board. Parameters roughly follow a Raspberry Pi 4 with a
+ *  small heatsink fan: about 25 K over ambient at idle without the fan, 80 K at full load,
+ *  and a time constant of a few minutes.
+ *
+ * */
+
+#include "sim.h"
+
+#define SIM_MAX_STEP 0.1
+
+void sim_init(struct sim *s, double ambient, double load) {
+    s->ambient = ambient;
+    s->load = load;
+    s->duty = 0.0;
+    s->p_idle = 2.0;
+    s->p_load = 4.5;
+    s->g0 = 0.08;
+    s->g1 = 0.25;
+    s->c = 30.0;
+    // Start in the equilibrium of the given load with the fan off.
+    s->temp = ambient + (s->p_idle + s->p_load * load) / s->g0;
+}
+
+// Advances the model by dt seconds, in small steps to keep the integration stable.
+void sim_step(struct sim *s, double dt) {
+    double h, p = s->p_idle + s->p_load * s->load, g = s->g0 + s->g1 * s->duty;
+
+    for(; dt > 0.0; dt -= h) {
+        h = dt < SIM_MAX_STEP ? dt : SIM_MAX_STEP;
+        s->temp += h * (p - g * (s->temp - s->ambient)) / s->c;
+    }
+}
@@ -0,0 +1,33 @@
+/*
+ *  file: sim.h
+ *
+ *  Simulated board: a first order thermal model of the SoC with a fan. Used instead of the
+ *  driver and the thermal zones when the configured device is 'sim', so the adaptive process
+ *  and benchmarks can run on any machine.
+ *
+ *      C * dT/dt = P(load) - (G0 + G1 * duty) * (T - ambient)
+ *
+ * */
+
+#ifndef RPIFAN_SIM_H
+#define RPIFAN_SIM_H
+
+#define SIM_DEVICE "sim"
+
+struct sim {
+    double temp;        // SoC temperature in C.
+    double ambient;     // Air temperature in C.
+    double load;        // CPU utilization in range 0..1.
+    double duty;        // Fan duty cycle in range 0..1.
+
+    double p_idle;      // Power at idle in W.
+    double p_load;      // Additional power at full load in W.
+    double g0;          // Passive heat conductance in W/K.
+    double g1;          // Additional conductance of the fan at full speed in W/K.
+    double c;           // Heat capacity in J/K.
+};
+
+void sim_init(struct sim *s, double ambient, double load);
+void sim_step(struct sim *s, double dt);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ *  file: sketch.c
+ *
+ *  KLL quantile sketch in a fixed buffer.
+ *
+ *  Level capacities shrink geometrically by 2/3 from the top level down to KLL_MIN_CAP, so the
+ *  whole sketch stays below KLL_CAP items for any realistic amount of samples. When the buffer
+ *  is full, the lowest level over its capacity is compacted: sorted, every other item (random
+ *  offset) is promoted to the next level with a doubled weight and the rest is dropped.
+ *
+ * */
+
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+
+#include "sketch.h"
+
+#define KLL_MIN_CAP 8
+
+const char *sketch_names[SKETCH_NMETRICS] = {
+    [SKETCH_TEMP] = "temp",
+    [SKETCH_DUTY] = "duty",
+    [SKETCH_LATENCY] = "latency",
+};
+
+struct weighted {
+    float v;
+    uint64_t w;
+};
+
+static uint32_t level_cap(int h, int nlevels) {
+    double c = KLL_K;
+
+    for(int i = 0; i < nlevels - 1 - h; i++)
+        c *= 2.0 / 3.0;
+    return c < KLL_MIN_CAP ? KLL_MIN_CAP : (uint32_t) ceil(c);
+}
+
+static uint32_t total_cap(int nlevels) {
+    uint32_t cap = 0;
+
+    for(int h = 0; h < nlevels; h++)
+        cap += level_cap(h, nlevels);
+    return cap;
+}
+
+static inline uint32_t level_size(const struct kll *s, int h) {
+    return s->levels[h + 1] - s->levels[h];
+}
+
+static inline int is_full(const struct kll *s) {
+    return KLL_CAP - s->levels[0] >= total_cap(s->nlevels);
+}
+
+static uint32_t xorshift(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int cmp_float(const void *a, const void *b) {
+    float x = *(const float*) a, y = *(const float*) b;
+
+    return (x > y) - (x < y);
+}
+
+static int cmp_weighted(const void *a, const void *b) {
+    return cmp_float(&((const struct weighted*) a)->v, &((const struct weighted*) b)->v);
+}
+
+void kll_init(struct kll *s) {
+    memset(s, 0, sizeof(*s));
+    s->min = INFINITY;
+    s->max = -INFINITY;
+    s->rng = 0x9e3779b9;
+    s->nlevels = 1;
+    s->levels[0] = s->levels[1] = KLL_CAP;
+}
+
+// New top level is empty and sits right at the end of the buffer.
+static int add_level(struct kll *s) {
+    if(s->nlevels == KLL_MAX_LEVELS)
+        return -1;
+    s->levels[s->nlevels + 1] = KLL_CAP;
+    s->nlevels++;
+    return 0;
+}
+
+static void compact(struct kll *s, int h) {
+    float merged[KLL_CAP], kept = 0.0f;
+    uint32_t start = s->levels[h], size = level_size(s, h), up_size, odd, half, i, j, k;
+    const float *up;
+
+    if(h == 0)
+        qsort(&s->items[start], size, sizeof(float), cmp_float);
+
+    odd = size & 1;
+    half = (size - odd) / 2;
+    if(odd)
+        kept = s->items[start];
+
+    // Promoted items are already sorted, so they are merged with the level above in one pass.
+    up = &s->items[s->levels[h + 1]];
+    up_size = level_size(s, h + 1);
+    i = xorshift(&s->rng) & 1;
+    for(j = 0, k = 0; i < 2 * half || j < up_size; k++) {
+        if(j >= up_size || (i < 2 * half && s->items[start + odd + i] <= up[j])) {
+            merged[k] = s->items[start + odd + i];
+            i += 2;
+        } else {
+            merged[k] = up[j++];
+        }
+    }
+
+    memcpy(&s->items[s->levels[h + 2] - k], merged, k * sizeof(float));
+    memmove(&s->items[s->levels[0] + half], &s->items[s->levels[0]], (start - s->levels[0]) * sizeof(float));
+    s->levels[h + 1] = s->levels[h + 2] - k;
+    s->levels[h] = s->levels[h + 1] - odd;
+    if(odd)
+        s->items[s->levels[h]] = kept;
+    for(int l = 0; l < h; l++)
+        s->levels[l] += half;
+}
+
+/*
+ * Frees space by compacting the lowest level that reached its capacity. Such level always
+ * exists when the buffer is full. Compacting the top level first grows the sketch by a level.
+ * */
+static void compress(struct kll *s) {
+    int h;
+
+    for(h = 0; h < s->nlevels - 1; h++) {
+        if(level_size(s, h) >= level_cap(h, s->nlevels))
+            break;
+    }
+    // With KLL_MAX_LEVELS levels that takes more than 10^9 samples, so it is not a real limit.
+    if(h == s->nlevels - 1 && add_level(s) < 0)
+        h--;
+    compact(s, h);
+}
+
+// Inserts an item of weight 2^h, keeping levels above zero sorted.
+static void insert(struct kll *s, int h, float x) {
+    uint32_t lo, hi, mid;
+
+    while(h >= s->nlevels && add_level(s) == 0)
+        ;
+    if(h >= s->nlevels)
+        h = s->nlevels - 1;
+    if(is_full(s))
+        compress(s);
+
+    lo = s->levels[h];
+    hi = h > 0 ? s->levels[h + 1] : lo;
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(s->items[mid] <= x)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    memmove(&s->items[s->levels[0] - 1], &s->items[s->levels[0]], (lo - s->levels[0]) * sizeof(float));
+    s->items[lo - 1] = x;
+    for(int l = 0; l <= h; l++)
+        s->levels[l]--;
+}
+
+void kll_add(struct kll *s, float x) {
+    if(x < s->min)
+        s->min = x;
+    if(x > s->max)
+        s->max = x;
+    insert(s, 0, x);
+    s->n++;
+}
+
+void kll_merge(struct kll *dst, const struct kll *src) {
+    if(src->n == 0)
+        return;
+
+    for(int h = 0; h < src->nlevels; h++) {
+        for(uint32_t i = src->levels[h]; i < src->levels[h + 1]; i++)
+            insert(dst, h, src->items[i]);
+    }
+    dst->n += src->n;
+    if(src->min < dst->min)
+        dst->min = src->min;
+    if(src->max > dst->max)
+        dst->max = src->max;
+}
+
+float kll_quantile(const struct kll *s, double q) {
+    struct weighted w[KLL_CAP];
+    uint64_t total = 0, seen = 0;
+    uint32_t n = 0;
+
+    if(s->n == 0)
+        return NAN;
+    if(q <= 0.0)
+        return s->min;
+    if(q >= 1.0)
+        return s->max;
+
+    for(int h = 0; h < s->nlevels; h++) {
+        for(uint32_t i = s->levels[h]; i < s->levels[h + 1]; i++) {
+            w[n].v = s->items[i];
+            w[n].w = 1ull << h;
+            total += w[n++].w;
+        }
+    }
+    qsort(w, n, sizeof(w[0]), cmp_weighted);
+
+    for(uint32_t i = 0; i < n; i++) {
+        seen += w[i].w;
+        if(seen > q * total)
+            return w[i].v;
+    }
+    return s->max;
+}
+
+/*
+ * Compact form: n, min, max, number of levels, size of each level and the items. Only the
+ * used part of the buffer is stored, a sketch of a few samples takes a few bytes.
+ * */
+size_t kll_serialize(const struct kll *s, void *buf, size_t len) {
+    uint32_t nitems = KLL_CAP - s->levels[0];
+    size_t need = 8 + 4 + 4 + 2 + 2 * s->nlevels + 4 * nitems;
+    uint8_t *p = buf;
+    uint16_t size;
+
+    if(need > len)
+        return 0;
+
+    memcpy(p, &s->n, 8);
+    memcpy(p + 8, &s->min, 4);
+    memcpy(p + 12, &s->max, 4);
+    memcpy(p + 16, &s->nlevels, 2);
+    p += 18;
+    for(int h = 0; h < s->nlevels; h++, p += 2) {
+        size = level_size(s, h);
+        memcpy(p, &size, 2);
+    }
+    memcpy(p, &s->items[s->levels[0]], 4 * nitems);
+    return need;
+}
+
+int kll_deserialize(struct kll *s, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint32_t nitems = 0;
+    uint16_t size;
+
+    kll_init(s);
+    if(len < 18)
+        return -1;
+    memcpy(&s->n, p, 8);
+    memcpy(&s->min, p + 8, 4);
+    memcpy(&s->max, p + 12, 4);
+    memcpy(&s->nlevels, p + 16, 2);
+    if(s->nlevels < 1 || s->nlevels > KLL_MAX_LEVELS || len < 18 + 2u * s->nlevels)
+        goto _fail;
+    p += 18;
+
+    // Levels are laid out from the top one, right aligned.
+    s->levels[s->nlevels] = KLL_CAP;
+    for(int h = s->nlevels - 1; h >= 0; h--) {
+        memcpy(&size, p + 2 * h, 2);
+        nitems += size;
+        if(nitems >= KLL_CAP)
+            goto _fail;
+        s->levels[h] = s->levels[h + 1] - size;
+    }
+    p += 2 * s->nlevels;
+    if(len != 18 + 2u * s->nlevels + 4 * nitems)
+        goto _fail;
+    memcpy(&s->items[s->levels[0]], p, 4 * nitems);
+    return 0;
+
+_fail:
+    kll_init(s);
+    return -1;
+}
+
+// Adds one sample of every metric into the sketches of the current hour.
+void sketch_hour_add(struct sketch_hour *ring, uint64_t epoch_ms, const float *vals) {
+    uint64_t hour = epoch_ms / 3600000;
+    struct sketch_hour *slot = &ring[hour % SKETCH_HOURS];
+
+    if(slot->hour != hour) {
+        slot->hour = hour;
+        for(int m = 0; m < SKETCH_NMETRICS; m++)
+            kll_init(&slot->k[m]);
+    }
+    for(int m = 0; m < SKETCH_NMETRICS; m++)
+        kll_add(&slot->k[m], vals[m]);
+}
+
+// History file section of one sketch: hour, metric and the sketch itself.
+size_t sketch_pack(uint64_t hour, int metric, const struct kll *s, void *buf, size_t len) {
+    uint8_t *p = buf;
+    uint32_t m = metric;
+    size_t n;
+
+    if(len < 12 || (n = kll_serialize(s, p + 12, len - 12)) == 0)
+        return 0;
+    memcpy(p, &hour, 8);
+    memcpy(p + 8, &m, 4);
+    return n + 12;
+}
+
+int sketch_unpack(const void *buf, size_t len, uint64_t *hour, int *metric, struct kll *s) {
+    const uint8_t *p = buf;
+    uint32_t m;
+
+    if(len < 12)
+        return -1;
+    memcpy(hour, p, 8);
+    memcpy(&m, p + 8, 4);
+    if(m >= SKETCH_NMETRICS)
+        return -1;
+    *metric = m;
+    return kll_deserialize(s, p + 12, len - 12);
+}
+
+// Saves the samples together with the non empty sketches of the ring.
+int sketch_save(const struct history *h, const char *path, const struct sketch_hour *ring) {
+    struct hist_extra extra[SKETCH_HOURS * SKETCH_NMETRICS];
+    uint8_t *buf, *p;
+    int n = 0, ret;
+
+    p = buf = malloc(SKETCH_HOURS * SKETCH_NMETRICS * SKETCH_PACK_SIZE);
+    if(buf == NULL) {
+        perror("Unable to allocate sketch buffer");
+        return -1;
+    }
+    for(int i = 0; i < SKETCH_HOURS; i++) {
+        for(int m = 0; ring[i].hour && m < SKETCH_NMETRICS; m++) {
+            extra[n].tag = HIST_SECTION_SKETCH;
+            extra[n].data = p;
+            extra[n].len = sketch_pack(ring[i].hour, m, &ring[i].k[m], p, SKETCH_PACK_SIZE);
+            p += extra[n++].len;
+        }
+    }
+
+    ret = hist_save(h, path, extra, n);
+    free(buf);
+    return ret;
+}
@@ -0,0 +1,70 @@
+/*
+ *  file: sketch.h
+ *
+ *  Streaming quantile sketches (KLL). A sketch summarizes any number of samples in a fixed
+ *  amount of memory, answers arbitrary quantiles with about 1% rank error and sketches of
+ *  different hours or boards can be merged.
+ *
+ *  The adaptive process keeps one sketch of temperature, duty cycle and tick latency for each
+ *  of the last SKETCH_HOURS hours and persists them together with the sample history.
+ *
+ * */
+
+#ifndef RPIFAN_SKETCH_H
+#define RPIFAN_SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "history.h"
+
+#define KLL_K 128
+#define KLL_MAX_LEVELS 24
+#define KLL_CAP 512
+#define SKETCH_HOURS 24
+
+#define HIST_SECTION_SKETCH 0x4c4c4b21  // "!KLL"
+#define SKETCH_PACK_SIZE (8 + 4 + 18 + 2 * KLL_MAX_LEVELS + 4 * KLL_CAP)
+
+/*
+ * Level h holds items[levels[h] .. levels[h + 1]), each item weighting 2^h samples. Items are
+ * aligned to the end of the buffer, new samples are put right before level 0. Levels above
+ * zero are always sorted.
+ * */
+struct kll {
+    uint64_t n;
+    float min, max;
+    uint32_t rng;
+    uint16_t nlevels;
+    uint16_t levels[KLL_MAX_LEVELS + 1];
+    float items[KLL_CAP];
+};
+
+enum sketch_metric {
+    SKETCH_TEMP,        // Hottest zone in C.
+    SKETCH_DUTY,        // Written duty cycle in %.
+    SKETCH_LATENCY,     // Tick processing time in microseconds.
+    SKETCH_NMETRICS,
+};
+
+struct sketch_hour {
+    uint64_t hour;      // Hours since the epoch.
+    struct kll k[SKETCH_NMETRICS];
+};
+
+extern const char *sketch_names[SKETCH_NMETRICS];
+
+void kll_init(struct kll *s);
+void kll_add(struct kll *s, float x);
+void kll_merge(struct kll *dst, const struct kll *src);
+float kll_quantile(const struct kll *s, double q);
+
+size_t kll_serialize(const struct kll *s, void *buf, size_t len);
+int kll_deserialize(struct kll *s, const void *buf, size_t len);
+
+void sketch_hour_add(struct sketch_hour *ring, uint64_t epoch_ms, const float *vals);
+size_t sketch_pack(uint64_t hour, int metric, const struct kll *s, void *buf, size_t len);
+int sketch_unpack(const void *buf, size_t len, uint64_t *hour, int *metric, struct kll *s);
+int sketch_save(const struct history *h, const char *path, const struct sketch_hour *ring);
+
+#endif
@@ -0,0 +1,296 @@
+/*
+ *  file: standby.c
+ *
+ *  Shared heartbeat, ownership and controller state hand-over of the hot standby.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rpifan.h"
+#include "standby.h"
+
+#define STANDBY_READ_TRIES 100
+
+// Whether the owner is gone: none, dead, or its heartbeat is over half an interval late.
+static int owner_gone(const struct heartbeat *hb, pid_t owner, const char **why) {
+    uint64_t beat = __atomic_load_n(&hb->beat_ns, __ATOMIC_ACQUIRE);
+    uint64_t late_ns = hb->interval_ms * 1500000ull;
+
+    if(owner == 0)
+        *why = "no owner";
+    else if(kill(owner, 0) < 0 && errno == ESRCH)
+        *why = "owner exited";
+    else if(now_ns() > beat + late_ns)
+        *why = "heartbeat stopped";
+    else
+        return 0;
+    return 1;
+}
+
+static int claim(struct heartbeat *hb, pid_t from, pid_t to) {
+    return __atomic_compare_exchange_n(&hb->owner, &from, to, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Opens the heartbeat file. Whoever can write it can claim the fan, so it has to be a plain
+ * file of this user that nobody else may write, and a symlink is never followed.
+ * */
+static int open_heartbeat(const char *path, int flags) {
+    struct stat sb;
+    int fd;
+
+    if((fd = open(path, flags | O_NOFOLLOW | O_CLOEXEC, 0600)) < 0)
+        return -1;
+    if(fstat(fd, &sb) < 0 || !S_ISREG(sb.st_mode) || sb.st_uid != geteuid() || (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Maps the heartbeat. A primary takes control unless another process holds it, in which
+ * case it asks for it back and waits as a standby until it is handed over.
+ * */
+int standby_open(struct standby *s, const char *path, int standby, uint64_t interval_ms) {
+    const char *why;
+    pid_t owner;
+
+    memset(s, 0, sizeof(*s));
+    s->self = getpid();
+    s->standby = standby;
+    s->interval_ms = interval_ms;
+    s->active = 1;
+
+    // Only ever grown, an owner of another version may map more of it.
+    s->fd = open_heartbeat(path, O_RDWR | O_CREAT);
+    if(s->fd < 0 || (lseek(s->fd, 0, SEEK_END) < (off_t) sizeof(struct heartbeat)
+            && ftruncate(s->fd, sizeof(struct heartbeat)) < 0)) {
+        perror("Unable to open the heartbeat");
+        goto _fail;
+    }
+    s->hb = mmap(NULL, sizeof(struct heartbeat), PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if(s->hb == MAP_FAILED) {
+        perror("Unable to map the heartbeat");
+        s->hb = NULL;
+        goto _fail;
+    }
+    if(s->hb->magic != STANDBY_MAGIC || s->hb->version != STANDBY_VERSION) {
+        // The owner comes before anything that changes between the versions.
+        owner = __atomic_load_n(&s->hb->owner, __ATOMIC_ACQUIRE);
+        if(s->hb->magic == STANDBY_MAGIC && owner != 0 && owner != s->self && kill(owner, 0) == 0) {
+            fprintf(stderr, "PID %d of another version uses the heartbeat '%s'.\n", owner, path);
+            goto _fail;
+        }
+        memset(s->hb, 0, sizeof(*s->hb));
+        s->hb->magic = STANDBY_MAGIC;
+        s->hb->version = STANDBY_VERSION;
+    }
+    // Overrides left for an earlier process do not apply to this one.
+    s->manual_seq = __atomic_load_n(&s->hb->manual_seq, __ATOMIC_ACQUIRE);
+
+    if(standby) {
+        s->active = 0;
+        dfprintf("Standing by for the adaptive PWM process.\n");
+        return 0;
+    }
+    owner = __atomic_load_n(&s->hb->owner, __ATOMIC_ACQUIRE);
+    if(owner_gone(s->hb, owner, &why) && claim(s->hb, owner, s->self)) {
+        s->from = owner;
+        s->hb->interval_ms = interval_ms;
+        __atomic_store_n(&s->hb->beat_ns, now_ns(), __ATOMIC_RELEASE);
+        return 0;
+    }
+    s->active = 0;
+    s->from = owner;    // Until it hands control back, which leaves no trace of whom from.
+    __atomic_store_n(&s->hb->request, s->self, __ATOMIC_RELEASE);
+    fprintf(stderr, "PID %d controls the fan, waiting for it to hand control back.\n", owner);
+    return 0;
+
+_fail:
+    if(s->hb != NULL)
+        munmap(s->hb, sizeof(*s->hb));
+    if(s->fd >= 0)
+        close(s->fd);
+    s->hb = NULL;
+    s->fd = -1;
+    return -1;
+}
+
+// Writes under a sequence lock, readers retry while it changes. Only the owner writes.
+static void seq_write(uint32_t *seq, void *dst, const void *src, size_t len) {
+    uint32_t s = *seq;
+
+    __atomic_store_n(seq, s + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(dst, src, len);
+    __atomic_store_n(seq, s + 2, __ATOMIC_RELEASE);
+}
+
+static int seq_read(const uint32_t *seq, void *dst, const void *src, size_t len) {
+    uint32_t s;
+
+    for(int i = 0; i < STANDBY_READ_TRIES; i++) {
+        s = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if(s & 1)
+            continue;
+        memcpy(dst, src, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(seq, __ATOMIC_RELAXED) == s)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * Stamps the heartbeat and publishes the state, at the start of every tick of the owner.
+ * Returns 0 when the process is not in control any more, then it must not write the fan.
+ * */
+int standby_beat(struct standby *s, const struct standby_state *st) {
+    struct heartbeat *hb = s->hb;
+    pid_t request;
+
+    if(hb == NULL)
+        return 1;
+    if(__atomic_load_n(&hb->owner, __ATOMIC_ACQUIRE) != s->self) {
+        if(s->active)
+            fprintf(stderr, "Lost control of the fan to PID %d, standing by.\n", hb->owner);
+        return s->active = 0;
+    }
+
+    seq_write(&hb->seq, &hb->state, st, sizeof(*st));
+    hb->interval_ms = s->interval_ms;
+    __atomic_store_n(&hb->beat_ns, now_ns(), __ATOMIC_RELEASE);
+
+    // Only a standby gives control away, to a primary that is alive.
+    request = __atomic_load_n(&hb->request, __ATOMIC_ACQUIRE);
+    if(s->standby && request != 0 && request != s->self && kill(request, 0) == 0 && claim(hb, s->self, request)) {
+        __atomic_store_n(&hb->request, 0, __ATOMIC_RELEASE);
+        fprintf(stderr, "Handed control of the fan back to PID %d.\n", request);
+        return s->active = 0;
+    }
+    return s->active = 1;
+}
+
+// Whether the process is still in control, also between its ticks.
+int standby_owner(const struct standby *s) {
+    if(s->hb == NULL)
+        return 1;
+    return s->active && __atomic_load_n(&s->hb->owner, __ATOMIC_ACQUIRE) == s->self;
+}
+
+/*
+ * Stamps the heartbeat of an owner that sleeps and tells a standby that the next beat comes
+ * within 'ms'. An owner that exits is still noticed at once, one that hangs after as long as
+ * usual. The next tick sets the interval back. Returns 0 when the process lost control.
+ * */
+int standby_sleep(struct standby *s, uint64_t ms) {
+    if(s->hb == NULL)
+        return 1;
+    if(!s->active || __atomic_load_n(&s->hb->owner, __ATOMIC_ACQUIRE) != s->self)
+        return 0;
+    s->hb->interval_ms = ms;
+    __atomic_store_n(&s->hb->beat_ns, now_ns(), __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*
+ * Polled while standing by. Takes control when it was handed over or the owner is gone, and
+ * returns 1 with the owner's last published state.
+ * */
+int standby_watch(struct standby *s, struct standby_state *st) {
+    struct heartbeat *hb = s->hb;
+    const char *why = "handed over";
+    pid_t owner, self = s->self;
+
+    if(hb == NULL || s->active)
+        return 0;
+    owner = __atomic_load_n(&hb->owner, __ATOMIC_ACQUIRE);
+    if(owner != s->self && !(owner_gone(hb, owner, &why) && claim(hb, owner, s->self)))
+        return 0;
+
+    if(seq_read(&hb->seq, st, &hb->state, sizeof(*st)) < 0)
+        memset(st, 0, sizeof(*st));
+    __atomic_compare_exchange_n(&hb->request, &self, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    if(owner != s->self)
+        s->from = owner;
+    hb->interval_ms = s->interval_ms;
+    __atomic_store_n(&hb->beat_ns, now_ns(), __ATOMIC_RELEASE);
+    fprintf(stderr, "Took control of the fan from PID %d: %s.\n", owner, why);
+    return s->active = 1;
+}
+
+// Publishes the live view at the end of the owner's tick.
+void standby_publish(struct standby *s, const struct standby_live *live) {
+    if(s->hb != NULL && s->active)
+        seq_write(&s->hb->live_seq, &s->hb->live, live, sizeof(*live));
+}
+
+// Reads a consistent copy of the live view, for the dashboard.
+int standby_read_live(const struct heartbeat *hb, struct standby_live *live) {
+    return seq_read(&hb->live_seq, live, &hb->live, sizeof(*live));
+}
+
+/*
+ * Leaves a manual duty cycle override for the adaptive process in control, a negative duty
+ * returns to automatic control. Returns -1 when no adaptive process is ticking.
+ * */
+int standby_manual(const char *path, double duty, unsigned secs) {
+    struct heartbeat *hb;
+    struct stat sb;
+    const char *why;
+    int fd, ret = -1;
+
+    if((fd = open_heartbeat(path, O_RDWR)) < 0)
+        return -1;
+    if(fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(*hb)) {
+        close(fd);
+        return -1;
+    }
+    hb = mmap(NULL, sizeof(*hb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(hb == MAP_FAILED)
+        return -1;
+    if(hb->magic == STANDBY_MAGIC && hb->version == STANDBY_VERSION && !owner_gone(hb, hb->owner, &why)) {
+        hb->manual_duty = duty;
+        hb->manual_s = secs;
+        __atomic_fetch_add(&hb->manual_seq, 1, __ATOMIC_RELEASE);
+        ret = 0;
+    }
+    munmap(hb, sizeof(*hb));
+    return ret;
+}
+
+// Returns 1 with the override when a new one was left since the last call.
+int standby_poll_manual(struct standby *s, double *duty, unsigned *secs) {
+    uint32_t seq;
+
+    if(s->hb == NULL || (seq = __atomic_load_n(&s->hb->manual_seq, __ATOMIC_ACQUIRE)) == s->manual_seq)
+        return 0;
+    s->manual_seq = seq;
+    *duty = s->hb->manual_duty;
+    *secs = s->hb->manual_s;
+    return 1;
+}
+
+// Gives up control on a clean stop, so a standby takes over right away.
+void standby_close(struct standby *s) {
+    if(s->hb != NULL) {
+        claim(s->hb, s->self, 0);
+        munmap(s->hb, sizeof(*s->hb));
+    }
+    if(s->fd >= 0)
+        close(s->fd);
+    s->hb = NULL;
+    s->fd = -1;
+}
@@ -0,0 +1,99 @@
+/*
+ *  file: standby.h
+ *
+ *  Hot standby of the adaptive process. Every adaptive process maps a small heartbeat file,
+ *  in /run by default. The one in control owns it: it stamps the heartbeat and publishes
+ *  its controller state there on every tick. A standby instance (-S) polls the heartbeat four
+ *  times per tick interval and takes control over when the owner is gone or its heartbeat is
+ *  more than half an interval late, continuing from the published state.
+ *
+ *  Ownership is a pid in the shared page, changed only by compare-and-swap. An owner that
+ *  was hung and wakes up sees that it lost control before it writes anything, and turns into
+ *  a standby itself. A primary that is started again asks for control back, and an active
+ *  standby hands it over on its next tick.
+ *
+ *  The owner also publishes the live view of every tick there, which 'rpi_fan_util top'
+ *  reads without asking the daemon or the driver anything, and picks up manual duty cycle
+ *  overrides that 'rpi_fan_util -c' leaves there.
+ *
+ * */
+
+#ifndef RPIFAN_STANDBY_H
+#define RPIFAN_STANDBY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rpifan_plugin.h"
+
+#define STANDBY_MAGIC 0x42484652    // "RFHB"
+#define STANDBY_VERSION 4
+
+// Controller state handed over with control.
+struct standby_state {
+    uint64_t tick;
+    double prev_duty;
+    double temp_max;
+    double ambient;                 // NaN while unknown.
+};
+
+// Live view of the last tick of the owner.
+struct standby_live {
+    uint64_t tick;
+    uint64_t time_ms;               // Wall clock of the tick.
+    uint32_t interval_ms;
+    uint32_t ntemps;
+    float temps[RPIFAN_MAX_ZONES];
+    float temp;
+    float temp_max;
+    float duty;
+    float ambient;
+    uint32_t tick_ns;               // Processing time of the tick.
+    uint32_t nfans;                 // Hotplugged fans, besides the configured one.
+    float manual;                   // Manual duty cycle, -1 under automatic control.
+    uint32_t manual_left_s;         // Until the manual duty cycle expires.
+    uint64_t writes;
+    uint64_t suppressed;
+    uint64_t write_errors;
+    uint64_t read_errors;
+};
+
+struct heartbeat {
+    uint32_t magic;
+    uint32_t version;
+    int32_t owner;                  // Pid in control, 0 if none.
+    int32_t request;                // Pid of a primary that asks for control back.
+    uint64_t beat_ns;               // CLOCK_MONOTONIC of the owner's last tick.
+    uint64_t interval_ms;           // Tick interval of the owner.
+    uint32_t seq;                   // Odd while the state is being written.
+    uint32_t live_seq;
+    struct standby_state state;
+    struct standby_live live;
+    uint32_t manual_seq;            // Bumped by every override, after the fields below.
+    float manual_duty;              // Duty cycle of the override, -1 back to automatic.
+    uint32_t manual_s;              // How long the override holds.
+};
+
+struct standby {
+    int fd;
+    struct heartbeat *hb;           // NULL when the heartbeat is disabled.
+    pid_t self;
+    pid_t from;                     // Owner that control was last taken from, 0 if none.
+    int standby;                    // Started with -S, hands control back on request.
+    int active;                     // In control of the fan.
+    uint64_t interval_ms;
+    uint32_t manual_seq;            // Last override seen.
+};
+
+int standby_open(struct standby *s, const char *path, int standby, uint64_t interval_ms);
+int standby_beat(struct standby *s, const struct standby_state *st);
+int standby_owner(const struct standby *s);
+int standby_watch(struct standby *s, struct standby_state *st);
+void standby_publish(struct standby *s, const struct standby_live *live);
+int standby_sleep(struct standby *s, uint64_t ms);
+int standby_read_live(const struct heartbeat *hb, struct standby_live *live);
+int standby_manual(const char *path, double duty, unsigned secs);
+int standby_poll_manual(struct standby *s, double *duty, unsigned *secs);
+void standby_close(struct standby *s);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ *  file: stats.c
+ *
+ *  Latency histogram and the sharded event counters.
+ *
+ * */
+
+#include <stdlib.h>
+
+#include "stats.h"
+
+const char *counter_names[CNT_COUNT] = { "ticks", "writes", "suppressed", "write errors", "read errors", "drops" };
+
+/*
+ * Claims a shard for the calling thread, once per thread. Threads beyond COUNTER_SHARDS
+ * would have to share one, which is a bug in the caller.
+ * */
+struct counter_shard *counters_shard(struct counters *c) {
+    uint32_t i = __atomic_fetch_add(&c->nshards, 1, __ATOMIC_RELAXED);
+
+    if(i >= COUNTER_SHARDS) {
+        fprintf(stderr, "More than %d threads count events.\n", COUNTER_SHARDS);
+        abort();
+    }
+    return &c->shards[i];
+}
+
+uint64_t counter_read(const struct counters *c, enum counter id) {
+    uint32_t n = __atomic_load_n(&c->nshards, __ATOMIC_RELAXED);
+    uint64_t sum = 0;
+
+    for(uint32_t i = 0; i < n && i < COUNTER_SHARDS; i++)
+        sum += __atomic_load_n(&c->shards[i].v[id], __ATOMIC_RELAXED);
+    return sum;
+}
+
+void counters_print(FILE *f, const struct counters *c) {
+    for(int id = 0; id < CNT_COUNT; id++)
+        fprintf(f, "%s%lu %s", id ? ", " : "", counter_read(c, id), counter_names[id]);
+    fprintf(f, ".\n");
+}
+
+void lat_add(struct lat_hist *h, uint64_t ns) {
+    int b = ns ? 63 - __builtin_clzll(ns) : 0;
+
+    h->buckets[b < LAT_BUCKETS ? b : LAT_BUCKETS - 1]++;
+    h->count++;
+    h->sum_ns += ns;
+    if(ns > h->max_ns)
+        h->max_ns = ns;
+}
+
+// Upper bound of the bucket holding the q-th quantile.
+uint64_t lat_quantile(const struct lat_hist *h, double q) {
+    uint64_t rank = (uint64_t)(q * h->count), seen = 0;
+
+    for(int b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if(seen > rank)
+            return (2ull << b) < h->max_ns ? (2ull << b) : h->max_ns;
+    }
+    return h->max_ns;
+}
+
+void lat_print(FILE *f, const char *name, const struct lat_hist *h) {
+    if(h->count == 0) {
+        fprintf(f, "%s: no samples.\n", name);
+        return;
+    }
+
+    fprintf(f, "%s: %lu samples, mean %lu ns, p50 <%lu ns, p99 <%lu ns, max %lu ns.\n",
+            name, h->count, h->sum_ns / h->count,
+            lat_quantile(h, 0.5), lat_quantile(h, 0.99), h->max_ns);
+    for(int b = 0; b < LAT_BUCKETS; b++) {
+        if(h->buckets[b])
+            fprintf(f, "\t[%10lu, %10lu) ns: %lu\n", b ? 1ul << b : 0ul, 2ul << b, h->buckets[b]);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ *  file: stats.h
+ *
+ *  Event counters and a cheap latency histogram with power of two buckets. Adding a sample
+ *  is a couple of instructions, so it can be used on every tick.
+ *
+ *  The counters are sharded per thread. Each thread that counts claims a shard of its own,
+ *  padded to whole cache lines, and is its only writer, so a count is a plain load and store
+ *  with no locked instruction and no line moving between cores. Readers (the live view,
+ *  telemetry, the guardrails, SIGUSR1) sum the shards when they need a value.
+ *
+ * */
+
+#ifndef RPIFAN_STATS_H
+#define RPIFAN_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define LAT_BUCKETS 40
+#define COUNTER_SHARDS 8
+#define CACHE_LINE 64
+
+// Event counters of the adaptive process.
+enum counter {
+    CNT_TICKS,
+    CNT_WRITES,                     // Duty cycles written to the configured fan.
+    CNT_SUPPRESSED,                 // Writes skipped because the value did not change.
+    CNT_WRITE_ERRORS,
+    CNT_READ_ERRORS,
+    CNT_DROPS,                      // Telemetry datagrams that could not be sent.
+    CNT_COUNT,
+};
+
+struct counter_shard {
+    uint64_t v[CNT_COUNT];
+} __attribute__((aligned(CACHE_LINE)));
+
+struct counters {
+    struct counter_shard shards[COUNTER_SHARDS];
+    uint32_t nshards;
+};
+
+extern const char *counter_names[CNT_COUNT];
+
+// Only the thread that claimed the shard adds to it, readers may load it at any time.
+static inline void counter_add(struct counter_shard *s, enum counter id, uint64_t n) {
+    __atomic_store_n(&s->v[id], __atomic_load_n(&s->v[id], __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+struct counter_shard *counters_shard(struct counters *c);
+uint64_t counter_read(const struct counters *c, enum counter id);
+void counters_print(FILE *f, const struct counters *c);
+
+struct lat_hist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[LAT_BUCKETS];  // Bucket i holds samples in [2^i, 2^(i+1)) ns.
+};
+
+void lat_add(struct lat_hist *h, uint64_t ns);
+uint64_t lat_quantile(const struct lat_hist *h, double q);
+void lat_print(FILE *f, const char *name, const struct lat_hist *h);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ *  file: stepbench.c
+ *
+ *  Step response benchmark of the policies against the simulated board.
+ *
+ *  Each policy is warmed up at a low load, then the load is stepped up and later down again.
+ *  For each step the benchmark measures the time from the step to the first duty change, the
+ *  time until the temperature settles, the peak overshoot above the target temperature and
+ *  the amount of PWM writes. Everything runs in virtual time, so a run of hours takes
+ *  milliseconds and the numbers are exactly repeatable.
+ *
+ *  Where a step falls within the tick interval decides how long the policy waits for its
+ *  next tick, so every step is repeated at evenly spaced phases of the interval and both
+ *  the mean and the worst case are reported.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <libgen.h>
+
+#include "rpifan.h"
+#include "conf.h"
+#include "policy.h"
+#include "sim.h"
+
+#define STEP_MAX_POLICIES 8
+#define STEP_REACTION_EPS 0.005     // Duty change that counts as a reaction.
+#define STEP_SETTLE_BAND 0.5        // Settled when within this many C of the final temperature.
+#define STEP_WARMUP_S 1800.0
+
+struct step_opts {
+    double interval;    // Tick interval in seconds.
+    double target;      // Temperature the overshoot is measured against.
+    double low, high;   // Loads before and after the step up.
+    double window;      // Seconds measured after each step.
+    double ambient;
+    int phases;
+};
+
+struct step_result {
+    double reaction_sum, reaction_max;
+    int reacted;
+    double settle_sum, settle_max;
+    double overshoot;
+    uint64_t writes;
+};
+
+struct bench_run {
+    struct policy *policy;
+    struct sim sim;
+    struct rpifan_state st;
+    uint64_t written_dc;
+    uint64_t writes;
+    double now;
+    double next_tick;
+};
+
+// One tick of the adaptive process, the same steps in the same order.
+static void tick(struct bench_run *r, double interval) {
+    uint64_t new_dc;
+    double duty;
+
+    sim_step(&r->sim, r->next_tick - r->now);
+    r->now = r->next_tick;
+    r->next_tick += interval;
+
+    // Real thermal zones report whole millidegrees.
+    r->st.temps[0] = r->st.temp = floor(r->sim.temp * 1000.0) / 1000.0;
+    if(r->st.temp > r->st.temp_max)
+        r->st.temp_max = r->st.temp;
+    r->st.time_ns = r->now * 1e9;
+    r->st.load = r->sim.load;
+    r->st.tick++;
+
+    duty = policy_step(r->policy, &r->st);
+    new_dc = (uint64_t)(duty * PWM_PERIOD);
+    if(new_dc != r->written_dc) {
+        r->sim.duty = duty;
+        r->written_dc = new_dc;
+        r->writes++;
+    }
+    r->st.prev_duty = duty;
+}
+
+// Moves the virtual time to t, running every tick that falls before it.
+static void advance(struct bench_run *r, double t, double interval) {
+    while(r->next_tick <= t)
+        tick(r, interval);
+    sim_step(&r->sim, t - r->now);
+    r->now = t;
+}
+
+/*
+ * Applies the load step 'phase' seconds after the last tick and follows the response for
+ * the measurement window.
+ * */
+static void measure(struct bench_run *r, const struct step_opts *o, double load, double phase, struct step_result *res) {
+    double t0, duty0 = r->st.prev_duty, settle = 0.0, final, reaction = -1.0;
+    int n = 0, cap = o->window / o->interval + 2;
+    double *temps = malloc(cap * sizeof(double)), *times = malloc(cap * sizeof(double));
+    uint64_t writes0 = r->writes;
+
+    t0 = r->next_tick - o->interval + phase;
+    advance(r, t0, o->interval);
+    r->sim.load = load;
+
+    while(r->next_tick <= t0 + o->window && n < cap) {
+        tick(r, o->interval);
+        times[n] = r->now - t0;
+        temps[n++] = r->st.temp;
+        if(reaction < 0.0 && fabs(r->st.prev_duty - duty0) > STEP_REACTION_EPS)
+            reaction = r->now - t0;
+        if(r->st.temp - o->target > res->overshoot)
+            res->overshoot = r->st.temp - o->target;
+    }
+
+    // Settled from the first sample after the last one outside of the band.
+    final = n > 0 ? temps[n - 1] : 0.0;
+    for(int i = n - 1; i >= 0; i--) {
+        if(fabs(temps[i] - final) > STEP_SETTLE_BAND) {
+            settle = i + 1 < n ? times[i + 1] : times[i];
+            break;
+        }
+    }
+
+    if(reaction >= 0.0) {
+        res->reacted++;
+        res->reaction_sum += reaction;
+        if(reaction > res->reaction_max)
+            res->reaction_max = reaction;
+    }
+    res->settle_sum += settle;
+    if(settle > res->settle_max)
+        res->settle_max = settle;
+    res->writes += r->writes - writes0;
+
+    free(temps);
+    free(times);
+}
+
+static void print_result(const char *name, const char *step, const struct step_result *res, const struct step_opts *o, int up) {
+    char reaction[48] = "none", overshoot[16] = "-";
+
+    if(res->reacted)
+        snprintf(reaction, sizeof(reaction), "%7.0f %7.0f", res->reaction_sum / res->reacted * 1000.0, res->reaction_max * 1000.0);
+    if(up)
+        snprintf(overshoot, sizeof(overshoot), "%.2f", res->overshoot);
+
+    fprintf(stdout, "%-16s %-5s %15s %8.1f %8.1f %10s %8.1f\n", name, step, reaction,
+            res->settle_sum / o->phases, res->settle_max, overshoot, (double) res->writes / o->phases);
+}
+
+static int bench_policy(struct fan_conf *conf, const char *name, const struct step_opts *o) {
+    struct step_result up = { 0 }, down = { 0 };
+    struct policy policy;
+    struct bench_run r;
+    uint64_t steps = 0, step_ns = 0;
+
+    for(int p = 0; p < o->phases; p++) {
+        // Fresh policy for every phase, plugins may keep their own state.
+        if(policy_init(&policy, conf) < 0)
+            return -1;
+
+        memset(&r, 0, sizeof(r));
+        r.policy = &policy;
+        r.written_dc = UINT64_MAX;
+        r.st.abi = RPIFAN_PLUGIN_ABI;
+        r.st.size = sizeof(struct rpifan_state);
+        r.st.interval_ms = o->interval * 1000.0;
+        r.st.ntemps = 1;
+        sim_init(&r.sim, o->ambient, o->low);
+
+        advance(&r, STEP_WARMUP_S, o->interval);
+        measure(&r, o, o->high, o->interval * p / o->phases, &up);
+        measure(&r, o, o->low, o->interval * p / o->phases, &down);
+
+        steps += policy.cost.count;
+        step_ns += policy.cost.sum_ns;
+        policy_teardown(&policy);
+    }
+
+    print_result(name, "up", &up, o, 1);
+    print_result(name, "down", &down, o, 0);
+    dfprintf("%s: %.0f ns per policy step.\n", name, steps ? (double) step_ns / steps : 0.0);
+    return 0;
+}
+
+/*
+ * Runs the step response benchmark for the built-in policy and the policies of the given
+ * configuration files.
+ *
+ *      rpi_fan_util stepbench [-i ms] [-t C] [-l load] [-u load] [-w s] [-r phases] [conf...]
+ * */
+int stepbench_cmd(int argc, char **argv) {
+    struct step_opts o = {
+        .interval = 1.0, .target = 60.0, .low = 0.1, .high = 0.9,
+        .window = 600.0, .ambient = 25.0, .phases = 10,
+    };
+    struct fan_conf *conf;
+    int opt, ret = 0;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "i:t:l:u:w:r:a:")) != -1) {
+        switch(opt) {
+            case 'i': o.interval = strtod(optarg, NULL) / 1000.0; break;
+            case 't': o.target = strtod(optarg, NULL); break;
+            case 'l': o.low = strtod(optarg, NULL); break;
+            case 'u': o.high = strtod(optarg, NULL); break;
+            case 'w': o.window = strtod(optarg, NULL); break;
+            case 'r': o.phases = atoi(optarg); break;
+            case 'a': o.ambient = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "Usage: rpi_fan_util stepbench [-i ms] [-t C] [-l load] [-u load] [-w s] [-r phases] [-a C] [conf...]\n");
+                return -1;
+        }
+    }
+    if(o.interval <= 0.0 || o.window < o.interval || o.phases < 1) {
+        fprintf(stderr, "Interval, window and phases must be positive, window at least one interval.\n");
+        return -1;
+    }
+    if(argc - optind > STEP_MAX_POLICIES) {
+        fprintf(stderr, "At most %d configuration files can be compared.\n", STEP_MAX_POLICIES);
+        return -1;
+    }
+
+    conf = malloc(sizeof(*conf));
+    if(conf == NULL)
+        return -1;
+
+    fprintf(stdout, "Load %.2f -> %.2f -> %.2f, tick %.0f ms, %d phases, target %.1f C, window %.0f s.\n",
+            o.low, o.high, o.low, o.interval * 1000.0, o.phases, o.target, o.window);
+    fprintf(stdout, "%-16s %-5s %15s %8s %8s %10s %8s\n", "policy", "step", "reaction ms", "settle s", "max s", "overshoot", "writes");
+    fprintf(stdout, "%-16s %-5s %15s\n", "", "", "mean     max");
+
+    conf_default(conf);
+    ret |= bench_policy(conf, "builtin", &o);
+    for(int i = optind; i < argc; i++) {
+        if(conf_load(argv[i], conf) < 0) {
+            ret = -1;
+            continue;
+        }
+        ret |= bench_policy(conf, basename(argv[i]), &o);
+    }
+
+    free(conf);
+    return ret;
+}
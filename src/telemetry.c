@@ -0,0 +1,411 @@
+/*
+ *  file: telemetry.c
+ *
+ *  Telemetry push of the adaptive process and the collector.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "rpifan.h"
+#include "telemetry.h"
+
+#define COLLECT_MAX_BOARDS 1024
+#define COLLECT_BATCH 32
+#define COLLECT_HISTORY_KB 64
+#define COLLECT_SAVE_S 60
+
+struct board {
+    char name[BOARD_NAME_SIZE];
+    uint64_t received;
+    uint64_t lost;
+    uint32_t last_seq;
+    struct telemetry_msg last;
+    struct telemetry_shadow shadows[CONF_MAX_SHADOWS];
+    struct telemetry_fan fans[FANS_MAX];
+    int nfans;
+    struct history hist;
+    struct sketch_hour hours[SKETCH_HOURS];
+};
+
+static volatile sig_atomic_t collect_stop = 0;
+
+static void on_collect_signal(int sig) {
+    collect_stop = 1;
+}
+
+// Resolves 'host[:port]' and connects a non blocking UDP socket to it.
+static int udp_connect(const char *endpoint) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *res, *ai;
+    char host[256], *port;
+    int sock = -1, err;
+
+    strncpy(host, endpoint, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+    port = strrchr(host, ':');
+    if(port != NULL)
+        *port++ = '\0';
+
+    if((err = getaddrinfo(host, port != NULL ? port : TELEMETRY_PORT, &hints, &res)) != 0) {
+        fprintf(stderr, "Unable to resolve telemetry endpoint '%s': %s\n", endpoint, gai_strerror(err));
+        return -1;
+    }
+    for(ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if(sock >= 0 && connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        if(sock >= 0)
+            close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+
+    if(sock < 0)
+        fprintf(stderr, "Unable to connect to telemetry endpoint '%s'.\n", endpoint);
+    return sock;
+}
+
+int telemetry_open(struct telemetry *t, const char *endpoint, const char *board) {
+    memset(t, 0, sizeof(*t));
+    t->sock = udp_connect(endpoint);
+    if(t->sock < 0)
+        return -1;
+
+    if(board[0] != '\0')
+        strncpy(t->board, board, BOARD_NAME_SIZE - 1);
+    else
+        gethostname(t->board, BOARD_NAME_SIZE - 1);
+    for(int m = 0; m < SKETCH_NMETRICS; m++)
+        kll_init(&t->k[m]);
+    return 0;
+}
+
+void telemetry_sample(struct telemetry *t, const float *vals) {
+    for(int m = 0; m < SKETCH_NMETRICS; m++)
+        kll_add(&t->k[m], vals[m]);
+}
+
+/*
+ * Sends the datagram, on the telemetry timer of the adaptive process. The buffer is
+ * preallocated and the send never blocks; a full socket buffer or an unreachable collector
+ * just drops the datagram. Returns -1 when it was dropped.
+ * */
+int telemetry_push(struct telemetry *t, uint64_t epoch_ms, const struct rpifan_state *st, const struct counters *c,
+        const struct shadows *sh, const struct fans *fs) {
+    struct telemetry_msg *msg = (struct telemetry_msg*) t->buf;
+    struct telemetry_shadow ts;
+    struct telemetry_fan tf;
+    const struct shadow *s;
+    size_t len = sizeof(*msg), n;
+
+    memset(msg, 0, sizeof(*msg));
+    memcpy(msg->magic, TELEMETRY_MAGIC, 4);
+    msg->version = TELEMETRY_VERSION;
+    memcpy(msg->board, t->board, BOARD_NAME_SIZE);
+    msg->seq = t->seq++;
+    msg->interval_ms = st->interval_ms;
+    msg->time_ms = epoch_ms;
+    msg->ticks = counter_read(c, CNT_TICKS);
+    msg->writes = counter_read(c, CNT_WRITES);
+    msg->write_errors = counter_read(c, CNT_WRITE_ERRORS);
+    msg->read_errors = counter_read(c, CNT_READ_ERRORS);
+    msg->nzones = st->ntemps;
+    for(uint32_t z = 0; z < st->ntemps; z++)
+        msg->temps[z] = st->temps[z];
+    msg->temp = st->temp;
+    msg->temp_max = st->temp_max;
+    msg->duty = st->prev_duty;
+
+    for(int m = 0; m < SKETCH_NMETRICS; m++) {
+        n = kll_serialize(&t->k[m], t->buf + len, TELEMETRY_MAX_SIZE - len);
+        msg->sketch_len[m] = n;
+        len += n;
+        kll_init(&t->k[m]);
+    }
+
+    // Records follow the variable length sketches, so they are copied in unaligned.
+    for(int i = 0; sh != NULL && i < sh->n && len + sizeof(ts) <= TELEMETRY_MAX_SIZE; i++) {
+        s = &sh->s[i];
+        memset(&ts, 0, sizeof(ts));
+        memcpy(ts.name, s->name, SHADOW_NAME_SIZE);
+        ts.ticks = s->policy.cost.count;
+        ts.writes = s->writes;
+        ts.diverged = s->diverged;
+        ts.div_mean = ts.ticks ? s->div_sum / ts.ticks : 0.0;
+        ts.div_max = s->div_max;
+        ts.cost_mean_ns = ts.ticks ? s->policy.cost.sum_ns / ts.ticks : 0;
+        ts.cost_max_ns = s->policy.cost.max_ns;
+        memcpy(t->buf + len, &ts, sizeof(ts));
+        len += sizeof(ts);
+        msg->nshadows++;
+    }
+
+    // The fans fill the rest, their count follows from the length.
+    for(int i = 0; fs != NULL && i < fs->n && len + sizeof(tf) <= TELEMETRY_MAX_SIZE; i++) {
+        const struct lat_hist *h = &fs->f[i].lat;
+
+        tf = (struct telemetry_fan) {
+            .writes = fs->f[i].writes, .errors = fs->f[i].errors, .phase_ms = fs->f[i].phase_ms,
+            .mean_ns = h->count ? h->sum_ns / h->count : 0, .p99_ns = lat_quantile(h, 0.99), .max_ns = h->max_ns,
+        };
+        memcpy(t->buf + len, &tf, sizeof(tf));
+        len += sizeof(tf);
+    }
+    msg->len = len;
+
+    if(send(t->sock, t->buf, len, MSG_DONTWAIT) < 0) {
+        dfprintf("Telemetry datagram %u dropped: %m\n", msg->seq);
+        return -1;
+    }
+    return 0;
+}
+
+void telemetry_close(struct telemetry *t) {
+    if(t->sock >= 0)
+        close(t->sock);
+    t->sock = -1;
+}
+
+// Number of fan records of a valid datagram, -1 when it is not valid.
+static int valid_msg(const struct telemetry_msg *msg, size_t len) {
+    size_t total = sizeof(*msg);
+
+    if(len < sizeof(*msg) || memcmp(msg->magic, TELEMETRY_MAGIC, 4) != 0
+            || msg->version < 1 || msg->version > TELEMETRY_VERSION || msg->len != len
+            || msg->nzones == 0 || msg->nzones > RPIFAN_MAX_ZONES
+            || memchr(msg->board, '\0', BOARD_NAME_SIZE) == NULL || msg->board[0] == '\0')
+        return -1;
+    // Version 1 had the shadow count reserved as zero.
+    if(msg->nshadows > CONF_MAX_SHADOWS)
+        return -1;
+    for(int m = 0; m < SKETCH_NMETRICS; m++)
+        total += msg->sketch_len[m];
+    total += msg->nshadows * sizeof(struct telemetry_shadow);
+    // Versions before 3 end with the shadows.
+    if(total > len || (msg->version < 3 && total != len) || (len - total) % sizeof(struct telemetry_fan) != 0
+            || (len - total) / sizeof(struct telemetry_fan) > FANS_MAX)
+        return -1;
+    return (len - total) / sizeof(struct telemetry_fan);
+}
+
+// Open addressing over board names, boards are only allocated once seen.
+static struct board *find_board(struct board **table, const char *name, int nzones, unsigned history_kb) {
+    uint32_t hash = 2166136261u;
+    struct board *b;
+
+    for(const char *p = name; *p; p++)
+        hash = (hash ^ (uint8_t) *p) * 16777619u;
+
+    for(uint32_t i = 0; i < COLLECT_MAX_BOARDS; i++) {
+        b = table[(hash + i) % COLLECT_MAX_BOARDS];
+        if(b != NULL && strcmp(b->name, name) == 0)
+            return b;
+        if(b != NULL)
+            continue;
+
+        b = calloc(1, sizeof(*b));
+        if(b == NULL || hist_init(&b->hist, nzones + 1, history_kb * 1024ul) < 0) {
+            free(b);
+            return NULL;
+        }
+        strcpy(b->name, name);
+        table[(hash + i) % COLLECT_MAX_BOARDS] = b;
+        dfprintf("New board '%s' with %d thermal zone(s).\n", name, nzones);
+        return b;
+    }
+    return NULL;
+}
+
+static void merge_msg(struct board *b, const struct telemetry_msg *msg, int nfans) {
+    double vals[HIST_MAX_VALUES];
+    uint64_t hour = msg->time_ms / 3600000;
+    struct sketch_hour *slot = &b->hours[hour % SKETCH_HOURS];
+    const uint8_t *p = msg->sketches;
+    struct kll k;
+
+    if(b->received > 0 && msg->seq != b->last_seq + 1)
+        b->lost += msg->seq > b->last_seq ? msg->seq - b->last_seq - 1 : 0;
+    b->last_seq = msg->seq;
+    b->received++;
+    b->last = *msg;
+
+    // Same units as the history of the adaptive process.
+    if((int) msg->nzones + 1 == b->hist.nvalues) {
+        for(uint32_t z = 0; z < msg->nzones; z++)
+            vals[z] = (int64_t)(msg->temps[z] * 1000.0f + 0.5f);
+        vals[msg->nzones] = (uint64_t)(msg->duty * PWM_PERIOD);
+        hist_add(&b->hist, msg->time_ms, vals);
+    }
+
+    if(slot->hour != hour) {
+        slot->hour = hour;
+        for(int m = 0; m < SKETCH_NMETRICS; m++)
+            kll_init(&slot->k[m]);
+    }
+    for(int m = 0; m < SKETCH_NMETRICS; m++) {
+        if(kll_deserialize(&k, p, msg->sketch_len[m]) == 0)
+            kll_merge(&slot->k[m], &k);
+        p += msg->sketch_len[m];
+    }
+    memcpy(b->shadows, p, msg->nshadows * sizeof(struct telemetry_shadow));
+    p += msg->nshadows * sizeof(struct telemetry_shadow);
+    memcpy(b->fans, p, nfans * sizeof(struct telemetry_fan));
+    b->nfans = nfans;
+}
+
+static void save_boards(struct board **table, const char *dir) {
+    char path[512], name[BOARD_NAME_SIZE];
+
+    for(int i = 0; i < COLLECT_MAX_BOARDS; i++) {
+        if(table[i] == NULL)
+            continue;
+        // Board names come from the network, only a safe subset ends up in the path.
+        for(int c = 0; c < BOARD_NAME_SIZE; c++) {
+            name[c] = table[i]->name[c];
+            if(name[c] != '\0' && !(name[c] >= 'a' && name[c] <= 'z') && !(name[c] >= 'A' && name[c] <= 'Z')
+                    && !(name[c] >= '0' && name[c] <= '9') && name[c] != '-' && name[c] != '_')
+                name[c] = '_';
+        }
+        snprintf(path, sizeof(path), "%s/%s.hist", dir, name);
+        sketch_save(&table[i]->hist, path, table[i]->hours);
+    }
+}
+
+static void print_boards(struct board **table) {
+    const struct sketch_hour *slot;
+    struct board *b;
+
+    fprintf(stdout, "%-20s %10s %8s %8s %8s %8s %10s\n", "board", "received", "lost", "temp", "duty", "p95", "writes");
+    for(int i = 0; i < COLLECT_MAX_BOARDS; i++) {
+        if((b = table[i]) == NULL)
+            continue;
+        slot = &b->hours[(b->last.time_ms / 3600000) % SKETCH_HOURS];
+        fprintf(stdout, "%-20s %10lu %8lu %8.1f %7.1f%% %8.1f %10lu\n", b->name, b->received, b->lost,
+                b->last.temp, b->last.duty * 100.0, kll_quantile(&slot->k[SKETCH_TEMP], 0.95), b->last.writes);
+        for(int s = 0; s < b->last.nshadows; s++) {
+            const struct telemetry_shadow *ts = &b->shadows[s];
+            fprintf(stdout, "  shadow %-24.24s %lu writes, diverged %lu of %lu ticks, duty diff mean %.2f%% max %.2f%%, %u ns per step\n",
+                    ts->name, ts->writes, ts->diverged, ts->ticks, ts->div_mean * 100.0, ts->div_max * 100.0, ts->cost_mean_ns);
+        }
+        for(int f = 0; f < b->nfans; f++) {
+            const struct telemetry_fan *tf = &b->fans[f];
+            fprintf(stdout, "  fan %d at +%u ms: %lu writes, %lu errors, ioctl mean %u ns, p99 <%u ns, max %u ns\n",
+                    f, tf->phase_ms, tf->writes, tf->errors, tf->mean_ns, tf->p99_ns, tf->max_ns);
+        }
+    }
+}
+
+/*
+ * Receives telemetry of many boards.
+ *
+ *      rpi_fan_util collect [-l port] [-o dir] [-i seconds] [-k kb]
+ *
+ * Datagrams are read in batches with recvmmsg(), merged into a per board history and hourly
+ * sketches, and written to '<dir>/<board>.hist' every interval and on exit.
+ * */
+int collect_cmd(int argc, char **argv) {
+    static uint8_t bufs[COLLECT_BATCH][TELEMETRY_MAX_SIZE];
+    struct mmsghdr msgs[COLLECT_BATCH];
+    struct iovec iov[COLLECT_BATCH];
+    struct addrinfo hints = { .ai_family = AF_INET6, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE }, *res;
+    struct board **table;
+    const char *port = TELEMETRY_PORT, *dir = ".";
+    unsigned save_s = COLLECT_SAVE_S, history_kb = COLLECT_HISTORY_KB;
+    uint64_t next_save, invalid = 0;
+    struct pollfd pfd;
+    struct board *b;
+    int sock, n, opt, nfans, off = 0;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "l:o:i:k:")) != -1) {
+        switch(opt) {
+            case 'l': port = optarg; break;
+            case 'o': dir = optarg; break;
+            case 'i': save_s = strtoul(optarg, NULL, 10); break;
+            case 'k': history_kb = strtoul(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: rpi_fan_util collect [-l port] [-o dir] [-i seconds] [-k kb]\n");
+                return -1;
+        }
+    }
+
+    if(getaddrinfo(NULL, port, &hints, &res) != 0) {
+        fprintf(stderr, "Invalid port '%s'.\n", port);
+        return -1;
+    }
+    sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(sock >= 0)
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));     // Also IPv4.
+    if(sock < 0 || bind(sock, res->ai_addr, res->ai_addrlen) < 0) {
+        perror("Unable to bind the collector socket");
+        freeaddrinfo(res);
+        return -1;
+    }
+    freeaddrinfo(res);
+    mkdir(dir, 0755);
+
+    table = calloc(COLLECT_MAX_BOARDS, sizeof(*table));
+    if(table == NULL) {
+        perror("Unable to allocate the board table");
+        return -1;
+    }
+    for(int i = 0; i < COLLECT_BATCH; i++) {
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = TELEMETRY_MAX_SIZE;
+        msgs[i].msg_hdr = (struct msghdr) { .msg_iov = &iov[i], .msg_iovlen = 1 };
+    }
+
+    signal(SIGINT, on_collect_signal);
+    signal(SIGTERM, on_collect_signal);
+    fprintf(stdout, "Collecting telemetry on port %s into '%s'.\n", port, dir);
+
+    pfd.fd = sock;
+    pfd.events = POLLIN;
+    next_save = now_ns() + save_s * 1000000000ull;
+    while(!collect_stop) {
+        if(poll(&pfd, 1, 1000) > 0 && (n = recvmmsg(sock, msgs, COLLECT_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+            for(int i = 0; i < n; i++) {
+                const struct telemetry_msg *msg = (const void*) bufs[i];
+
+                if((nfans = valid_msg(msg, msgs[i].msg_len)) < 0) {
+                    invalid++;
+                    continue;
+                }
+                if((b = find_board(table, msg->board, msg->nzones, history_kb)) != NULL)
+                    merge_msg(b, msg, nfans);
+            }
+        }
+
+        if(now_ns() >= next_save) {
+            next_save += save_s * 1000000000ull;
+            save_boards(table, dir);
+            if(debug)
+                print_boards(table);
+        }
+    }
+
+    save_boards(table, dir);
+    print_boards(table);
+    if(invalid)
+        fprintf(stdout, "%lu invalid datagrams ignored.\n", invalid);
+
+    for(int i = 0; i < COLLECT_MAX_BOARDS; i++) {
+        if(table[i] != NULL)
+            hist_free(&table[i]->hist);
+        free(table[i]);
+    }
+    free(table);
+    close(sock);
+    return 0;
+}
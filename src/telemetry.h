@@ -0,0 +1,103 @@
+/*
+ *  file: telemetry.h
+ *
+ *  Fleet telemetry. The adaptive process periodically pushes one binary datagram with its
+ *  counters, current state and sketches of the samples since the previous push to a UDP
+ *  endpoint. The 'collect' subcommand receives datagrams of many boards, merges them in
+ *  memory and writes one history file per board.
+ *
+ *  Datagrams are one-way and fire-and-forget: a lost datagram only loses the samples of one
+ *  interval in the sketches, which the collector detects from the sequence numbers.
+ *
+ * */
+
+#ifndef RPIFAN_TELEMETRY_H
+#define RPIFAN_TELEMETRY_H
+
+#include <stdint.h>
+
+#include "rpifan_plugin.h"
+#include "sketch.h"
+#include "stats.h"
+#include "shadow.h"
+#include "fans.h"
+
+#define TELEMETRY_MAGIC "RFTM"
+#define TELEMETRY_VERSION 3
+#define TELEMETRY_PORT "9797"
+#define TELEMETRY_MAX_SIZE 16384
+#define BOARD_NAME_SIZE 32
+
+/*
+ * Datagram layout
+ *
+ * Fixed header followed by the serialized sketches, sketch_len[i] bytes each, nshadows
+ * shadow policy records and a fan record for each fan, up to the end of the datagram. All
+ * fields are in the byte order of the sender, the collector refuses foreign magic. Version 2
+ * is the same without fans, version 1 also without shadows.
+ * */
+struct telemetry_msg {
+    char magic[4];
+    uint16_t version;
+    uint16_t len;                       // Size of the whole datagram.
+    char board[BOARD_NAME_SIZE];
+    uint32_t seq;
+    uint32_t interval_ms;               // Tick interval of the sender.
+    uint64_t time_ms;                   // Milliseconds since the epoch.
+    uint64_t ticks;
+    uint64_t writes;
+    uint64_t write_errors;
+    uint64_t read_errors;
+    uint32_t nzones;
+    float temps[RPIFAN_MAX_ZONES];
+    float temp;
+    float temp_max;
+    float duty;
+    uint16_t sketch_len[SKETCH_NMETRICS];
+    uint16_t nshadows;
+    uint8_t sketches[];
+};
+
+// Totals of one shadow policy since the start of the adaptive process.
+struct telemetry_shadow {
+    char name[SHADOW_NAME_SIZE];
+    uint64_t ticks;
+    uint64_t writes;                    // Writes it would have done.
+    uint64_t diverged;                  // Ticks on which it would have written another value.
+    float div_mean;                     // Mean and maximum duty difference to the active policy.
+    float div_max;
+    uint32_t cost_mean_ns;
+    uint32_t cost_max_ns;
+};
+
+// Writes of one fan since the start of the adaptive process.
+struct telemetry_fan {
+    uint64_t writes;
+    uint64_t errors;
+    uint32_t phase_ms;                  // Offset of its writes after the tick.
+    uint32_t mean_ns;                   // Duration of the ioctl.
+    uint32_t p99_ns;                    // Upper bound, a power of two.
+    uint32_t max_ns;
+};
+
+_Static_assert(sizeof(struct telemetry_msg) == 144, "telemetry_msg layout is a part of the protocol");
+_Static_assert(sizeof(struct telemetry_shadow) == 64, "telemetry_shadow layout is a part of the protocol");
+_Static_assert(sizeof(struct telemetry_fan) == 32, "telemetry_fan layout is a part of the protocol");
+
+struct telemetry {
+    int sock;
+    uint32_t seq;
+    char board[BOARD_NAME_SIZE];
+    struct kll k[SKETCH_NMETRICS];      // Samples since the last push.
+    uint8_t buf[TELEMETRY_MAX_SIZE];
+};
+
+int telemetry_open(struct telemetry *t, const char *endpoint, const char *board);
+void telemetry_sample(struct telemetry *t, const float *vals);
+int telemetry_push(struct telemetry *t, uint64_t epoch_ms, const struct rpifan_state *st, const struct counters *c,
+        const struct shadows *sh, const struct fans *fs);
+void telemetry_close(struct telemetry *t);
+
+int collect_cmd(int argc, char **argv);
+
+#endif
@@ -0,0 +1,300 @@
+/*
+ *  file: top.c
+ *
+ *  Live dashboard of one or several adaptive processes. Each of them publishes the view of
+ *  its last tick in its heartbeat file (see standby.h), which is mapped read-only here, so a
+ *  frame costs no syscall to the daemon or the driver.
+ *
+ *  The screen is kept as a grid of cells. A frame is drawn into the grid, compared with the
+ *  previous one, and only the cells that changed are sent, with cursor moves in between, in
+ *  a single write.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rpifan.h"
+#include "conf.h"
+#include "standby.h"
+
+#define TOP_MAX_PANELS 8
+#define TOP_MAX_ROWS 100
+#define TOP_MAX_COLS 240
+#define TOP_HISTORY TOP_MAX_COLS
+#define TOP_CELL_SIZE 4             // UTF-8 of one column, the sparkline blocks take 3 bytes.
+#define TOP_MOVE_SIZE 10            // Longest cursor move, '\033[100;240H'.
+// A frame that changes every cell, each after a cursor move, and the screen setup before it.
+#define TOP_OUT_SIZE (TOP_MAX_ROWS * TOP_MAX_COLS * (TOP_MOVE_SIZE + TOP_CELL_SIZE) + 64)
+#define TOP_LINE_SIZE 512
+#define TOP_STALE_TICKS 3           // Missed ticks until the daemon counts as stalled.
+
+struct top_panel {
+    const char *path;
+    int fd;
+    const struct heartbeat *hb;
+    struct standby_live live;
+    float temps[TOP_HISTORY];       // Ring of the samples of past frames.
+    float duties[TOP_HISTORY];
+    int head, count;
+    uint64_t writes0, time0_ms;     // Write rate over the last few seconds.
+    double write_rate;
+};
+
+struct screen {
+    int rows, cols;
+    char cur[TOP_MAX_ROWS][TOP_MAX_COLS][TOP_CELL_SIZE];
+    char prev[TOP_MAX_ROWS][TOP_MAX_COLS][TOP_CELL_SIZE];
+    char out[TOP_OUT_SIZE];
+    size_t len;
+};
+
+static const char *spark[] = { "▁", "▂", "▃", "▄", "▅", "▆", "▇", "█" };
+
+static volatile sig_atomic_t top_stop = 0, top_resized = 1;
+
+static void on_top_signal(int sig) {
+    if(sig == SIGWINCH)
+        top_resized = 1;
+    else
+        top_stop = 1;
+}
+
+// Appends to the output of the frame. Returns -1 when it did not fit and nothing was added.
+static int emit(struct screen *s, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(s->out + s->len, sizeof(s->out) - s->len, fmt, ap);
+    va_end(ap);
+    if(n < 0 || s->len + n >= sizeof(s->out))
+        return -1;
+    s->len += n;
+    return 0;
+}
+
+// Text from the given column on, cut at the edge of the screen.
+static void put(struct screen *s, int row, int col, const char *fmt, ...) {
+    char line[TOP_LINE_SIZE];
+    va_list ap;
+
+    if(row >= s->rows)
+        return;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    for(const char *p = line; *p && col < s->cols; p++, col++) {
+        memset(s->cur[row][col], 0, TOP_CELL_SIZE);
+        s->cur[row][col][0] = *p;
+    }
+}
+
+static void put_glyph(struct screen *s, int row, int col, const char *glyph) {
+    if(row < s->rows && col < s->cols)
+        strncpy(s->cur[row][col], glyph, TOP_CELL_SIZE);
+}
+
+static void clear(struct screen *s) {
+    for(int r = 0; r < s->rows; r++) {
+        for(int c = 0; c < s->cols; c++) {
+            memset(s->cur[r][c], 0, TOP_CELL_SIZE);
+            s->cur[r][c][0] = ' ';
+        }
+    }
+}
+
+/*
+ * Sends the cells that differ from the previous frame, moving the cursor only over gaps. A cell
+ * only counts as sent once it is in the output, otherwise it is tried again on the next frame.
+ * */
+static void flush(struct screen *s) {
+    int crow = -1, ccol = -1;
+
+    for(int r = 0; r < s->rows; r++) {
+        for(int c = 0; c < s->cols; c++) {
+            if(memcmp(s->cur[r][c], s->prev[r][c], TOP_CELL_SIZE) == 0)
+                continue;
+            if((r != crow || c != ccol) && emit(s, "\033[%d;%dH", r + 1, c + 1) < 0)
+                break;
+            if(emit(s, "%.4s", s->cur[r][c]) < 0)
+                break;
+            memcpy(s->prev[r][c], s->cur[r][c], TOP_CELL_SIZE);
+            crow = r;
+            ccol = c + 1;
+        }
+    }
+    if(s->len && write(STDOUT_FILENO, s->out, s->len) < 0)
+        top_stop = 1;
+    s->len = 0;
+}
+
+// Takes the terminal size. Everything is sent again, the terminal may have lost it.
+static void resize(struct screen *s) {
+    struct winsize ws;
+
+    s->rows = 24;
+    s->cols = 80;
+    if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row && ws.ws_col) {
+        s->rows = ws.ws_row < TOP_MAX_ROWS ? ws.ws_row : TOP_MAX_ROWS;
+        s->cols = ws.ws_col < TOP_MAX_COLS ? ws.ws_col : TOP_MAX_COLS;
+    }
+    memset(s->prev, 0, sizeof(s->prev));
+    emit(s, "\033[2J");
+}
+
+// Maps the heartbeat of a daemon, retried on every frame until it exists.
+static void attach(struct top_panel *p) {
+    struct stat sb;
+    void *map;
+
+    if(p->hb != NULL)
+        return;
+    if(p->fd < 0 && (p->fd = open(p->path, O_RDONLY | O_CLOEXEC)) < 0)
+        return;
+    if(fstat(p->fd, &sb) < 0 || sb.st_size < (off_t) sizeof(struct heartbeat))
+        return;
+    map = mmap(NULL, sizeof(struct heartbeat), PROT_READ, MAP_SHARED, p->fd, 0);
+    if(map != MAP_FAILED)
+        p->hb = map;
+}
+
+static void sparkline(struct screen *s, int row, int col, const float *ring, int head, int count, float lo, float hi) {
+    int width = s->cols - col, n = count < width ? count : width, level;
+    float v;
+
+    for(int i = 0; i < n; i++) {
+        v = ring[(head - n + i + TOP_HISTORY) % TOP_HISTORY];
+        level = hi > lo ? (int)((v - lo) / (hi - lo) * 7.0 + 0.5) : 0;
+        put_glyph(s, row, col + i, spark[level < 0 ? 0 : level > 7 ? 7 : level]);
+    }
+}
+
+// Draws one daemon from the given row on. Returns the rows it took.
+static int draw_panel(struct screen *s, struct top_panel *p, int row, uint64_t now_ms) {
+    const struct heartbeat *hb;
+    struct standby_live *l = &p->live;
+    char manual[48] = "";
+    float lo, hi;
+
+    attach(p);
+    if((hb = p->hb) == NULL || hb->magic != STANDBY_MAGIC || hb->version != STANDBY_VERSION
+            || standby_read_live(hb, l) < 0 || l->time_ms == 0) {
+        put(s, row, 0, "%s: no adaptive PWM process", p->path);
+        return 2;
+    }
+
+    p->temps[p->head] = l->temp;
+    p->duties[p->head] = l->duty * 100.0;
+    p->head = (p->head + 1) % TOP_HISTORY;
+    if(p->count < TOP_HISTORY)
+        p->count++;
+    if(now_ms >= p->time0_ms + 5000 || l->writes < p->writes0) {
+        p->write_rate = p->time0_ms && l->writes >= p->writes0 ?
+            (l->writes - p->writes0) * 1000.0 / (now_ms - p->time0_ms) : 0.0;
+        p->writes0 = l->writes;
+        p->time0_ms = now_ms;
+    }
+
+    put(s, row, 0, "%s  pid %d  tick %lu every %u ms%s", p->path, hb->owner, l->tick, l->interval_ms,
+            now_ms > l->time_ms + TOP_STALE_TICKS * l->interval_ms ? "  STALLED" : "");
+    if(l->manual >= 0.0)
+        snprintf(manual, sizeof(manual), "  manual %.0f %% for %u s", l->manual * 100.0, l->manual_left_s);
+    put(s, row + 1, 0, "temp %5.1f C  max %5.1f C  ambient %5.1f C  duty %5.1f %%  fans %u%s",
+            l->temp, l->temp_max, l->ambient, l->duty * 100.0, 1 + l->nfans, manual);
+    put(s, row + 2, 0, "zones");
+    for(uint32_t z = 0; z < l->ntemps && z < RPIFAN_MAX_ZONES; z++)
+        put(s, row + 2, 5 + z * 8, " %5.1f C", l->temps[z]);
+    put(s, row + 3, 0, "writes %lu (%.2f/s)  suppressed %lu  errors %lu read, %lu write  tick %.1f us",
+            l->writes, p->write_rate, l->suppressed, l->read_errors, l->write_errors, l->tick_ns / 1000.0);
+
+    lo = hi = p->temps[(p->head - 1 + TOP_HISTORY) % TOP_HISTORY];
+    for(int i = 0; i < p->count; i++) {
+        lo = p->temps[i] < lo ? p->temps[i] : lo;
+        hi = p->temps[i] > hi ? p->temps[i] : hi;
+    }
+    put(s, row + 4, 0, "temp ");
+    sparkline(s, row + 4, 5, p->temps, p->head, p->count, lo, hi);
+    put(s, row + 5, 0, "duty ");
+    sparkline(s, row + 5, 5, p->duties, p->head, p->count, 0.0, 100.0);
+    return 7;
+}
+
+static uint64_t wall_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Live view of adaptive processes, until interrupted or for the given amount of frames.
+ *
+ *      rpi_fan_util top [-i ms] [-n frames] [heartbeat...]
+ * */
+int top_cmd(int argc, char **argv) {
+    static struct screen scr;
+    struct top_panel panels[TOP_MAX_PANELS] = { 0 };
+    uint64_t interval_ms = 500, frames = 0, start;
+    int npanels = 0, opt, row;
+
+    optind = 1;
+    while((opt = getopt(argc, argv, "i:n:")) != -1) {
+        switch(opt) {
+            case 'i': interval_ms = strtoull(optarg, NULL, 10); break;
+            case 'n': frames = strtoull(optarg, NULL, 10); break;
+            default:
+                fprintf(stderr, "Usage: rpi_fan_util top [-i ms] [-n frames] [heartbeat...]\n");
+                return -1;
+        }
+    }
+    if(interval_ms == 0)
+        interval_ms = 1;
+    for(int i = optind; i < argc && npanels < TOP_MAX_PANELS; i++)
+        panels[npanels++].path = argv[i];
+    if(npanels == 0)
+        panels[npanels++].path = CONF_HEARTBEAT;
+    for(int i = 0; i < npanels; i++)
+        panels[i].fd = -1;
+
+    signal(SIGINT, on_top_signal);
+    signal(SIGTERM, on_top_signal);
+    signal(SIGWINCH, on_top_signal);
+
+    // Alternate screen without the cursor, restored on the way out.
+    emit(&scr, "\033[?1049h\033[?25l");
+    start = now_ns();
+    for(uint64_t f = 0; !top_stop && (frames == 0 || f < frames); f++) {
+        if(top_resized) {
+            top_resized = 0;
+            resize(&scr);
+        }
+        clear(&scr);
+        row = 0;
+        for(int i = 0; i < npanels; i++)
+            row += draw_panel(&scr, &panels[i], row, wall_ms());
+        put(&scr, scr.rows - 1, 0, "refresh %lu ms, Ctrl-C quits", interval_ms);
+        flush(&scr);
+        sleep_until(start + (f + 1) * interval_ms * 1000000ull);
+    }
+    emit(&scr, "\033[?25h\033[?1049l");
+    flush(&scr);
+
+    for(int i = 0; i < npanels; i++) {
+        if(panels[i].hb != NULL)
+            munmap((void*) panels[i].hb, sizeof(struct heartbeat));
+        if(panels[i].fd >= 0)
+            close(panels[i].fd);
+    }
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ *  file: w1sensor.c
+ *
+ *  Worker thread of the 1-Wire sensors and the slots it publishes to.
+ *
+ * */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+
+#include "rpifan.h"
+#include "w1sensor.h"
+
+#define W1_BUF_SIZE 128
+#define W1_POWER_ON_MDEG 85000      // Reset value of the DS18B20, read when a conversion failed.
+
+/*
+ * Waits until the monotonic deadline, or for as long as the worker is parked. Returns 1 when
+ * the worker is asked to stop.
+ * */
+static int wait_until(struct w1_sensors *w, uint64_t deadline_ns) {
+    struct pollfd pfd = { .fd = w->wake, .events = POLLIN };
+    uint64_t now, v;
+    int timeout;
+
+    for(;;) {
+        now = now_ns();
+        timeout = deadline_ns > now ? (deadline_ns - now + 999999) / 1000000 : 0;
+        if(poll(&pfd, 1, __atomic_load_n(&w->parked, __ATOMIC_ACQUIRE) ? -1 : timeout) <= 0)
+            return 0;
+        if(read(w->wake, &v, sizeof(v)) < 0)
+            return 0;
+        if(__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
+            return 1;
+        if(!__atomic_load_n(&w->parked, __ATOMIC_ACQUIRE))
+            return 0;
+    }
+}
+
+// Millidegrees from 'temperature', or from the second line of 'w1_slave' if its CRC was good.
+static int read_sensor(struct w1_sensor *s, int32_t *mdeg) {
+    char buf[W1_BUF_SIZE], *t;
+    ssize_t n;
+
+    if((n = pread(s->fd, buf, sizeof(buf) - 1, 0)) <= 0)
+        return -1;
+    buf[n] = '\0';
+    if((t = strstr(buf, "t=")) != NULL) {
+        if(strstr(buf, "YES") == NULL)
+            return -1;
+        t += 2;
+    } else {
+        t = buf;
+    }
+    *mdeg = (int32_t) strtol(t, NULL, 10);
+    return *mdeg == W1_POWER_ON_MDEG ? -1 : 0;
+}
+
+static void *worker(void *arg) {
+    struct w1_sensors *w = arg;
+    struct counter_shard *ctr = counters_shard(w->cnt);
+    uint64_t next = now_ns(), ms;
+    int32_t mdeg;
+
+    for(;;) {
+        // Every sensor of a master converts at once, the reads below then return right away.
+        for(int m = 0; m < w->nmasters; m++) {
+            if(pwrite(w->masters[m], "trigger\n", 8, 0) < 0)
+                counter_add(ctr, CNT_READ_ERRORS, 1);
+        }
+        if(w->nmasters && wait_until(w, now_ns() + W1_CONVERT_MS * 1000000ull))
+            break;
+
+        for(int i = 0; i < w->nsensors; i++) {
+            if(read_sensor(&w->sensors[i], &mdeg) < 0) {
+                counter_add(ctr, CNT_READ_ERRORS, 1);
+                continue;
+            }
+            ms = now_ns() / 1000000ull;
+            __atomic_store_n(&w->sensors[i].slot, (uint64_t)(uint32_t) mdeg << 32 | (uint32_t)(ms ? ms : 1), __ATOMIC_RELEASE);
+        }
+
+        // After a park the reads start over from now, the missed ones are not caught up.
+        next += w->interval_ms * 1000000ull;
+        if(next < now_ns())
+            next = now_ns();
+        if(wait_until(w, next))
+            break;
+    }
+    return NULL;
+}
+
+// Opens the 'therm_bulk_read' of the master of the sensor, once per master.
+static int add_master(struct w1_sensors *w, const struct fan_conf *conf, const char *id, char (*seen)[PATH_MAX]) {
+    char path[W1_PATH_SIZE];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/bus/w1/devices/%s/../therm_bulk_read", conf->sysfs, id);
+    if(realpath(path, seen[w->nmasters]) == NULL)
+        return -1;
+    for(int m = 0; m < w->nmasters; m++) {
+        if(strcmp(seen[m], seen[w->nmasters]) == 0)
+            return m;
+    }
+    if(w->nmasters == W1_MAX_MASTERS || (fd = open(path, O_WRONLY | O_CLOEXEC)) < 0)
+        return -1;
+    w->masters[w->nmasters] = fd;
+    return w->nmasters++;
+}
+
+int w1_open(struct w1_sensors *w, const struct fan_conf *conf, struct counters *cnt) {
+    char id[W1_ID_SIZE], seen[W1_MAX_MASTERS + 1][PATH_MAX];
+    const char *p = conf->w1;
+    struct w1_sensor *s;
+    sigset_t all, old;
+    size_t len;
+    int err;
+
+    memset(w, 0, sizeof(*w));
+    w->wake = -1;
+    w->cnt = cnt;
+    while(*p) {
+        p += strspn(p, " ,\t");
+        if((len = strcspn(p, " ,\t")) == 0)
+            break;
+        snprintf(id, sizeof(id), "%.*s", (int) len, p);
+        p += len;
+        if(w->nsensors == W1_MAX_SENSORS) {
+            fprintf(stderr, "At most %d 1-Wire sensors are supported, '%s' is left out.\n", W1_MAX_SENSORS, id);
+            continue;
+        }
+        s = &w->sensors[w->nsensors];
+        snprintf(s->path, sizeof(s->path), "%s/bus/w1/devices/%s/temperature", conf->sysfs, id);
+        if((s->fd = open(s->path, O_RDONLY | O_CLOEXEC)) < 0) {
+            snprintf(s->path, sizeof(s->path), "%s/bus/w1/devices/%s/w1_slave", conf->sysfs, id);
+            s->fd = open(s->path, O_RDONLY | O_CLOEXEC);
+        }
+        if(s->fd < 0) {
+            fprintf(stderr, "Unable to open 1-Wire sensor '%s'.\n", id);
+            continue;
+        }
+        add_master(w, conf, id, seen);
+        w->nsensors++;
+    }
+    if(w->nsensors == 0) {
+        w1_close(w);
+        return -1;
+    }
+
+    w->interval_ms = conf->w1_interval_s ? conf->w1_interval_s * 1000ull : 1000;
+    w->fresh_ms = 2 * w->interval_ms + W1_CONVERT_MS;
+    w->stale_ms = conf->w1_stale_s * 1000ull;
+    if(w->stale_ms <= w->fresh_ms)
+        w->stale_ms = w->fresh_ms + w->interval_ms;
+
+    // Signals stay with the control thread.
+    if((w->wake = eventfd(0, EFD_CLOEXEC)) < 0) {
+        perror("Unable to create the 1-Wire wake-up");
+        w1_close(w);
+        return -1;
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(&w->worker, NULL, worker, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(err != 0) {
+        fprintf(stderr, "Unable to start the 1-Wire worker.\n");
+        w1_close(w);
+        return -1;
+    }
+    w->running = 1;
+    dfprintf("%d 1-Wire sensors on %d bulk converting masters, read every %lu ms.\n", w->nsensors, w->nmasters, w->interval_ms);
+    return 0;
+}
+
+/*
+ * The latest reading of a sensor as seen from the tick. Up to 'fresh_ms' it counts in full.
+ * After that, a reading above the fast sensors ('base') slides linearly toward them until
+ * 'stale_ms', so an old peak neither holds the fan up nor drops out all at once. Returns -1
+ * while there is no reading or it is stale.
+ * */
+int w1_temp(const struct w1_sensors *w, int i, uint64_t now_ms, double base, double *temp) {
+    uint64_t slot = __atomic_load_n(&w->sensors[i].slot, __ATOMIC_ACQUIRE);
+    uint32_t age = (uint32_t) now_ms - (uint32_t) slot;
+    double t, weight;
+
+    if(slot == 0 || age >= w->stale_ms)
+        return -1;
+    t = (int32_t)(slot >> 32) / 1000.0;
+    weight = age <= w->fresh_ms ? 1.0 : (double)(w->stale_ms - age) / (w->stale_ms - w->fresh_ms);
+    *temp = t > base ? base + weight * (t - base) : t;
+    return 0;
+}
+
+/*
+ * Parks the worker during a deep sleep, so it neither converts nor wakes until it is resumed.
+ * Its last readings age out meanwhile.
+ * */
+void w1_park(struct w1_sensors *w, int parked) {
+    uint64_t one = 1;
+
+    if(!w->running)
+        return;
+    __atomic_store_n(&w->parked, parked, __ATOMIC_RELEASE);
+    if(write(w->wake, &one, sizeof(one)) != sizeof(one))
+        perror("Unable to wake the 1-Wire worker");
+}
+
+void w1_close(struct w1_sensors *w) {
+    uint64_t one = 1;
+
+    __atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+    if(w->running && write(w->wake, &one, sizeof(one)) == sizeof(one))
+        pthread_join(w->worker, NULL);
+    w->running = 0;
+    w->stop = 0;
+    w->parked = 0;
+    for(int i = 0; i < w->nsensors; i++) {
+        if(w->sensors[i].fd >= 0)
+            close(w->sensors[i].fd);
+    }
+    for(int m = 0; m < w->nmasters; m++) {
+        if(w->masters[m] >= 0)
+            close(w->masters[m]);
+    }
+    if(w->wake >= 0)
+        close(w->wake);
+    w->wake = -1;
+    w->nsensors = 0;
+    w->nmasters = 0;
+}
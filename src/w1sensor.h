@@ -0,0 +1,56 @@
+/*
+ *  file: w1sensor.h
+ *
+ *  Slow sensors, 1-Wire DS18B20 class thermometers behind the w1 sysfs interface. A read
+ *  blocks for the whole conversion (about 750 ms at 12 bits), so they are never read from the
+ *  tick. A worker thread triggers the conversions of every bus master at once through
+ *  'therm_bulk_read' where the kernel has it, waits the conversion out, reads the results and
+ *  publishes each of them with its time in a lock-free slot: a single 64 bit word holding the
+ *  millidegrees and the millisecond it was taken. The tick only loads that word.
+ *
+ *  An aging reading loses weight against the fast sensors, see w1_temp().
+ *
+ * */
+
+#ifndef RPIFAN_W1SENSOR_H
+#define RPIFAN_W1SENSOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "conf.h"
+#include "stats.h"
+
+#define W1_MAX_SENSORS 4
+#define W1_MAX_MASTERS 2
+#define W1_PATH_SIZE (CONF_LINE_SIZE + 128)
+#define W1_ID_SIZE 64
+#define W1_CONVERT_MS 750           // Conversion time of a DS18B20 at 12 bits.
+
+struct w1_sensor {
+    char path[W1_PATH_SIZE];        // 'temperature', or 'w1_slave' on older kernels.
+    int fd;
+    uint64_t slot;                  // Millidegrees << 32 | monotonic ms, 0 before the first read.
+};
+
+struct w1_sensors {
+    struct w1_sensor sensors[W1_MAX_SENSORS];
+    int nsensors;
+    int masters[W1_MAX_MASTERS];    // 'therm_bulk_read' of each bus master.
+    int nmasters;
+    uint64_t interval_ms;
+    uint64_t fresh_ms, stale_ms;    // Full weight up to fresh, none from stale on.
+    struct counters *cnt;           // The worker counts its failed reads in a shard of its own.
+    int wake;                       // Eventfd that stops, parks or resumes the worker.
+    int stop;
+    int parked;                     // No conversions during a deep sleep.
+    int running;
+    pthread_t worker;
+};
+
+int w1_open(struct w1_sensors *w, const struct fan_conf *conf, struct counters *cnt);
+int w1_temp(const struct w1_sensors *w, int i, uint64_t now_ms, double base, double *temp);
+void w1_park(struct w1_sensors *w, int parked);
+void w1_close(struct w1_sensors *w);
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ *  file: wheel.c
+ *
+ *  Hierarchical timer wheel with slack based coalescing.
+ *
+ * */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(struct wheel *w) {
+    memset(w, 0, sizeof(*w));
+}
+
+static int level_of(const struct wheel *w, uint64_t when) {
+    int level = (63 - __builtin_clzll(when ^ w->now)) / WHEEL_BITS;
+
+    return level < WHEEL_LEVELS ? level : WHEEL_LEVELS - 1;
+}
+
+// Expiry of a timer that fires in [from, to], walking only the slots that cover it.
+static int find_when(const struct wheel *w, uint64_t from, uint64_t to, uint64_t *when) {
+    const struct wtimer *t;
+    uint64_t x = from;
+    int level;
+
+    while(x <= to) {
+        level = level_of(w, x);
+        for(t = w->slots[level][(x >> (level * WHEEL_BITS)) & WHEEL_MASK]; t != NULL; t = t->next) {
+            if(t->when >= from && t->when <= to) {
+                *when = t->when;
+                return 1;
+            }
+        }
+        x = ((x >> (level * WHEEL_BITS)) + 1) << (level * WHEEL_BITS);
+    }
+    return 0;
+}
+
+/*
+ * Time within [due, due + slack] to fire at. A wake-up that is already planned in there is
+ * shared, otherwise the latest point is rounded down to the largest power of two not above
+ * slack + 1. The rounding takes at most slack ms, so the result never precedes the due time.
+ * */
+static uint64_t coalesce(const struct wheel *w, uint64_t due, uint64_t slack) {
+    uint64_t g, when;
+
+    if(slack == 0)
+        return due;
+    if(due > w->now && find_when(w, due, due + slack, &when))
+        return when;
+    g = 1ull << (63 - __builtin_clzll(slack + 1));
+    return (due + slack) & ~(g - 1);
+}
+
+static void place(struct wheel *w, struct wtimer *t) {
+    struct wtimer **head;
+    int level;
+
+    if(t->when <= w->now) {
+        head = &w->expired;
+    } else {
+        level = level_of(w, t->when);
+        head = &w->slots[level][(t->when >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    }
+    t->next = *head;
+    *head = t;
+}
+
+// Schedules the timer to fire first at 'due', then every interval if it has one.
+void wheel_add(struct wheel *w, struct wtimer *t, uint64_t due) {
+    t->due = due;
+    t->when = coalesce(w, due, t->slack);
+    place(w, t);
+}
+
+// Unlinks the timer from wherever it waits. Rare, so the lists are simply searched.
+static int unlink_from(struct wtimer **head, const struct wtimer *t) {
+    for(; *head != NULL; head = &(*head)->next) {
+        if(*head == t) {
+            *head = t->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Removes a timer that was added, it does not fire any more until it is added again.
+void wheel_del(struct wheel *w, struct wtimer *t) {
+    if(unlink_from(&w->expired, t))
+        return;
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        for(int i = 0; i < WHEEL_SLOTS; i++) {
+            if(unlink_from(&w->slots[level][i], t))
+                return;
+        }
+    }
+}
+
+// Earliest time a timer fires. Returns 0 when there is no timer.
+int wheel_next(const struct wheel *w, uint64_t *when) {
+    const struct wtimer *t, *slot;
+    int idx;
+
+    if(w->expired != NULL) {
+        *when = w->now;
+        return 1;
+    }
+
+    // Any timer on a lower level fires before all of the higher ones.
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        idx = (w->now >> (level * WHEEL_BITS)) & WHEEL_MASK;
+        for(int i = 1; i <= (level == WHEEL_LEVELS - 1 ? WHEEL_SLOTS : WHEEL_MASK - idx); i++) {
+            if((slot = w->slots[level][(idx + i) & WHEEL_MASK]) == NULL)
+                continue;
+            *when = slot->when;
+            for(t = slot->next; t != NULL; t = t->next) {
+                if(t->when < *when)
+                    *when = t->when;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void fire(struct wheel *w, struct wtimer *t) {
+    t->fired++;
+    w->fired++;
+    if(t->interval) {
+        // Periods that were missed entirely are skipped, the phase is kept.
+        t->due += t->interval;
+        if(t->due <= w->now)
+            t->due += ((w->now - t->due) / t->interval + 1) * t->interval;
+        t->when = coalesce(w, t->due, t->slack);
+        place(w, t);
+    }
+    t->fn(t, t->ctx);
+}
+
+/*
+ * Advances the wheel to 'now' and fires every timer that is due by then. Slots the time has
+ * passed on each level are emptied, and their timers either fire or move to a lower level.
+ * Returns the amount of timers fired.
+ * */
+int wheel_run(struct wheel *w, uint64_t now) {
+    struct wtimer *list = w->expired, *t, *next;
+    uint64_t from, to, fired = w->fired;
+
+    w->expired = NULL;
+    if(now < w->now)
+        now = w->now;
+
+    for(int level = 0; level < WHEEL_LEVELS; level++) {
+        from = w->now >> (level * WHEEL_BITS);
+        to = now >> (level * WHEEL_BITS);
+        if(from == to)
+            break;
+        for(uint64_t i = 1; i <= to - from && i <= WHEEL_SLOTS; i++) {
+            for(t = w->slots[level][(from + i) & WHEEL_MASK]; t != NULL; t = next) {
+                next = t->next;
+                t->next = list;
+                list = t;
+            }
+            w->slots[level][(from + i) & WHEEL_MASK] = NULL;
+        }
+    }
+    w->now = now;
+
+    for(t = list; t != NULL; t = next) {
+        next = t->next;
+        if(t->when <= now)
+            fire(w, t);
+        else
+            place(w, t);
+    }
+
+    if(w->fired != fired)
+        w->wakeups++;
+    return w->fired - fired;
+}
@@ -0,0 +1,57 @@
+/*
+ *  file: wheel.h
+ *
+ *  Hierarchical timer wheel of the periodic tasks of the adaptive process: the control tick,
+ *  slow sensors and housekeeping. All of them run under one timerfd, which is always armed
+ *  for the earliest timer, or disarmed when there is none.
+ *
+ *  Time is in milliseconds since the wheel was created. Level L has 64 slots of 64^L ms; a
+ *  timer sits on the level of the highest bit in which its expiry differs from the current
+ *  time and moves down as the time approaches it.
+ *
+ *  Every timer may fire up to 'slack' ms late. When another timer already fires within that
+ *  window, it fires together with it. Otherwise its expiry is rounded down to the coarsest
+ *  power of two multiple that still lies within the slack, so timers whose windows overlap
+ *  tend to land on the same instant. Either way they share one wake-up.
+ *
+ * */
+
+#ifndef RPIFAN_WHEEL_H
+#define RPIFAN_WHEEL_H
+
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 6      // 64^6 ms, about two years.
+
+struct wtimer;
+typedef void (*wtimer_fn)(struct wtimer *t, void *ctx);
+
+struct wtimer {
+    struct wtimer *next;
+    uint64_t due;           // Earliest time of the current period.
+    uint64_t when;          // Time it fires, within [due, due + slack].
+    uint64_t interval;      // Period, 0 for a one-shot timer.
+    uint64_t slack;
+    uint32_t id;
+    wtimer_fn fn;
+    void *ctx;
+    uint64_t fired;
+};
+
+struct wheel {
+    uint64_t now;
+    struct wtimer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    struct wtimer *expired;         // Added with an expiry in the past.
+    uint64_t wakeups;               // Runs that fired at least one timer.
+    uint64_t fired;
+};
+
+void wheel_init(struct wheel *w);
+void wheel_add(struct wheel *w, struct wtimer *t, uint64_t due);
+void wheel_del(struct wheel *w, struct wtimer *t);
+int wheel_next(const struct wheel *w, uint64_t *when);
+int wheel_run(struct wheel *w, uint64_t now);
+
+#endif